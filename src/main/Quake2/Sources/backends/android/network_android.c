@@ -24,6 +24,10 @@
  * =======================================================================
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1 /* recvmmsg() and sendmmsg() */
+#endif
+
 #include "common/common.h"
 
 #ifndef __USE_POSIX
@@ -49,6 +53,24 @@ netadr_t net_local_adr;
 #define MAX_LOOPBACK 4
 #define QUAKE2MCAST "ff12::666"
 
+#ifdef __linux__
+ #define NET_MMSG /* recvmmsg() and sendmmsg() are available */
+ #define NET_EPOLL /* NET_Sleep() waits with epoll and a timerfd */
+#endif
+
+#ifdef NET_EPOLL
+ #include <sys/epoll.h>
+ #include <sys/timerfd.h>
+
+ #define NET_WATCH_STDIN 0
+ #define NET_WATCH_IP 1
+ #define NET_WATCH_IP6 2
+ #define NET_MAXWATCHED 3
+#endif
+
+#define NET_RECVBATCH 32
+#define NET_SENDBATCH 64
+
 typedef struct
 {
 	byte data[MAX_MSGLEN];
@@ -67,6 +89,48 @@ int ip6_sockets[2];
 int ipx_sockets[2];
 char *multicast_interface = NULL;
 
+#ifdef NET_MMSG
+/* Packets received by one recvmmsg() call and not yet
+   handed out by NET_GetPacket(). One per socket. */
+typedef struct
+{
+	byte data[NET_RECVBATCH][MAX_MSGLEN];
+	struct sockaddr_storage from[NET_RECVBATCH];
+	int length[NET_RECVBATCH];
+	qboolean truncated[NET_RECVBATCH];
+	int get, count;
+} netrecvbatch_t;
+
+static netrecvbatch_t net_recvBatches[2][3];
+
+/* Packets held back by NET_SendPacket() between
+   NET_BeginPacketBatch() and NET_FlushPackets() */
+typedef struct
+{
+	int socket;
+	netadr_t to;
+	struct sockaddr_storage addr;
+	int addr_size;
+	int length;
+	byte data[MAX_MSGLEN];
+} netqueued_t;
+
+static netqueued_t net_sendQueue[NET_SENDBATCH];
+static int net_numQueued;
+static qboolean net_queueing[2];
+#endif
+
+#ifdef NET_EPOLL
+static int net_epoll = -1;
+static int net_timer = -1;
+static qboolean net_epollFailed;
+static int net_watched[NET_MAXWATCHED]; /* fd registered for each slot, or -1 */
+#endif
+
+/* how much later than asked for NET_Sleep() returned */
+static int net_sleeps;
+static long long net_sleepLate, net_sleepMaxLate; /* in microseconds */
+
 int NET_Socket(char *net_interface, int port, netsrc_t type, int family);
 char* NET_ErrorString(void);
 
@@ -186,8 +250,31 @@ void SockadrToNetadr(struct sockaddr_storage *s, netadr_t *a)
 	}
 }
 
+static void NET_SleepStats_f(void)
+{
+	if (!net_sleeps)
+	{
+		Com_Printf("NET_Sleep wasn't called.\n");
+		return;
+	}
+
+	Com_Printf("%i sleeps with %s, %lli us late on average, %lli us at most\n",
+		net_sleeps,
+#ifdef NET_EPOLL
+		(net_epoll != -1) ? "epoll" : "select",
+#else
+		"select",
+#endif
+		net_sleepLate / net_sleeps, net_sleepMaxLate);
+
+	net_sleeps = 0;
+	net_sleepLate = 0;
+	net_sleepMaxLate = 0;
+}
+
 void NET_Init()
 {
+	Cmd_AddCommand("net_sleepstats", NET_SleepStats_f);
 }
 
 qboolean NET_CompareAdr(netadr_t a, netadr_t b)
@@ -503,6 +590,171 @@ void NET_SendLoopPacket(netsrc_t sock, int length, void *data, netadr_t to)
 	loop->msgs[i].datalen = length;
 }
 
+#ifdef NET_MMSG
+/*
+ * Reads as many packets from a socket as there are
+ * with a single syscall. Returns the number read.
+ */
+static int NET_RecvBatch(int net_socket, netrecvbatch_t *batch)
+{
+	struct mmsghdr msgs[NET_RECVBATCH];
+	struct iovec iovs[NET_RECVBATCH];
+	int ret;
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < NET_RECVBATCH; i++)
+	{
+		iovs[i].iov_base = batch->data[i];
+		iovs[i].iov_len = MAX_MSGLEN;
+		msgs[i].msg_hdr.msg_name = &batch->from[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(batch->from[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	batch->get = 0;
+	batch->count = 0;
+
+	ret = recvmmsg(net_socket, msgs, NET_RECVBATCH, MSG_DONTWAIT, NULL);
+
+	if (ret == -1)
+	{
+		if ((errno != EWOULDBLOCK) && (errno != ECONNREFUSED))
+		{
+			Com_Printf("NET_GetPacket: %s\n", NET_ErrorString());
+		}
+
+		return 0;
+	}
+
+	for (i = 0; i < ret; i++)
+	{
+		batch->length[i] = msgs[i].msg_len;
+		batch->truncated[i] = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+	}
+
+	batch->count = ret;
+
+	return ret;
+}
+
+qboolean NET_GetPacket(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_message)
+{
+	netrecvbatch_t *batch;
+	int net_socket;
+	int protocol;
+	int i;
+
+	if (NET_GetLoopPacket(sock, net_from, net_message))
+	{
+		return true;
+	}
+
+	for (protocol = 0; protocol < 3; protocol++)
+	{
+		if (protocol == 0)
+		{
+			net_socket = ip_sockets[sock];
+		}
+		else
+		if (protocol == 1)
+		{
+			net_socket = ip6_sockets[sock];
+		}
+		else
+		{
+			net_socket = ipx_sockets[sock];
+		}
+
+		if (!net_socket)
+		{
+			continue;
+		}
+
+		batch = &net_recvBatches[sock][protocol];
+
+		while ((batch->get < batch->count) ||
+			   NET_RecvBatch(net_socket, batch))
+		{
+			i = batch->get++;
+
+			SockadrToNetadr(&batch->from[i], net_from);
+
+			if (batch->truncated[i] || (batch->length[i] >= net_message->maxsize))
+			{
+				Com_Printf("Oversize packet from %s\n", NET_AdrToString(*net_from));
+				continue;
+			}
+
+			memcpy(net_message->data, batch->data[i], batch->length[i]);
+			net_message->cursize = batch->length[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Sends the queued packets, one sendmmsg() for each
+ * run of packets that go out through the same socket.
+ */
+static void NET_SendQueued(void)
+{
+	struct mmsghdr msgs[NET_SENDBATCH];
+	struct iovec iovs[NET_SENDBATCH];
+	netqueued_t *q;
+	int start, n;
+	int ret;
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < net_numQueued; i++)
+	{
+		q = &net_sendQueue[i];
+
+		iovs[i].iov_base = q->data;
+		iovs[i].iov_len = q->length;
+		msgs[i].msg_hdr.msg_name = &q->addr;
+		msgs[i].msg_hdr.msg_namelen = q->addr_size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (start = 0; start < net_numQueued; start += n)
+	{
+		q = &net_sendQueue[start];
+
+		for (n = 1; start + n < net_numQueued; n++)
+		{
+			if (q[n].socket != q->socket)
+			{
+				break;
+			}
+		}
+
+		ret = sendmmsg(q->socket, msgs + start, n, 0);
+
+		if (ret == -1)
+		{
+			/* the first one failed, go on after it */
+			Com_Printf("NET_SendPacket ERROR: %s to %s\n", NET_ErrorString(),
+				NET_AdrToString(q->to));
+			n = 1;
+		}
+		else if (ret > 0)
+		{
+			/* the rest is tried again, to get their error */
+			n = ret;
+		}
+	}
+
+	net_numQueued = 0;
+}
+#else
 qboolean NET_GetPacket(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_message)
 {
 	int ret;
@@ -570,6 +822,31 @@ qboolean NET_GetPacket(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_message
 
 	return false;
 }
+#endif
+
+/*
+ * From now on, NET_SendPacket() collects the packets sent from
+ * sock and NET_FlushPackets() sends them with as few syscalls
+ * as possible. The server does this for its client messages.
+ */
+void NET_BeginPacketBatch(netsrc_t sock)
+{
+#ifdef NET_MMSG
+	net_queueing[sock] = true;
+#endif
+}
+
+void NET_FlushPackets(netsrc_t sock)
+{
+#ifdef NET_MMSG
+	net_queueing[sock] = false;
+
+	if (net_numQueued)
+	{
+		NET_SendQueued();
+	}
+#endif
+}
 
 void NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to)
 {
@@ -710,6 +987,33 @@ void NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to)
 		}
 	}
 
+#ifdef NET_MMSG
+	if (net_queueing[sock] && (length <= MAX_MSGLEN))
+	{
+		netqueued_t *q;
+
+		if (net_numQueued == NET_SENDBATCH)
+		{
+			NET_SendQueued();
+		}
+
+		q = &net_sendQueue[net_numQueued++];
+		q->socket = net_socket;
+		q->to = to;
+		q->addr = addr;
+		q->addr_size = addr_size;
+		q->length = length;
+		memcpy(q->data, data, length);
+		return;
+	}
+
+	/* keep the order */
+	if (net_numQueued)
+	{
+		NET_SendQueued();
+	}
+#endif
+
 	ret = sendto(net_socket,
 			data,
 			length,
@@ -765,6 +1069,23 @@ void NET_Config(qboolean multiplayer)
 
 	if (!multiplayer)
 	{
+#ifdef NET_MMSG
+		/* nothing to send or receive through anymore */
+		net_numQueued = 0;
+		memset(net_queueing, 0, sizeof(net_queueing));
+
+		for (i = 0; i < 2; i++)
+		{
+			int protocol;
+
+			for (protocol = 0; protocol < 3; protocol++)
+			{
+				net_recvBatches[i][protocol].get = 0;
+				net_recvBatches[i][protocol].count = 0;
+			}
+		}
+#endif
+
 		/* shut down any existing sockets */
 		for (i = 0; i < 2; i++)
 		{
@@ -786,6 +1107,13 @@ void NET_Config(qboolean multiplayer)
 				ipx_sockets[i] = 0;
 			}
 		}
+
+#ifdef NET_EPOLL
+		/* closing removed them from the epoll
+		   set, the numbers may come back */
+		net_watched[NET_WATCH_IP] = -1;
+		net_watched[NET_WATCH_IP6] = -1;
+#endif
 	}
 	else
 	{
@@ -967,15 +1295,135 @@ char* NET_ErrorString(void)
 	return strerror(code);
 }
 
+#ifdef NET_EPOLL
 /*
- * sleeps msec or until net socket is ready
+ * Makes the epoll set wait for fd in the given slot,
+ * -1 waits for nothing. Sets are kept across frames,
+ * so this only costs a syscall if something changed.
  */
-void NET_Sleep(int msec)
+static void NET_Watch(int slot, int fd)
+{
+	struct epoll_event event;
+
+	if (net_watched[slot] == fd)
+	{
+		return;
+	}
+
+	if (net_watched[slot] != -1)
+	{
+		epoll_ctl(net_epoll, EPOLL_CTL_DEL, net_watched[slot], NULL);
+	}
+
+	if (fd != -1)
+	{
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+
+		/* fails for regular files as stdin, those aren't waited for */
+		epoll_ctl(net_epoll, EPOLL_CTL_ADD, fd, &event);
+	}
+
+	net_watched[slot] = fd;
+}
+
+static qboolean NET_InitEpoll(void)
+{
+	struct epoll_event event;
+	int i;
+
+	net_epoll = epoll_create1(EPOLL_CLOEXEC);
+	net_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = net_timer;
+
+	if ((net_epoll == -1) || (net_timer == -1) ||
+		(epoll_ctl(net_epoll, EPOLL_CTL_ADD, net_timer, &event) == -1))
+	{
+		Com_Printf("NET_Sleep: %s, using select()\n", NET_ErrorString());
+
+		if (net_epoll != -1)
+		{
+			close(net_epoll);
+			net_epoll = -1;
+		}
+
+		if (net_timer != -1)
+		{
+			close(net_timer);
+			net_timer = -1;
+		}
+
+		net_epollFailed = true;
+		return false;
+	}
+
+	for (i = 0; i < NET_MAXWATCHED; i++)
+	{
+		net_watched[i] = -1;
+	}
+
+	return true;
+}
+
+/*
+ * The timerfd wakes us up at the exact nanosecond,
+ * epoll_wait()'s own timeout is only a safety net.
+ */
+static qboolean NET_EpollSleep(int usec, qboolean packets)
+{
+	struct epoll_event events[NET_MAXWATCHED + 1];
+	struct itimerspec deadline;
+	extern qboolean stdin_active;
+	uint64_t expirations;
+
+	if ((net_epoll == -1) && (net_epollFailed || !NET_InitEpoll()))
+	{
+		return false;
+	}
+
+	NET_Watch(NET_WATCH_STDIN, stdin_active ? 0 : -1);
+	NET_Watch(NET_WATCH_IP, (packets && ip_sockets[NS_SERVER]) ? ip_sockets[NS_SERVER] : -1);
+	NET_Watch(NET_WATCH_IP6, (packets && ip6_sockets[NS_SERVER]) ? ip6_sockets[NS_SERVER] : -1);
+
+	if (usec <= 0)
+	{
+		epoll_wait(net_epoll, events, NET_MAXWATCHED + 1, 0);
+		return true;
+	}
+
+	memset(&deadline, 0, sizeof(deadline));
+	deadline.it_value.tv_sec = usec / 1000000;
+	deadline.it_value.tv_nsec = (usec % 1000000) * 1000;
+	timerfd_settime(net_timer, 0, &deadline, NULL);
+
+	epoll_wait(net_epoll, events, NET_MAXWATCHED + 1, usec / 1000 + 1);
+
+	/* nothing happens if it hasn't expired */
+	if (read(net_timer, &expirations, sizeof(expirations)) == -1)
+	{
+		memset(&deadline, 0, sizeof(deadline));
+		timerfd_settime(net_timer, 0, &deadline, NULL);
+	}
+
+	return true;
+}
+#endif
+
+/*
+ * sleeps usec, or until a packet arrives if packets is set
+ */
+void NET_Sleep(int usec, qboolean packets)
 {
 	struct timeval timeout;
 	fd_set fdset;
 	extern cvar_t *dedicated;
 	extern qboolean stdin_active;
+	long long start, late;
+	int maxfd;
 
 	if ((!ip_sockets[NS_SERVER] &&
 	     !ip6_sockets[NS_SERVER]) || (dedicated && !dedicated->value))
@@ -983,17 +1431,49 @@ void NET_Sleep(int msec)
 		return; /* we're not a server, just run full speed */
 	}
 
+	start = Sys_Microseconds();
+
+#ifdef NET_EPOLL
+	if (NET_EpollSleep(usec, packets))
+	{
+		goto slept;
+	}
+#endif
+
 	FD_ZERO(&fdset);
+	maxfd = 0;
 
 	if (stdin_active)
 	{
 		FD_SET(0, &fdset); /* stdin is processed too */
 	}
 
-	FD_SET(ip_sockets[NS_SERVER], &fdset); /* IPv4 network socket */
-	FD_SET(ip6_sockets[NS_SERVER], &fdset); /* IPv6 network socket */
-	timeout.tv_sec = msec / 1000;
-	timeout.tv_usec = (msec % 1000) * 1000;
-	select(MAX(ip_sockets[NS_SERVER],
-			ip6_sockets[NS_SERVER]) + 1, &fdset, NULL, NULL, &timeout);
+	if (packets)
+	{
+		FD_SET(ip_sockets[NS_SERVER], &fdset); /* IPv4 network socket */
+		FD_SET(ip6_sockets[NS_SERVER], &fdset); /* IPv6 network socket */
+		maxfd = MAX(ip_sockets[NS_SERVER], ip6_sockets[NS_SERVER]);
+	}
+
+	timeout.tv_sec = usec / 1000000;
+	timeout.tv_usec = usec % 1000000;
+	select(maxfd + 1, &fdset, NULL, NULL, &timeout);
+
+#ifdef NET_EPOLL
+slept:
+#endif
+	/* waking up early because of a packet is fine */
+	late = Sys_Microseconds() - start - usec;
+
+	if (late > 0)
+	{
+		net_sleepLate += late;
+
+		if (late > net_sleepMaxLate)
+		{
+			net_sleepMaxLate = late;
+		}
+	}
+
+	net_sleeps++;
 }
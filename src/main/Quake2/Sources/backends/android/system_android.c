@@ -42,11 +42,14 @@
 #include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <termios.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 //#include "SDL/SDLWrapper.h"
 
@@ -361,6 +364,94 @@ int Sys_Milliseconds()
 	return curtime;
 }
 
+long long Sys_Microseconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Threads, mutexes and semaphores for background jobs.
+ */
+typedef struct
+{
+	int (*function)(void *);
+	void *data;
+} sysThreadStart_t;
+
+static void* Sys_ThreadStart(void *arg)
+{
+	sysThreadStart_t start = *(sysThreadStart_t *)arg;
+
+	free(arg);
+	start.function(start.data);
+
+	return NULL;
+}
+
+void* Sys_CreateThread(int (*function)(void *), void *data)
+{
+	pthread_t *thread;
+	sysThreadStart_t *start;
+
+	thread = malloc(sizeof(pthread_t));
+	start = malloc(sizeof(sysThreadStart_t));
+	start->function = function;
+	start->data = data;
+
+	if (pthread_create(thread, NULL, Sys_ThreadStart, start) != 0)
+	{
+		free(start);
+		free(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+void* Sys_CreateMutex()
+{
+	pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+
+	pthread_mutex_init(mutex, NULL);
+
+	return mutex;
+}
+
+void Sys_LockMutex(void *mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+void Sys_UnlockMutex(void *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+void* Sys_CreateSemaphore(int value)
+{
+	sem_t *sem = malloc(sizeof(sem_t));
+
+	sem_init(sem, 0, value);
+
+	return sem;
+}
+
+void Sys_SemWait(void *sem)
+{
+	while ((sem_wait(sem) != 0) && (errno == EINTR))
+	{
+	}
+}
+
+void Sys_SemPost(void *sem)
+{
+	sem_post(sem);
+}
+
 void Sys_RedirectStdout()
 {
 	if (!logFileEnabled)
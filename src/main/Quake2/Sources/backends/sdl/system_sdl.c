@@ -50,6 +50,61 @@ int Sys_Milliseconds()
 	return curtime;
 }
 
+long long Sys_Microseconds(void)
+{
+	static Uint64 frequency;
+	Uint64 counter;
+
+	if (!frequency)
+	{
+		frequency = SDL_GetPerformanceFrequency();
+	}
+
+	counter = SDL_GetPerformanceCounter();
+
+	/* split so the multiplication can't overflow */
+	return (long long)((counter / frequency) * 1000000 +
+			(counter % frequency) * 1000000 / frequency);
+}
+
+/*
+ * Threads, mutexes and semaphores for background jobs.
+ */
+void* Sys_CreateThread(int (*function)(void *), void *data)
+{
+	return SDL_CreateThread(function, "quake2", data);
+}
+
+void* Sys_CreateMutex()
+{
+	return SDL_CreateMutex();
+}
+
+void Sys_LockMutex(void *mutex)
+{
+	SDL_LockMutex(mutex);
+}
+
+void Sys_UnlockMutex(void *mutex)
+{
+	SDL_UnlockMutex(mutex);
+}
+
+void* Sys_CreateSemaphore(int value)
+{
+	return SDL_CreateSemaphore(value);
+}
+
+void Sys_SemWait(void *sem)
+{
+	SDL_SemWait(sem);
+}
+
+void Sys_SemPost(void *sem)
+{
+	SDL_SemPost(sem);
+}
+
 void Sys_RedirectStdout()
 {
 	if (!logFileEnabled)
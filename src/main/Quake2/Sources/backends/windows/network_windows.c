@@ -788,6 +788,19 @@ void NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to)
 
 /* ============================================================================= */
 
+/*
+ * Packets are always sent right away here.
+ */
+void NET_BeginPacketBatch(netsrc_t sock)
+{
+}
+
+void NET_FlushPackets(netsrc_t sock)
+{
+}
+
+/* ============================================================================= */
+
 int NET_IPSocket(char *net_interface, int port, netsrc_t type, int family)
 {
 	char Buf[BUFSIZ], *Host, *Service;
@@ -1194,10 +1207,10 @@ void NET_Config(qboolean multiplayer)
 }
 
 /*
- * sleeps msec or until
- * net socket is ready
+ * sleeps usec, or until a packet
+ * arrives if packets is set
  */
-void NET_Sleep(int msec)
+void NET_Sleep(int usec, qboolean packets)
 {
 	struct timeval timeout;
 	fd_set fdset;
@@ -1209,6 +1222,13 @@ void NET_Sleep(int msec)
 		return; /* we're not a server, just run full speed */
 	}
 
+	/* select() doesn't take an empty set */
+	if (!packets)
+	{
+		Sleep(usec / 1000);
+		return;
+	}
+
 	FD_ZERO(&fdset);
 	i = 0;
 
@@ -1234,8 +1254,8 @@ void NET_Sleep(int msec)
 		}
 	}
 
-	timeout.tv_sec = msec / 1000;
-	timeout.tv_usec = (msec % 1000) * 1000;
+	timeout.tv_sec = usec / 1000000;
+	timeout.tv_usec = usec % 1000000;
 	i = max(ip_sockets[NS_SERVER], ip6_sockets[NS_SERVER]);
 	i = max(i, ipx_sockets[NS_SERVER]);
 	select(i + 1, &fdset, NULL, NULL, &timeout);
@@ -26,6 +26,10 @@
 
 #include "client/client.h"
 
+#ifdef ZIP
+ #include "zlib.h"
+#endif
+
 extern cvar_t *allow_download;
 extern cvar_t *allow_download_players;
 extern cvar_t *allow_download_models;
@@ -47,6 +51,13 @@ static const char *env_suf[6] = { "rt", "bk", "lf", "ft", "up", "dn" };
 #define ENV_CNT (CS_PLAYERSKINS + MAX_CLIENTS * PLAYER_MULT)
 #define TEXTURE_CNT (ENV_CNT + 13)
 
+#ifdef ZIP
+/* windowed download, see SV_SendDownloadChunks */
+static int dl_stream; /* id of the last stream asked for */
+static int dl_position; /* bytes of the file written */
+static qboolean dl_ack; /* a chunk arrived since the last clc_dlack */
+#endif
+
 void CL_RequestNextDownload(void)
 {
 	unsigned int map_checksum; /* for detecting cheater maps */
@@ -418,6 +429,40 @@ void CL_RequestNextDownload(void)
 	MSG_WriteString(&cls.netchan.message, va("begin %i\n", precache_spawncount));
 }
 
+/*
+ * Asks the server for cls.downloadname, starting at offset.
+ */
+static void CL_RequestDownload(int offset)
+{
+	MSG_WriteByte(&cls.netchan.message, clc_stringcmd);
+
+#ifdef ZIP
+	/* svc_dlchunk would end up in the demo */
+	if ((cls.protocolext & PROTOCOL_EXT_DLSTREAM) && !cls.demorecording)
+	{
+		/* a new id, so chunks of the last file are ignored */
+		dl_stream = (dl_stream % 255) + 1;
+		dl_position = offset;
+		dl_ack = false;
+
+		MSG_WriteString(&cls.netchan.message, va("download %s %i %i",
+			cls.downloadname, offset, dl_stream));
+		return;
+	}
+#endif
+
+	if (offset)
+	{
+		MSG_WriteString(&cls.netchan.message, va("download %s %i",
+			cls.downloadname, offset));
+	}
+	else
+	{
+		MSG_WriteString(&cls.netchan.message, va("download %s",
+			cls.downloadname));
+	}
+}
+
 void CL_DownloadFileName(char *dest, int destlen, char *fn)
 {
 	#if 0
@@ -486,14 +531,12 @@ qboolean CL_CheckOrDownloadFile(char *filename)
 
 		/* give the server an offset to start the download */
 		Com_Printf("Resuming %s\n", cls.downloadname);
-		MSG_WriteByte(&cls.netchan.message, clc_stringcmd);
-		MSG_WriteString(&cls.netchan.message, va("download %s %i", cls.downloadname, len));
+		CL_RequestDownload(len);
 	}
 	else
 	{
 		Com_Printf("Downloading %s\n", cls.downloadname);
-		MSG_WriteByte(&cls.netchan.message, clc_stringcmd);
-		MSG_WriteString(&cls.netchan.message, va("download %s", cls.downloadname));
+		CL_RequestDownload(0);
 	}
 
 	cls.downloadnumber++;
@@ -538,20 +581,69 @@ void CL_Download_f(void)
 	COM_StripExtension(cls.downloadname, cls.downloadtempname);
 	strcat(cls.downloadtempname, ".tmp");
 
-	MSG_WriteByte(&cls.netchan.message, clc_stringcmd);
-	MSG_WriteString(&cls.netchan.message, va("download %s", cls.downloadname));
+	CL_RequestDownload(0);
 
 	cls.downloadnumber++;
 }
 
+/*
+ * Opens the temp file of a new download.
+ */
+static qboolean CL_OpenDownloadFile(void)
+{
+	char name[MAX_OSPATH];
+
+	CL_DownloadFileName(name, sizeof(name), cls.downloadtempname);
+
+	FS_CreatePath(name);
+
+	cls.download = fopen(name, "wb");
+
+	if (!cls.download)
+	{
+		Com_Printf("Failed to open %s\n", cls.downloadtempname);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Renames the complete download and goes on with the next one.
+ */
+static void CL_FinishDownload(void)
+{
+	char oldn[MAX_OSPATH];
+	char newn[MAX_OSPATH];
+	int r;
+
+	fclose(cls.download);
+
+	/* rename the temp file to it's final name */
+	CL_DownloadFileName(oldn, sizeof(oldn), cls.downloadtempname);
+	CL_DownloadFileName(newn, sizeof(newn), cls.downloadname);
+	r = rename(oldn, newn);
+
+	if (r)
+	{
+		Com_Printf("failed to rename.\n");
+	}
+
+	FS_FlushNegativeCache();
+
+	cls.download = NULL;
+	cls.downloadpercent = 0;
+
+	/* get another file if needed */
+	CL_RequestNextDownload();
+}
+
 /*
  * A download message has been received from the server
  */
 void CL_ParseDownload(void)
 {
 	int size, percent;
-	char name[MAX_OSPATH];
-	int r;
 
 	/* read the data */
 	size = MSG_ReadShort(&net_message);
@@ -576,16 +668,9 @@ void CL_ParseDownload(void)
 	/* open the file if not opened yet */
 	if (!cls.download)
 	{
-		CL_DownloadFileName(name, sizeof(name), cls.downloadtempname);
-
-		FS_CreatePath(name);
-
-		cls.download = fopen(name, "wb");
-
-		if (!cls.download)
+		if (!CL_OpenDownloadFile())
 		{
 			net_message.readcount += size;
-			Com_Printf("Failed to open %s\n", cls.downloadtempname);
 			CL_RequestNextDownload();
 			return;
 		}
@@ -604,25 +689,109 @@ void CL_ParseDownload(void)
 	}
 	else
 	{
-		char oldn[MAX_OSPATH];
-		char newn[MAX_OSPATH];
+		CL_FinishDownload();
+	}
+}
+
+/*
+ * A chunk of a windowed download has been received. Only the
+ * one that continues the file is written, the server goes back
+ * to the position in the acks if some got lost.
+ */
+void CL_ParseDownloadChunk(void)
+{
+#ifdef ZIP
+	static byte data[MAX_DLCHUNKSIZE];
+	uLongf unpacked;
+	byte *chunk;
+	int stream;
+	int offset;
+	int length;
+	int size;
+	int percent;
+
+	stream = MSG_ReadByte(&net_message);
+	offset = MSG_ReadLong(&net_message);
+	length = MSG_ReadShort(&net_message);
+	size = MSG_ReadShort(&net_message);
+	percent = MSG_ReadByte(&net_message);
+
+	chunk = net_message.data + net_message.readcount;
+	net_message.readcount += size ? size : length;
+
+	if ((length < 0) || (length > MAX_DLCHUNKSIZE) || (size < 0) ||
+	    (net_message.readcount > net_message.cursize))
+	{
+		Com_Error(ERR_DROP, "CL_ParseDownloadChunk: Bad size\n");
+	}
 
-		fclose(cls.download);
+	if (!dl_stream || (stream != dl_stream))
+	{
+		return; /* left over from an earlier download */
+	}
 
-		/* rename the temp file to it's final name */
-		CL_DownloadFileName(oldn, sizeof(oldn), cls.downloadtempname);
-		CL_DownloadFileName(newn, sizeof(newn), cls.downloadname);
-		r = rename(oldn, newn);
+	/* even duplicates are acked, the server may have missed it */
+	dl_ack = true;
 
-		if (r)
+	if (offset != dl_position)
+	{
+		return;
+	}
+
+	if (size)
+	{
+		unpacked = length;
+
+		if ((uncompress(data, &unpacked, chunk, size) != Z_OK) ||
+		    ((int)unpacked != length))
 		{
-			Com_Printf("failed to rename.\n");
+			Com_Error(ERR_DROP, "CL_ParseDownloadChunk: Bad data\n");
 		}
 
-		cls.download = NULL;
-		cls.downloadpercent = 0;
+		chunk = data;
+	}
 
-		/* get another file if needed */
-		CL_RequestNextDownload();
+	/* open the file if not opened yet */
+	if (!cls.download)
+	{
+		if (!CL_OpenDownloadFile())
+		{
+			dl_stream = 0;
+			CL_RequestNextDownload();
+			return;
+		}
+	}
+
+	fwrite(chunk, 1, length, cls.download);
+	dl_position += length;
+
+	if (percent != 100)
+	{
+		cls.downloadpercent = percent;
 	}
+	else
+	{
+		CL_FinishDownload();
+	}
+#endif
+}
+
+/*
+ * Tells the server how much of the windowed download
+ * is written, if anything arrived since the last time.
+ */
+void CL_WriteDownloadAck(sizebuf_t *buf)
+{
+#ifdef ZIP
+	if (!dl_stream || !dl_ack)
+	{
+		return;
+	}
+
+	MSG_WriteByte(buf, clc_dlack);
+	MSG_WriteByte(buf, dl_stream);
+	MSG_WriteLong(buf, dl_position);
+
+	dl_ack = false;
+#endif
 }
@@ -605,11 +605,13 @@ void CL_SendCmd()
 
 	if (cls.state == ca_connected)
 	{
-		if (cls.netchan.message.cursize ||
+		SZ_Init(&buf, data, sizeof(data));
+		CL_WriteDownloadAck(&buf);
+
+		if (buf.cursize || cls.netchan.message.cursize ||
 		    (curtime - cls.netchan.last_sent > 100))
 		{
-			byte zero_data = 0;
-			Netchan_Transmit(&cls.netchan, 0, &zero_data);
+			Netchan_Transmit(&cls.netchan, buf.cursize, buf.data);
 		}
 
 		return;
@@ -633,6 +635,8 @@ void CL_SendCmd()
 		SCR_FinishCinematic();
 	}
 
+	CL_WriteDownloadAck(&buf);
+
 	/* begin a client move command */
 	MSG_WriteByte(&buf, clc_move);
 
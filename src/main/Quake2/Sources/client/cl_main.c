@@ -133,6 +133,14 @@ void CL_Stop_f()
 	fclose(cls.demofile);
 	cls.demofile = NULL;
 	cls.demorecording = false;
+
+	/* the server may use the protocol extensions again */
+	if (cls.protocolext && (cls.state >= ca_connected))
+	{
+		MSG_WriteByte(&cls.netchan.message, clc_stringcmd);
+		MSG_WriteString(&cls.netchan.message, "recording 0");
+	}
+
 	Com_Printf("Stopped demo.\n");
 }
 
@@ -185,6 +193,15 @@ void CL_Record_f()
 	/* don't start saving messages until a non-delta compressed message is received */
 	cls.demowaiting = true;
 
+	/* stock clients play back neither blocks longer than
+	   MAX_MSGLEN nor svc_zpacket, so ask the server for
+	   whole packets of plain messages */
+	if (cls.protocolext)
+	{
+		MSG_WriteByte(&cls.netchan.message, clc_stringcmd);
+		MSG_WriteString(&cls.netchan.message, "recording 1");
+	}
+
 	/* write out messages to hold the startup information */
 	SZ_Init(&buf, buf_data, sizeof(buf_data));
 
@@ -337,6 +354,8 @@ void CL_ClearState()
 	memset(&cl, 0, sizeof(cl));
 	memset(&cl_entities, 0, sizeof(cl_entities));
 
+	FS_PreloadClear();
+
 	SZ_Clear(&cls.netchan.message);
 }
 
@@ -613,6 +632,7 @@ void CL_WriteConfiguration()
 	fclose(f);
 
 	Cvar_WriteVariables(path);
+	FS_FlushNegativeCache();
 }
 
 typedef struct
@@ -764,14 +784,14 @@ void CL_Frame(int msec)
 	/* update the screen */
 	if (host_speeds->value)
 	{
-		time_before_ref = Sys_Milliseconds();
+		time_before_ref = Sys_Microseconds();
 	}
 
 	SCR_UpdateScreen();
 
 	if (host_speeds->value)
 	{
-		time_after_ref = Sys_Milliseconds();
+		time_after_ref = Sys_Microseconds();
 	}
 
 	/* update audio */
@@ -82,6 +82,11 @@ void CL_ForwardToServer_f(void)
  */
 void CL_Drop(void)
 {
+	/* an error inside a svc_zpacket leaves net_message
+	   on the unpacked data, packets must not go there */
+	net_message.data = net_message_buffer;
+	net_message.maxsize = sizeof(net_message_buffer);
+
 	if (cls.state == ca_uninitialized)
 	{
 		return;
@@ -128,8 +133,9 @@ void CL_SendConnectPacket(void)
 
 	userinfo_modified = false;
 
-	Netchan_OutOfBandPrint(NS_CLIENT, adr, "connect %i %i %i \"%s\"\n",
-		PROTOCOL_VERSION, port, cls.challenge, Cvar_Userinfo());
+	Netchan_OutOfBandPrint(NS_CLIENT, adr, "connect %i %i %i \"%s\" %i\n",
+		PROTOCOL_VERSION, port, cls.challenge, Cvar_Userinfo(),
+		PROTOCOL_EXTENSIONS);
 }
 
 /*
@@ -563,6 +569,11 @@ void CL_ConnectionlessPacket(void)
 
 		Netchan_Setup(NS_CLIENT, &cls.netchan, net_from, cls.quakePort);
 
+		/* old servers don't accept any extensions */
+		cls.protocolext = (int)strtol(Cmd_Argv(1), (char **)NULL, 10) &
+		                  PROTOCOL_EXTENSIONS;
+		cls.netchan.fragments = (cls.protocolext & PROTOCOL_EXT_FRAGMENT) != 0;
+
 		MSG_WriteChar(&cls.netchan.message, clc_stringcmd);
 		MSG_WriteString(&cls.netchan.message, "new");
 		cls.state = ca_connected;
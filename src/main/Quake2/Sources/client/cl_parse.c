@@ -26,8 +26,13 @@
 
 #include "client/client.h"
 
+#ifdef ZIP
+ #include "zlib.h"
+#endif
+
 void CL_DownloadFileName(char *dest, int destlen, char *fn);
 void CL_ParseDownload(void);
+void CL_ParseDownloadChunk(void);
 
 int bitcounts[32]; /* just for protocol profiling */
 
@@ -55,7 +60,9 @@ char *svc_strings[256] =
 	"svc_playerinfo",
 	"svc_packetentities",
 	"svc_deltapacketentities",
-	"svc_frame"
+	"svc_frame",
+	"svc_zpacket",
+	"svc_dlchunk"
 };
 
 void CL_RegisterSounds(void)
@@ -136,141 +143,7 @@ int CL_ParseEntityBits(unsigned *bits)
  */
 void CL_ParseDelta(entity_state_t *from, entity_state_t *to, int number, int bits)
 {
-	/* set everything to the state we are delta'ing from */
-	*to = *from;
-
-	VectorCopy(from->origin, to->old_origin);
-	to->number = number;
-
-	if (bits & U_MODEL)
-	{
-		to->modelindex = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_MODEL2)
-	{
-		to->modelindex2 = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_MODEL3)
-	{
-		to->modelindex3 = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_MODEL4)
-	{
-		to->modelindex4 = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_FRAME8)
-	{
-		to->frame = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_FRAME16)
-	{
-		to->frame = MSG_ReadShort(&net_message);
-	}
-
-	/* used for laser colors */
-	if ((bits & U_SKIN8) && (bits & U_SKIN16))
-	{
-		to->skinnum = MSG_ReadLong(&net_message);
-	}
-	else
-	if (bits & U_SKIN8)
-	{
-		to->skinnum = MSG_ReadByte(&net_message);
-	}
-	else
-	if (bits & U_SKIN16)
-	{
-		to->skinnum = MSG_ReadShort(&net_message);
-	}
-
-	if ((bits & (U_EFFECTS8 | U_EFFECTS16)) == (U_EFFECTS8 | U_EFFECTS16))
-	{
-		to->effects = MSG_ReadLong(&net_message);
-	}
-	else
-	if (bits & U_EFFECTS8)
-	{
-		to->effects = MSG_ReadByte(&net_message);
-	}
-	else
-	if (bits & U_EFFECTS16)
-	{
-		to->effects = MSG_ReadShort(&net_message);
-	}
-
-	if ((bits & (U_RENDERFX8 | U_RENDERFX16)) == (U_RENDERFX8 | U_RENDERFX16))
-	{
-		to->renderfx = MSG_ReadLong(&net_message);
-	}
-	else
-	if (bits & U_RENDERFX8)
-	{
-		to->renderfx = MSG_ReadByte(&net_message);
-	}
-	else
-	if (bits & U_RENDERFX16)
-	{
-		to->renderfx = MSG_ReadShort(&net_message);
-	}
-
-	if (bits & U_ORIGIN1)
-	{
-		to->origin[0] = MSG_ReadCoord(&net_message);
-	}
-
-	if (bits & U_ORIGIN2)
-	{
-		to->origin[1] = MSG_ReadCoord(&net_message);
-	}
-
-	if (bits & U_ORIGIN3)
-	{
-		to->origin[2] = MSG_ReadCoord(&net_message);
-	}
-
-	if (bits & U_ANGLE1)
-	{
-		to->angles[0] = MSG_ReadAngle(&net_message);
-	}
-
-	if (bits & U_ANGLE2)
-	{
-		to->angles[1] = MSG_ReadAngle(&net_message);
-	}
-
-	if (bits & U_ANGLE3)
-	{
-		to->angles[2] = MSG_ReadAngle(&net_message);
-	}
-
-	if (bits & U_OLDORIGIN)
-	{
-		MSG_ReadPos(&net_message, to->old_origin);
-	}
-
-	if (bits & U_SOUND)
-	{
-		to->sound = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_EVENT)
-	{
-		to->event = MSG_ReadByte(&net_message);
-	}
-	else
-	{
-		to->event = 0;
-	}
-
-	if (bits & U_SOLID)
-	{
-		to->solid = MSG_ReadShort(&net_message);
-	}
+	MSG_ReadDeltaEntity(&net_message, from, to, number, bits);
 }
 
 /*
@@ -1035,6 +908,51 @@ void CL_ParseClientinfo(int player)
 	CL_LoadClientinfo(ci, s);
 }
 
+/*
+ * Starts reading the file behind a configstring in the background,
+ * while the rest of the connection sequence goes on.
+ */
+static void CL_PreloadConfigString(int i)
+{
+	char *s = cl.configstrings[i];
+	char name[MAX_QPATH];
+
+	if ((i >= CS_MODELS) && (i < CS_MODELS + MAX_MODELS))
+	{
+		if ((s[0] != '*') && (s[0] != '#'))
+		{
+			FS_PreloadFile(s);
+		}
+	}
+	else
+	if ((i >= CS_SOUNDS) && (i < CS_SOUNDS + MAX_SOUNDS))
+	{
+		if (s[0] == '#')
+		{
+			FS_PreloadFile(s + 1);
+		}
+		else
+		if (s[0] != '*')
+		{
+			Com_sprintf(name, sizeof(name), "sound/%s", s);
+			FS_PreloadFile(name);
+		}
+	}
+	else
+	if ((i >= CS_IMAGES) && (i < CS_IMAGES + MAX_IMAGES))
+	{
+		if ((s[0] == '/') || (s[0] == '\\'))
+		{
+			FS_PreloadFile(s + 1);
+		}
+		else
+		{
+			Com_sprintf(name, sizeof(name), "pics/%s.pcx", s);
+			FS_PreloadFile(name);
+		}
+	}
+}
+
 void CL_ParseConfigString(void)
 {
 	int i, length;
@@ -1060,6 +978,11 @@ void CL_ParseConfigString(void)
 
 	strcpy(cl.configstrings[i], s);
 
+	if (!cl.refresh_prepped && s[0])
+	{
+		CL_PreloadConfigString(i);
+	}
+
 	/* do something apropriate */
 	if ((i >= CS_LIGHTS) && (i < CS_LIGHTS + MAX_LIGHTSTYLES))
 	{
@@ -1220,24 +1143,23 @@ void SHOWNET(char *s)
 	}
 }
 
-void CL_ParseServerMessage(void)
+#ifdef ZIP
+static void CL_ParseZPacket(void);
+#endif
+
+/*
+ * Parses the messages in net_message, zpacket is
+ * true while in the unpacked data of a svc_zpacket.
+ */
+/* the message has commands stock clients can't read */
+static qboolean cl_extendedmessage;
+
+static void CL_ParseServerCommands(qboolean zpacket)
 {
 	int cmd;
 	char *s;
 	int i;
 
-	/* if recording demos, copy the message out */
-	if (cl_shownet->value == 1)
-	{
-		Com_Printf("%i ", net_message.cursize);
-	}
-	else
-	if (cl_shownet->value >= 2)
-	{
-		Com_Printf("------------------\n");
-	}
-
-	/* parse the message */
 	while (1)
 	{
 		if (net_message.readcount > net_message.cursize)
@@ -1350,6 +1272,24 @@ void CL_ParseServerMessage(void)
 			CL_ParseDownload();
 			break;
 
+#ifdef ZIP
+		case svc_zpacket:
+
+			if (zpacket)
+			{
+				Com_Error(ERR_DROP, "CL_ParseServerMessage: Nested svc_zpacket\n");
+			}
+
+			cl_extendedmessage = true;
+			CL_ParseZPacket();
+			break;
+
+		case svc_dlchunk:
+			cl_extendedmessage = true;
+			CL_ParseDownloadChunk();
+			break;
+#endif
+
 		case svc_frame:
 			CL_ParseFrame();
 			break;
@@ -1370,6 +1310,68 @@ void CL_ParseServerMessage(void)
 			break;
 		}
 	}
+}
+
+#ifdef ZIP
+/*
+ * Unpacks a svc_zpacket and parses the messages in it
+ * as if they had been sent one after another.
+ */
+static void CL_ParseZPacket(void)
+{
+	static byte data[MAX_ZPACKETSIZE];
+	sizebuf_t packet;
+	uLongf length;
+	int size;
+	int unpacked;
+
+	size = MSG_ReadShort(&net_message);
+	unpacked = MSG_ReadShort(&net_message);
+
+	if ((size <= 0) || (unpacked <= 0) || (unpacked > (int)sizeof(data)) ||
+	    (net_message.readcount + size > net_message.cursize))
+	{
+		Com_Error(ERR_DROP, "CL_ParseZPacket: Bad size\n");
+	}
+
+	length = unpacked;
+
+	if ((uncompress(data, &length, net_message.data + net_message.readcount,
+			size) != Z_OK) || ((int)length != unpacked))
+	{
+		Com_Error(ERR_DROP, "CL_ParseZPacket: Bad data\n");
+	}
+
+	net_message.readcount += size;
+
+	/* the parsers all read from net_message. If one of
+	   them errors out, CL_Drop puts it back on its buffer */
+	packet = net_message;
+	SZ_Init(&net_message, data, sizeof(data));
+	net_message.cursize = unpacked;
+
+	CL_ParseServerCommands(true);
+
+	net_message = packet;
+}
+#endif
+
+void CL_ParseServerMessage(void)
+{
+	/* if recording demos, copy the message out */
+	if (cl_shownet->value == 1)
+	{
+		Com_Printf("%i ", net_message.cursize);
+	}
+	else
+	if (cl_shownet->value >= 2)
+	{
+		Com_Printf("------------------\n");
+	}
+
+	/* parse the message */
+	cl_extendedmessage = false;
+	CL_ParseServerCommands(false);
 
 	CL_AddNetgraph();
 
@@ -1377,6 +1379,15 @@ void CL_ParseServerMessage(void)
 	   until after we have parsed the frame */
 	if (cls.demorecording && !cls.demowaiting)
 	{
-		CL_WriteDemoMessage();
+		if ((net_message.cursize - 8 > MAX_MSGLEN) || cl_extendedmessage)
+		{
+			/* sent before the server saw our "recording 1",
+			   start over with the next uncompressed frame */
+			cls.demowaiting = true;
+		}
+		else
+		{
+			CL_WriteDemoMessage();
+		}
 	}
 }
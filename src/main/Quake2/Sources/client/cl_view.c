@@ -344,6 +344,9 @@ void CL_PrepRefresh(void)
 	/* the renderer can now free unneeded stuff */
 	R_EndRegistration();
 
+	/* whatever wasn't used by now won't be */
+	FS_PreloadClear();
+
 	/* clear any lines of console text */
 	Con_ClearNotify();
 
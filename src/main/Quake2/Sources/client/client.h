@@ -229,6 +229,7 @@ typedef struct
 	int serverProtocol; /* in case we are doing some kind of version hack */
 
 	int challenge; /* from the server to use for connecting */
+	int protocolext; /* PROTOCOL_EXT_* bits the server accepted */
 
 	FILE *download; /* file transfer from server */
 	char downloadtempname[MAX_OSPATH];
@@ -437,6 +438,7 @@ void CL_GetChallengePacket();
 void CL_PingServers_f();
 void CL_Snd_Restart_f();
 void CL_RequestNextDownload();
+void CL_WriteDownloadAck(sizebuf_t *buf);
 
 typedef struct
 {
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 1997-2001 Id Software, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Bit sets of clusters and areas, like the rows of the PVS and PHS.
+ * Whole sets are processed 16 bytes at a time, with SSE2 or NEON if
+ * available, so their buffers must be padded to BITSET_BYTES.
+ *
+ * =======================================================================
+ */
+
+#ifndef CO_BITSET_H
+#define CO_BITSET_H
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+ #include <emmintrin.h>
+ #define BITSET_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+ #include <arm_neon.h>
+ #define BITSET_NEON
+#endif
+
+/* size of a set of the given number of bits, padded to 16 bytes */
+#define BITSET_BYTES(bits) ((((bits) + 127) >> 7) << 4)
+
+static inline qboolean Bitset_Test(const byte *set, int bit)
+{
+	return (set[bit >> 3] & (1 << (bit & 7))) != 0;
+}
+
+/*
+ * True if any of the bits in the list is set.
+ */
+static inline qboolean Bitset_TestAny(const byte *set, const int *bits, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+	{
+		if (set[bits[i] >> 3] & (1 << (bits[i] & 7)))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * dst |= src, bytes must be a multiple of 16.
+ */
+static inline void Bitset_Or(byte *dst, const byte *src, int bytes)
+{
+	int i;
+
+#if defined(BITSET_SSE2)
+	for (i = 0; i < bytes; i += 16)
+	{
+		_mm_storeu_si128((__m128i *)(dst + i),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(dst + i)),
+				_mm_loadu_si128((const __m128i *)(src + i))));
+	}
+#elif defined(BITSET_NEON)
+	for (i = 0; i < bytes; i += 16)
+	{
+		vst1q_u8(dst + i, vorrq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+	}
+#else
+	/* bytewise, the sets may not be aligned */
+	for (i = 0; i < bytes; i++)
+	{
+		dst[i] |= src[i];
+	}
+#endif
+}
+
+#endif
@@ -26,27 +26,36 @@
  * =======================================================================
  */
 
+#include <ctype.h>
+
 #include "common/common.h"
 
 #define MAX_ALIAS_NAME 32
 #define ALIAS_LOOP_COUNT 16
 
+#define CMD_HASHSIZE 256 /* Must be a power of two. */
+
 typedef struct cmd_function_s
 {
 	struct cmd_function_s *next;
+	struct cmd_function_s *hashNext; /* Next command in the same hash bucket. */
 	char *name;
 	xcommand_t function;
 } cmd_function_t;
 
 static cmd_function_t *cmd_functions; /* possible commands to execute */
+static cmd_function_t *cmd_hash[CMD_HASHSIZE];
 
 typedef struct cmdalias_s
 {
 	struct cmdalias_s *next;
+	struct cmdalias_s *hashNext; /* Next alias in the same hash bucket. */
 	char name[MAX_ALIAS_NAME];
 	char *value;
 } cmdalias_t;
 
+static cmdalias_t *cmd_aliasHash[CMD_HASHSIZE];
+
 char retval[256];
 int alias_count; /* for detecting runaway loops */
 cmdalias_t *cmd_alias;
@@ -60,6 +69,60 @@ sizebuf_t cmd_text;
 byte cmd_text_buf[8192];
 char defer_text_buf[8192];
 
+/*
+ * Hashes a command, alias or cvar name. The hash is
+ * case insensitive, so it serves the case sensitive
+ * and the case insensitive lookups alike.
+ */
+unsigned Cmd_HashName(const char *name)
+{
+	unsigned hash = 0;
+
+	while (*name)
+	{
+		hash = hash * 31 + tolower((unsigned char)*name++);
+	}
+
+	return hash;
+}
+
+/*
+ * Finds a command, either exactly or ignoring the case
+ */
+static cmd_function_t* Cmd_FindCommand(const char *cmd_name, qboolean caseless)
+{
+	cmd_function_t *cmd;
+
+	cmd = cmd_hash[Cmd_HashName(cmd_name) & (CMD_HASHSIZE - 1)];
+
+	for ( ; cmd; cmd = cmd->hashNext)
+	{
+		if (caseless ? !Q_strcasecmp(cmd_name, cmd->name) : !strcmp(cmd_name, cmd->name))
+		{
+			return cmd;
+		}
+	}
+
+	return NULL;
+}
+
+static cmdalias_t* Cmd_FindAlias(const char *alias_name, qboolean caseless)
+{
+	cmdalias_t *a;
+
+	a = cmd_aliasHash[Cmd_HashName(alias_name) & (CMD_HASHSIZE - 1)];
+
+	for ( ; a; a = a->hashNext)
+	{
+		if (caseless ? !Q_strcasecmp(alias_name, a->name) : !strcmp(alias_name, a->name))
+		{
+			return a;
+		}
+	}
+
+	return NULL;
+}
+
 /*
  * Causes execution of the remainder of the command buffer to be delayed
  * until next frame.  This allows commands like: bind g "impulse 5 ;
@@ -425,24 +488,24 @@ void Cmd_Alias_f(void)
 	}
 
 	/* if the alias already exists, reuse it */
-	for (a = cmd_alias; a; a = a->next)
+	a = Cmd_FindAlias(s, false);
+
+	if (a)
 	{
-		if (!strcmp(s, a->name))
-		{
-			Z_Free(a->value);
-			break;
-		}
+		Z_Free(a->value);
 	}
-
-	if (!a)
+	else
 	{
+		unsigned hash = Cmd_HashName(s) & (CMD_HASHSIZE - 1);
+
 		a = Z_Malloc(sizeof(cmdalias_t));
+		strcpy(a->name, s);
 		a->next = cmd_alias;
 		cmd_alias = a;
+		a->hashNext = cmd_aliasHash[hash];
+		cmd_aliasHash[hash] = a;
 	}
 
-	strcpy(a->name, s);
-
 	/* copy the rest of the command line */
 	cmd[0] = 0; /* start out with a null string */
 	c = Cmd_Argc();
@@ -661,6 +724,7 @@ void Cmd_AddCommand(char *cmd_name, xcommand_t function)
 {
 	cmd_function_t *cmd;
 	cmd_function_t **pos;
+	unsigned hash;
 
 	/* fail if the command is a variable name */
 	if (Cvar_VariableString(cmd_name)[0])
@@ -669,13 +733,10 @@ void Cmd_AddCommand(char *cmd_name, xcommand_t function)
 	}
 
 	/* fail if the command already exists */
-	for (cmd = cmd_functions; cmd; cmd = cmd->next)
+	if (Cmd_FindCommand(cmd_name, false))
 	{
-		if (!strcmp(cmd_name, cmd->name))
-		{
-			Com_Printf("Cmd_AddCommand: %s already defined\n", cmd_name);
-			return;
-		}
+		Com_Printf("Cmd_AddCommand: %s already defined\n", cmd_name);
+		return;
 	}
 
 	cmd = Z_Malloc(sizeof(cmd_function_t));
@@ -690,6 +751,10 @@ void Cmd_AddCommand(char *cmd_name, xcommand_t function)
 	}
 	cmd->next = *pos;
 	*pos = cmd;
+
+	hash = Cmd_HashName(cmd->name) & (CMD_HASHSIZE - 1);
+	cmd->hashNext = cmd_hash[hash];
+	cmd_hash[hash] = cmd;
 }
 
 void Cmd_RemoveCommand(char *cmd_name)
@@ -711,6 +776,17 @@ void Cmd_RemoveCommand(char *cmd_name)
 		if (!strcmp(cmd_name, cmd->name))
 		{
 			*back = cmd->next;
+
+			/* and out of its hash bucket */
+			back = &cmd_hash[Cmd_HashName(cmd_name) & (CMD_HASHSIZE - 1)];
+
+			while (*back != cmd)
+			{
+				back = &(*back)->hashNext;
+			}
+
+			*back = cmd->hashNext;
+
 			Z_Free(cmd);
 			return;
 		}
@@ -721,17 +797,7 @@ void Cmd_RemoveCommand(char *cmd_name)
 
 qboolean Cmd_Exists(char *cmd_name)
 {
-	cmd_function_t *cmd;
-
-	for (cmd = cmd_functions; cmd; cmd = cmd->next)
-	{
-		if (!strcmp(cmd_name, cmd->name))
-		{
-			return true;
-		}
-	}
-
-	return false;
+	return Cmd_FindCommand(cmd_name, false) != NULL;
 }
 
 int qsort_strcomp(const void *s1, const void *s2)
@@ -756,28 +822,19 @@ char* Cmd_CompleteCommand(char *partial)
 	}
 
 	/* check for exact match */
-	for (cmd = cmd_functions; cmd; cmd = cmd->next)
+	if ((cmd = Cmd_FindCommand(partial, false)) != NULL)
 	{
-		if (!strcmp(partial, cmd->name))
-		{
-			return cmd->name;
-		}
+		return cmd->name;
 	}
 
-	for (a = cmd_alias; a; a = a->next)
+	if ((a = Cmd_FindAlias(partial, false)) != NULL)
 	{
-		if (!strcmp(partial, a->name))
-		{
-			return a->name;
-		}
+		return a->name;
 	}
 
-	for (cvar = cvar_vars; cvar; cvar = cvar->next)
+	if ((cvar = Cvar_FindVar(partial)) != NULL)
 	{
-		if (!strcmp(partial, cvar->name))
-		{
-			return cvar->name;
-		}
+		return cvar->name;
 	}
 
 	for (i = 0; i < 1024; i++)
@@ -864,36 +921,9 @@ char* Cmd_CompleteCommand(char *partial)
 
 qboolean Cmd_IsComplete(char *command)
 {
-	cmd_function_t *cmd;
-	cmdalias_t *a;
-	cvar_t *cvar;
-
 	/* check for exact match */
-	for (cmd = cmd_functions; cmd; cmd = cmd->next)
-	{
-		if (!strcmp(command, cmd->name))
-		{
-			return true;
-		}
-	}
-
-	for (a = cmd_alias; a; a = a->next)
-	{
-		if (!strcmp(command, a->name))
-		{
-			return true;
-		}
-	}
-
-	for (cvar = cvar_vars; cvar; cvar = cvar->next)
-	{
-		if (!strcmp(command, cvar->name))
-		{
-			return true;
-		}
-	}
-
-	return false;
+	return Cmd_FindCommand(command, false) || Cmd_FindAlias(command, false) ||
+		Cvar_FindVar(command);
 }
 
 /* ugly hack to suppress warnings from default.cfg in Key_Bind_f() */
@@ -922,38 +952,32 @@ void Cmd_ExecuteString(char *text)
 	}
 
 	/* check functions */
-	for (cmd = cmd_functions; cmd; cmd = cmd->next)
+	if ((cmd = Cmd_FindCommand(cmd_argv[0], true)) != NULL)
 	{
-		if (!Q_strcasecmp(cmd_argv[0], cmd->name))
+		if (!cmd->function)
 		{
-			if (!cmd->function)
-			{
-				/* forward to server command */
-				Cmd_ExecuteString(va("cmd %s", text));
-			}
-			else
-			{
-				cmd->function();
-			}
-
-			return;
+			/* forward to server command */
+			Cmd_ExecuteString(va("cmd %s", text));
 		}
+		else
+		{
+			cmd->function();
+		}
+
+		return;
 	}
 
 	/* check alias */
-	for (a = cmd_alias; a; a = a->next)
+	if ((a = Cmd_FindAlias(cmd_argv[0], true)) != NULL)
 	{
-		if (!Q_strcasecmp(cmd_argv[0], a->name))
+		if (++alias_count == ALIAS_LOOP_COUNT)
 		{
-			if (++alias_count == ALIAS_LOOP_COUNT)
-			{
-				Com_Printf("ALIAS_LOOP_COUNT\n");
-				return;
-			}
-
-			Cbuf_InsertText(a->value);
+			Com_Printf("ALIAS_LOOP_COUNT\n");
 			return;
 		}
+
+		Cbuf_InsertText(a->value);
+		return;
 	}
 
 	/* check cvars */
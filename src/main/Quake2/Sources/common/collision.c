@@ -27,9 +27,25 @@
 
 #include "common/common.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+ #include <emmintrin.h>
+ #define CM_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+ #include <arm_neon.h>
+ #define CM_NEON
+#endif
+
+/*
+ * The plane is copied into the node, so walking the tree
+ * doesn't go through a plane pointer at every step. Box
+ * hull nodes take dist from the planes of a trace context.
+ */
 typedef struct
 {
-	cplane_t *plane;
+	vec3_t normal;
+	float dist;
+	int type; /* PLANE_X, PLANE_Y and PLANE_Z are axial */
+	int boxplane; /* of box hull nodes, into the box planes */
 	int children[2]; /* negative numbers are leafs */
 } cnode_t;
 
@@ -53,9 +69,19 @@ typedef struct
 	int contents;
 	int numsides;
 	int firstbrushside;
-	int checkcount; /* to avoid repeated testings */
+	int firstsideblock; /* into cm_sideblocks, -1 if it has none */
 } cbrush_t;
 
+/*
+ * The planes of four sides of a brush, laid out for
+ * CM_SideDists4. A brush has (numsides + 3) / 4 blocks.
+ */
+typedef struct
+{
+	float normal[3][4];
+	float dist[4];
+} csideblock_t;
+
 typedef struct
 {
 	int numareaportals;
@@ -64,10 +90,42 @@ typedef struct
 	int floodvalid;
 } carea_t;
 
+/*
+ * Everything a trace needs besides the map, so that
+ * traces running at the same time don't get in each
+ * others way. Brushes are stamped with the checkcount
+ * of the context to avoid repeated testings.
+ */
+struct cmtrace_s
+{
+	trace_t trace;
+	vec3_t start, end;
+	vec3_t mins, maxs;
+	vec3_t extents;
+	int contents;
+	qboolean ispoint; /* optimized case */
+	qboolean simd; /* use the side blocks */
+	int checkcount;
+	int brushtraces;
+	cplane_t *boxplanes;
+	cplane_t ownplanes[12];
+	int brushchecks[MAX_MAP_BRUSHES];
+};
+
+typedef struct
+{
+	float *mins, *maxs;
+	int count, maxcount;
+	int *list;
+	int topnode;
+	cplane_t *boxplanes;
+} cleaflist_t;
+
 byte *cmod_base;
 byte map_visibility[MAX_MAP_VISIBILITY];
 byte pvsrow[MAX_MAP_LEAFS / 8];
 byte phsrow[MAX_MAP_LEAFS / 8];
+static const byte nullrow[MAX_MAP_LEAFS / 8]; /* Cluster -1, never written. */
 carea_t map_areas[MAX_MAP_AREAS];
 cbrush_t map_brushes[MAX_MAP_BRUSHES];
 cbrushside_t map_brushsides[MAX_MAP_BRUSHSIDES];
@@ -81,16 +139,12 @@ cnode_t map_nodes[MAX_MAP_NODES + 6]; /* extra for box hull */
 cplane_t *box_planes;
 cplane_t map_planes[MAX_MAP_PLANES + 6]; /* extra for box hull */
 cvar_t *map_noareas;
+cvar_t *cm_viscache;
 dareaportal_t map_areaportals[MAX_MAP_AREAPORTALS];
 dvis_t *map_vis = (dvis_t *)map_visibility;
 int box_headnode;
-int checkcount;
 int emptyleaf, solidleaf;
 int floodvalid;
-float *leaf_mins, *leaf_maxs;
-int leaf_count, leaf_maxcount;
-int *leaf_list;
-int leaf_topnode;
 int numareaportals;
 int numareas = 1;
 int numbrushes;
@@ -104,20 +158,45 @@ int numnodes;
 int numplanes;
 int numtexinfo;
 int numvisibility;
-int trace_contents;
 mapsurface_t map_surfaces[MAX_MAP_TEXINFO];
 mapsurface_t nullsurface;
 qboolean portalopen[MAX_MAP_AREAPORTALS];
-qboolean trace_ispoint; /* optimized case */
-trace_t trace_trace;
 unsigned short map_leafbrushes[MAX_MAP_LEAFBRUSHES];
-vec3_t trace_start, trace_end;
-vec3_t trace_mins, trace_maxs;
-vec3_t trace_extents;
+
+static cmtrace_t cm_trace; /* used by CM_BoxTrace */
+
+/* traces recorded with cm_tracecapture for cm_tracebench */
+#define CM_MAXCAPTURES 32768
+
+typedef struct
+{
+	vec3_t start, end;
+	vec3_t mins, maxs;
+	vec3_t origin, angles; /* for CM_TransformedBoxTrace */
+	vec3_t boxmins, boxmaxs; /* of the box hull at the time */
+	int headnode;
+	int brushmask;
+	qboolean transformed;
+} cmcapture_t;
+
+cvar_t *cm_tracecapture;
+cvar_t *cm_simd;
+static csideblock_t *cm_sideblocks;
+static cmcapture_t *cm_captures;
+static int cm_numcaptures;
+
+/* decompressed PVS rows of all clusters, followed by the PHS rows */
+static byte *cm_visrows;
+static int cm_visrowbytes;
+static int cm_viscachesize;
+static int cm_visdecompressed;
+
+int c_traces; /* also for the server telemetry */
 
 #ifndef DEDICATED_ONLY
 int c_pointcontents;
-int c_traces, c_brush_traces;
+int c_brush_traces;
+int c_cachedtraces; /* answered by the SV_Trace cache, not in c_traces */
 #endif
 
 /* 1/32 epsilon to keep floating point happy */
@@ -300,6 +379,27 @@ qboolean CM_HeadnodeVisible(int nodenum, byte *visbits)
 	return CM_HeadnodeVisible(node->children[1], visbits);
 }
 
+static void CM_InitBoxPlanes(cplane_t *planes)
+{
+	int i;
+	cplane_t *p;
+
+	for (i = 0; i < 6; i++)
+	{
+		p = &planes[i * 2];
+		p->type = i >> 1;
+		p->signbits = 0;
+		VectorClear(p->normal);
+		p->normal[i >> 1] = 1;
+
+		p = &planes[i * 2 + 1];
+		p->type = 3 + (i >> 1);
+		p->signbits = 0;
+		VectorClear(p->normal);
+		p->normal[i >> 1] = -1;
+	}
+}
+
 /*
  * Set up the planes and nodes so that the six floats of a bounding box
  * can just be stored out and get a proper clipping hull structure.
@@ -309,11 +409,11 @@ void CM_InitBoxHull(void)
 	int i;
 	int side;
 	cnode_t *c;
-	cplane_t *p;
 	cbrushside_t *s;
 
 	box_headnode = numnodes;
 	box_planes = &map_planes[numplanes];
+	cm_trace.boxplanes = box_planes;
 
 	if ((numnodes + 6 > MAX_MAP_NODES) ||
 	    (numbrushes + 1 > MAX_MAP_BRUSHES) ||
@@ -327,6 +427,7 @@ void CM_InitBoxHull(void)
 	box_brush = &map_brushes[numbrushes];
 	box_brush->numsides = 6;
 	box_brush->firstbrushside = numbrushsides;
+	box_brush->firstsideblock = -1; /* the planes change */
 	box_brush->contents = CONTENTS_MONSTER;
 
 	box_leaf = &map_leafs[numleafs];
@@ -336,6 +437,8 @@ void CM_InitBoxHull(void)
 
 	map_leafbrushes[numleafbrushes] = numbrushes;
 
+	CM_InitBoxPlanes(box_planes);
+
 	for (i = 0; i < 6; i++)
 	{
 		side = i & 1;
@@ -347,7 +450,10 @@ void CM_InitBoxHull(void)
 
 		/* nodes */
 		c = &map_nodes[box_headnode + i];
-		c->plane = map_planes + (numplanes + i * 2);
+		c->boxplane = i * 2;
+		VectorCopy(box_planes[i * 2].normal, c->normal);
+		c->dist = 0;
+		c->type = box_planes[i * 2].type;
 		c->children[side] = -1 - emptyleaf;
 
 		if (i != 5)
@@ -358,19 +464,6 @@ void CM_InitBoxHull(void)
 		{
 			c->children[side ^ 1] = -1 - numleafs;
 		}
-
-		/* planes */
-		p = &box_planes[i * 2];
-		p->type = i >> 1;
-		p->signbits = 0;
-		VectorClear(p->normal);
-		p->normal[i >> 1] = 1;
-
-		p = &box_planes[i * 2 + 1];
-		p->type = 3 + (i >> 1);
-		p->signbits = 0;
-		VectorClear(p->normal);
-		p->normal[i >> 1] = -1;
 	}
 }
 
@@ -378,42 +471,84 @@ void CM_InitBoxHull(void)
  * To keep everything totally uniform, bounding boxes are turned into
  * small BSP trees instead of being compared directly.
  */
-int CM_HeadnodeForBox(vec3_t mins, vec3_t maxs)
+int CM_HeadnodeForBoxContext(cmtrace_t *ctx, vec3_t mins, vec3_t maxs)
 {
-	box_planes[0].dist = maxs[0];
-	box_planes[1].dist = -maxs[0];
-	box_planes[2].dist = mins[0];
-	box_planes[3].dist = -mins[0];
-	box_planes[4].dist = maxs[1];
-	box_planes[5].dist = -maxs[1];
-	box_planes[6].dist = mins[1];
-	box_planes[7].dist = -mins[1];
-	box_planes[8].dist = maxs[2];
-	box_planes[9].dist = -maxs[2];
-	box_planes[10].dist = mins[2];
-	box_planes[11].dist = -mins[2];
+	cplane_t *planes = ctx->boxplanes;
+
+	planes[0].dist = maxs[0];
+	planes[1].dist = -maxs[0];
+	planes[2].dist = mins[0];
+	planes[3].dist = -mins[0];
+	planes[4].dist = maxs[1];
+	planes[5].dist = -maxs[1];
+	planes[6].dist = mins[1];
+	planes[7].dist = -mins[1];
+	planes[8].dist = maxs[2];
+	planes[9].dist = -maxs[2];
+	planes[10].dist = mins[2];
+	planes[11].dist = -mins[2];
+
+	/* the nodes hold the dists of the global box
+	   hull for the walks that don't take a context */
+	if (planes == box_planes)
+	{
+		int i;
+
+		for (i = 0; i < 6; i++)
+		{
+			map_nodes[box_headnode + i].dist = planes[i * 2].dist;
+		}
+	}
 
 	return box_headnode;
 }
 
+int CM_HeadnodeForBox(vec3_t mins, vec3_t maxs)
+{
+	return CM_HeadnodeForBoxContext(&cm_trace, mins, maxs);
+}
+
+/*
+ * A context for traces from another thread. It's allocated
+ * from the zone, so create and free it on the main thread.
+ * The box hull of the context is private, CM_PointContents
+ * only knows the one set up by CM_HeadnodeForBox.
+ */
+cmtrace_t* CM_CreateTraceContext(void)
+{
+	cmtrace_t *ctx;
+
+	ctx = Z_Malloc(sizeof(cmtrace_t));
+	ctx->boxplanes = ctx->ownplanes;
+	CM_InitBoxPlanes(ctx->boxplanes);
+
+	return ctx;
+}
+
+void CM_FreeTraceContext(cmtrace_t *ctx)
+{
+	if (ctx && (ctx != &cm_trace))
+	{
+		Z_Free(ctx);
+	}
+}
+
 int CM_PointLeafnum_r(vec3_t p, int num)
 {
 	float d;
 	cnode_t *node;
-	cplane_t *plane;
 
 	while (num >= 0)
 	{
 		node = map_nodes + num;
-		plane = node->plane;
 
-		if (plane->type < 3)
+		if (node->type < 3)
 		{
-			d = p[plane->type] - plane->dist;
+			d = p[node->type] - node->dist;
 		}
 		else
 		{
-			d = DotProduct(plane->normal, p) - plane->dist;
+			d = DotProduct(node->normal, p) - node->dist;
 		}
 
 		if (d < 0)
@@ -447,28 +582,89 @@ int CM_PointLeafnum(vec3_t p)
  * Fills in a list of all the leafs touched
  */
 
-void CM_BoxLeafnums_r(int nodenum)
+/*
+ * BOX_ON_PLANE_SIDE for a node
+ */
+static int CM_BoxOnNodeSide(float *mins, float *maxs, cnode_t *node, float dist)
+{
+	float dist1, dist2;
+	int i, sides;
+
+	if (node->type < 3)
+	{
+		if (dist <= mins[node->type])
+		{
+			return 1;
+		}
+
+		if (dist >= maxs[node->type])
+		{
+			return 2;
+		}
+
+		return 3;
+	}
+
+	/* the corners nearest and farthest along the normal */
+	dist1 = dist2 = 0;
+
+	for (i = 0; i < 3; i++)
+	{
+		if (node->normal[i] < 0)
+		{
+			dist1 += node->normal[i] * mins[i];
+			dist2 += node->normal[i] * maxs[i];
+		}
+		else
+		{
+			dist1 += node->normal[i] * maxs[i];
+			dist2 += node->normal[i] * mins[i];
+		}
+	}
+
+	sides = 0;
+
+	if (dist1 >= dist)
+	{
+		sides = 1;
+	}
+
+	if (dist2 < dist)
+	{
+		sides |= 2;
+	}
+
+	return sides;
+}
+
+static void CM_BoxLeafnums_r(cleaflist_t *ll, int nodenum)
 {
-	cplane_t *plane;
 	cnode_t *node;
+	float dist;
 	int s;
 
 	while (1)
 	{
 		if (nodenum < 0)
 		{
-			if (leaf_count >= leaf_maxcount)
+			if (ll->count >= ll->maxcount)
 			{
 				return;
 			}
 
-			leaf_list[leaf_count++] = -1 - nodenum;
+			ll->list[ll->count++] = -1 - nodenum;
 			return;
 		}
 
 		node = &map_nodes[nodenum];
-		plane = node->plane;
-		s = BOX_ON_PLANE_SIDE(leaf_mins, leaf_maxs, plane);
+		dist = node->dist;
+
+		if (nodenum >= box_headnode)
+		{
+			dist = ll->boxplanes[node->boxplane].dist;
+		}
+
+		s = CM_BoxOnNodeSide(ll->mins, ll->maxs, node, dist);
 
 		if (s == 1)
 		{
@@ -482,41 +678,44 @@ void CM_BoxLeafnums_r(int nodenum)
 		else
 		{
 			/* go down both */
-			if (leaf_topnode == -1)
+			if (ll->topnode == -1)
 			{
-				leaf_topnode = nodenum;
+				ll->topnode = nodenum;
 			}
 
-			CM_BoxLeafnums_r(node->children[0]);
+			CM_BoxLeafnums_r(ll, node->children[0]);
 			nodenum = node->children[1];
 		}
 	}
 }
 
-int CM_BoxLeafnums_headnode(vec3_t mins, vec3_t maxs, int *list, int listsize, int headnode, int *topnode)
+static int CM_BoxLeafnums_headnode(vec3_t mins, vec3_t maxs, int *list, int listsize, int headnode, int *topnode, cplane_t *boxplanes)
 {
-	leaf_list = list;
-	leaf_count = 0;
-	leaf_maxcount = listsize;
-	leaf_mins = mins;
-	leaf_maxs = maxs;
+	cleaflist_t ll;
 
-	leaf_topnode = -1;
+	ll.list = list;
+	ll.count = 0;
+	ll.maxcount = listsize;
+	ll.mins = mins;
+	ll.maxs = maxs;
+	ll.topnode = -1;
+	ll.boxplanes = boxplanes;
 
-	CM_BoxLeafnums_r(headnode);
+	CM_BoxLeafnums_r(&ll, headnode);
 
 	if (topnode)
 	{
-		*topnode = leaf_topnode;
+		*topnode = ll.topnode;
 	}
 
-	return leaf_count;
+	return ll.count;
 }
 
+/* Safe to call from any thread. */
 int CM_BoxLeafnums(vec3_t mins, vec3_t maxs, int *list, int listsize, int *topnode)
 {
 	return CM_BoxLeafnums_headnode(mins, maxs, list,
-		listsize, map_cmodels[0].headnode, topnode);
+		listsize, map_cmodels[0].headnode, topnode, box_planes);
 }
 
 int CM_PointContents(vec3_t p, int headnode)
@@ -564,68 +763,219 @@ int CM_TransformedPointContents(vec3_t p, int headnode, vec3_t origin, vec3_t an
 	return map_leafs[l].contents;
 }
 
-void CM_ClipBoxToBrush(vec3_t mins, vec3_t maxs, vec3_t p1, vec3_t p2, trace_t *trace, cbrush_t *brush)
+/*
+ * d1 and d2 of four brush sides for CM_ClipBoxToBrush, or only
+ * d1 for CM_TestBoxInBrush if d2 is NULL. The operations and
+ * their order are those of the scalar code, so the results are
+ * the same to the bit.
+ */
+static void CM_SideDists4(const csideblock_t *block, const float *mins,
+		const float *maxs, const float *p1, const float *p2,
+		qboolean ispoint, float *d1, float *d2)
 {
+#if defined(CM_SSE2)
+	__m128 nx, ny, nz, dist, neg, ofs, dot;
+
+	nx = _mm_loadu_ps(block->normal[0]);
+	ny = _mm_loadu_ps(block->normal[1]);
+	nz = _mm_loadu_ps(block->normal[2]);
+	dist = _mm_loadu_ps(block->dist);
+
+	if (!ispoint)
+	{
+		/* push the planes out for mins/maxs */
+		neg = _mm_cmplt_ps(nx, _mm_setzero_ps());
+		ofs = _mm_or_ps(_mm_and_ps(neg, _mm_set1_ps(maxs[0])),
+				_mm_andnot_ps(neg, _mm_set1_ps(mins[0])));
+		dot = _mm_mul_ps(ofs, nx);
+
+		neg = _mm_cmplt_ps(ny, _mm_setzero_ps());
+		ofs = _mm_or_ps(_mm_and_ps(neg, _mm_set1_ps(maxs[1])),
+				_mm_andnot_ps(neg, _mm_set1_ps(mins[1])));
+		dot = _mm_add_ps(dot, _mm_mul_ps(ofs, ny));
+
+		neg = _mm_cmplt_ps(nz, _mm_setzero_ps());
+		ofs = _mm_or_ps(_mm_and_ps(neg, _mm_set1_ps(maxs[2])),
+				_mm_andnot_ps(neg, _mm_set1_ps(mins[2])));
+		dot = _mm_add_ps(dot, _mm_mul_ps(ofs, nz));
+
+		dist = _mm_sub_ps(dist, dot);
+	}
+
+	dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p1[0]), nx),
+			_mm_mul_ps(_mm_set1_ps(p1[1]), ny)), _mm_mul_ps(_mm_set1_ps(p1[2]), nz));
+	_mm_storeu_ps(d1, _mm_sub_ps(dot, dist));
+
+	if (d2)
+	{
+		dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p2[0]), nx),
+				_mm_mul_ps(_mm_set1_ps(p2[1]), ny)), _mm_mul_ps(_mm_set1_ps(p2[2]), nz));
+		_mm_storeu_ps(d2, _mm_sub_ps(dot, dist));
+	}
+#elif defined(CM_NEON)
+	float32x4_t nx, ny, nz, dist, dot;
+	uint32x4_t neg;
+
+	nx = vld1q_f32(block->normal[0]);
+	ny = vld1q_f32(block->normal[1]);
+	nz = vld1q_f32(block->normal[2]);
+	dist = vld1q_f32(block->dist);
+
+	if (!ispoint)
+	{
+		/* push the planes out for mins/maxs, no fused
+		   multiply-add, the scalar code doesn't have it */
+		neg = vcltq_f32(nx, vdupq_n_f32(0));
+		dot = vmulq_f32(vbslq_f32(neg, vdupq_n_f32(maxs[0]), vdupq_n_f32(mins[0])), nx);
+
+		neg = vcltq_f32(ny, vdupq_n_f32(0));
+		dot = vaddq_f32(dot, vmulq_f32(vbslq_f32(neg, vdupq_n_f32(maxs[1]),
+				vdupq_n_f32(mins[1])), ny));
+
+		neg = vcltq_f32(nz, vdupq_n_f32(0));
+		dot = vaddq_f32(dot, vmulq_f32(vbslq_f32(neg, vdupq_n_f32(maxs[2]),
+				vdupq_n_f32(mins[2])), nz));
+
+		dist = vsubq_f32(dist, dot);
+	}
+
+	dot = vaddq_f32(vaddq_f32(vmulq_f32(vdupq_n_f32(p1[0]), nx),
+			vmulq_f32(vdupq_n_f32(p1[1]), ny)), vmulq_f32(vdupq_n_f32(p1[2]), nz));
+	vst1q_f32(d1, vsubq_f32(dot, dist));
+
+	if (d2)
+	{
+		dot = vaddq_f32(vaddq_f32(vmulq_f32(vdupq_n_f32(p2[0]), nx),
+				vmulq_f32(vdupq_n_f32(p2[1]), ny)), vmulq_f32(vdupq_n_f32(p2[2]), nz));
+		vst1q_f32(d2, vsubq_f32(dot, dist));
+	}
+#else
+	float dist;
+	vec3_t normal, ofs;
 	int i, j;
-	cplane_t *plane, *clipplane;
+
+	for (i = 0; i < 4; i++)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			normal[j] = block->normal[j][i];
+			ofs[j] = (normal[j] < 0) ? maxs[j] : mins[j];
+		}
+
+		dist = block->dist[i];
+
+		if (!ispoint)
+		{
+			dist = dist - DotProduct(ofs, normal);
+		}
+
+		d1[i] = DotProduct(p1, normal) - dist;
+
+		if (d2)
+		{
+			d2[i] = DotProduct(p2, normal) - dist;
+		}
+	}
+#endif
+}
+
+/*
+ * The distances of p1 and p2 to a brush side
+ * pushed out for mins/maxs, one side at a time
+ */
+static void CM_SideDists(cplane_t *plane, vec3_t mins, vec3_t maxs,
+		vec3_t p1, vec3_t p2, qboolean ispoint, float *d1, float *d2)
+{
 	float dist;
-	float enterfrac, leavefrac;
 	vec3_t ofs;
+	int j;
+
+	if (!ispoint)
+	{
+		/* general box case
+		   push the plane out
+		   apropriately for mins/maxs */
+		for (j = 0; j < 3; j++)
+		{
+			if (plane->normal[j] < 0)
+			{
+				ofs[j] = maxs[j];
+			}
+			else
+			{
+				ofs[j] = mins[j];
+			}
+		}
+
+		dist = DotProduct(ofs, plane->normal);
+		dist = plane->dist - dist;
+	}
+	else
+	{
+		/* special point case */
+		dist = plane->dist;
+	}
+
+	*d1 = DotProduct(p1, plane->normal) - dist;
+
+	if (d2)
+	{
+		*d2 = DotProduct(p2, plane->normal) - dist;
+	}
+}
+
+static void CM_ClipBoxToBrush(cmtrace_t *ctx, vec3_t mins, vec3_t maxs, vec3_t p1, vec3_t p2, trace_t *trace, cbrush_t *brush)
+{
+	int i;
+	cplane_t *plane, *clipplane;
+	float enterfrac, leavefrac;
 	float d1, d2;
+	float d1s[4], d2s[4];
 	qboolean getout, startout;
+	qboolean simd;
 	float f;
-	cbrushside_t *side, *leadside;
+	int lead;
+	cbrushside_t *leadside;
 
 	enterfrac = -1;
 	leavefrac = 1;
-	clipplane = NULL;
+	lead = -1;
 
 	if (!brush->numsides)
 	{
 		return;
 	}
 
-	#ifndef DEDICATED_ONLY
-	c_brush_traces++;
-	#endif
+	ctx->brushtraces++;
 
 	getout = false;
 	startout = false;
-	leadside = NULL;
+	simd = ctx->simd && (brush->firstsideblock >= 0);
 
 	for (i = 0; i < brush->numsides; i++)
 	{
-		side = &map_brushsides[brush->firstbrushside + i];
-		plane = side->plane;
-
-		if (!trace_ispoint)
+		if (simd)
 		{
-			/* general box case
-			   push the plane out
-			   apropriately for mins/maxs */
-			for (j = 0; j < 3; j++)
+			if (!(i & 3))
 			{
-				if (plane->normal[j] < 0)
-				{
-					ofs[j] = maxs[j];
-				}
-				else
-				{
-					ofs[j] = mins[j];
-				}
+				CM_SideDists4(&cm_sideblocks[brush->firstsideblock + (i >> 2)],
+						mins, maxs, p1, p2, ctx->ispoint, d1s, d2s);
 			}
 
-			dist = DotProduct(ofs, plane->normal);
-			dist = plane->dist - dist;
+			d1 = d1s[i & 3];
+			d2 = d2s[i & 3];
 		}
 		else
 		{
-			/* special point case */
-			dist = plane->dist;
-		}
+			plane = map_brushsides[brush->firstbrushside + i].plane;
+
+			if (brush == box_brush)
+			{
+				plane = &ctx->boxplanes[plane - box_planes];
+			}
 
-		d1 = DotProduct(p1, plane->normal) - dist;
-		d2 = DotProduct(p2, plane->normal) - dist;
+			CM_SideDists(plane, mins, maxs, p1, p2, ctx->ispoint, &d1, &d2);
+		}
 
 		if (d2 > 0)
 		{
@@ -657,8 +1007,7 @@ void CM_ClipBoxToBrush(vec3_t mins, vec3_t maxs, vec3_t p1, vec3_t p2, trace_t *
 			if (f > enterfrac)
 			{
 				enterfrac = f;
-				clipplane = plane;
-				leadside = side;
+				lead = i;
 			}
 		}
 		else
@@ -695,11 +1044,19 @@ void CM_ClipBoxToBrush(vec3_t mins, vec3_t maxs, vec3_t p1, vec3_t p2, trace_t *
 				enterfrac = 0;
 			}
 
-			if (clipplane == NULL)
+			if (lead == -1)
 			{
 				Com_Error(ERR_FATAL, "clipplane was NULL!\n");
 			}
 
+			leadside = &map_brushsides[brush->firstbrushside + lead];
+			clipplane = leadside->plane;
+
+			if (brush == box_brush)
+			{
+				clipplane = &ctx->boxplanes[clipplane - box_planes];
+			}
+
 			trace->fraction = enterfrac;
 			trace->plane = *clipplane;
 			trace->surface = &(leadside->surface->c);
@@ -708,44 +1065,44 @@ void CM_ClipBoxToBrush(vec3_t mins, vec3_t maxs, vec3_t p1, vec3_t p2, trace_t *
 	}
 }
 
-void CM_TestBoxInBrush(vec3_t mins, vec3_t maxs, vec3_t p1, trace_t *trace, cbrush_t *brush)
+static void CM_TestBoxInBrush(cmtrace_t *ctx, vec3_t mins, vec3_t maxs, vec3_t p1, trace_t *trace, cbrush_t *brush)
 {
-	int i, j;
+	int i;
 	cplane_t *plane;
-	float dist;
-	vec3_t ofs;
 	float d1;
-	cbrushside_t *side;
+	float d1s[4];
+	qboolean simd;
 
 	if (!brush->numsides)
 	{
 		return;
 	}
 
+	simd = ctx->simd && (brush->firstsideblock >= 0);
+
 	for (i = 0; i < brush->numsides; i++)
 	{
-		side = &map_brushsides[brush->firstbrushside + i];
-		plane = side->plane;
-
-		/* general box case
-		   push the plane out
-		   apropriately for mins/maxs */
-		for (j = 0; j < 3; j++)
+		if (simd)
 		{
-			if (plane->normal[j] < 0)
-			{
-				ofs[j] = maxs[j];
-			}
-			else
+			if (!(i & 3))
 			{
-				ofs[j] = mins[j];
+				CM_SideDists4(&cm_sideblocks[brush->firstsideblock + (i >> 2)],
+						mins, maxs, p1, NULL, false, d1s, NULL);
 			}
+
+			d1 = d1s[i & 3];
 		}
+		else
+		{
+			plane = map_brushsides[brush->firstbrushside + i].plane;
 
-		dist = DotProduct(ofs, plane->normal);
-		dist = plane->dist - dist;
+			if (brush == box_brush)
+			{
+				plane = &ctx->boxplanes[plane - box_planes];
+			}
 
-		d1 = DotProduct(p1, plane->normal) - dist;
+			CM_SideDists(plane, mins, maxs, p1, NULL, false, &d1, NULL);
+		}
 
 		/* if completely in front of face, no intersection */
 		if (d1 > 0)
@@ -760,7 +1117,7 @@ void CM_TestBoxInBrush(vec3_t mins, vec3_t maxs, vec3_t p1, trace_t *trace, cbru
 	trace->contents = brush->contents;
 }
 
-void CM_TraceToLeaf(int leafnum)
+static void CM_TraceToLeaf(cmtrace_t *ctx, int leafnum)
 {
 	int k;
 	int brushnum;
@@ -769,7 +1126,7 @@ void CM_TraceToLeaf(int leafnum)
 
 	leaf = &map_leafs[leafnum];
 
-	if (!(leaf->contents & trace_contents))
+	if (!(leaf->contents & ctx->contents))
 	{
 		return;
 	}
@@ -780,29 +1137,29 @@ void CM_TraceToLeaf(int leafnum)
 		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
 		b = &map_brushes[brushnum];
 
-		if (b->checkcount == checkcount)
+		if (ctx->brushchecks[brushnum] == ctx->checkcount)
 		{
 			continue; /* already checked this brush in another leaf */
 		}
 
-		b->checkcount = checkcount;
+		ctx->brushchecks[brushnum] = ctx->checkcount;
 
-		if (!(b->contents & trace_contents))
+		if (!(b->contents & ctx->contents))
 		{
 			continue;
 		}
 
-		CM_ClipBoxToBrush(trace_mins, trace_maxs, trace_start,
-			trace_end, &trace_trace, b);
+		CM_ClipBoxToBrush(ctx, ctx->mins, ctx->maxs, ctx->start,
+			ctx->end, &ctx->trace, b);
 
-		if (!trace_trace.fraction)
+		if (!ctx->trace.fraction)
 		{
 			return;
 		}
 	}
 }
 
-void CM_TestInLeaf(int leafnum)
+static void CM_TestInLeaf(cmtrace_t *ctx, int leafnum)
 {
 	int k;
 	int brushnum;
@@ -811,7 +1168,7 @@ void CM_TestInLeaf(int leafnum)
 
 	leaf = &map_leafs[leafnum];
 
-	if (!(leaf->contents & trace_contents))
+	if (!(leaf->contents & ctx->contents))
 	{
 		return;
 	}
@@ -822,31 +1179,31 @@ void CM_TestInLeaf(int leafnum)
 		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
 		b = &map_brushes[brushnum];
 
-		if (b->checkcount == checkcount)
+		if (ctx->brushchecks[brushnum] == ctx->checkcount)
 		{
 			continue; /* already checked this brush in another leaf */
 		}
 
-		b->checkcount = checkcount;
+		ctx->brushchecks[brushnum] = ctx->checkcount;
 
-		if (!(b->contents & trace_contents))
+		if (!(b->contents & ctx->contents))
 		{
 			continue;
 		}
 
-		CM_TestBoxInBrush(trace_mins, trace_maxs, trace_start, &trace_trace, b);
+		CM_TestBoxInBrush(ctx, ctx->mins, ctx->maxs, ctx->start, &ctx->trace, b);
 
-		if (!trace_trace.fraction)
+		if (!ctx->trace.fraction)
 		{
 			return;
 		}
 	}
 }
 
-void CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
+static void CM_RecursiveHullCheck(cmtrace_t *ctx, int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 {
 	cnode_t *node;
-	cplane_t *plane;
+	float dist;
 	float t1, t2, offset;
 	float frac, frac2;
 	float idist;
@@ -855,7 +1212,7 @@ void CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 	int side;
 	float midf;
 
-	if (trace_trace.fraction <= p1f)
+	if (ctx->trace.fraction <= p1f)
 	{
 		return; /* already hit something nearer */
 	}
@@ -863,48 +1220,53 @@ void CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 	/* if < 0, we are in a leaf node */
 	if (num < 0)
 	{
-		CM_TraceToLeaf(-1 - num);
+		CM_TraceToLeaf(ctx, -1 - num);
 		return;
 	}
 
 	/* find the point distances to the seperating plane
 	   and the offset for the size of the box */
 	node = map_nodes + num;
-	plane = node->plane;
+	dist = node->dist;
 
-	if (plane->type < 3)
+	if (num >= box_headnode)
 	{
-		t1 = p1[plane->type] - plane->dist;
-		t2 = p2[plane->type] - plane->dist;
-		offset = trace_extents[plane->type];
+		dist = ctx->boxplanes[node->boxplane].dist;
+	}
+
+	if (node->type < 3)
+	{
+		t1 = p1[node->type] - dist;
+		t2 = p2[node->type] - dist;
+		offset = ctx->extents[node->type];
 	}
 	else
 	{
-		t1 = DotProduct(plane->normal, p1) - plane->dist;
-		t2 = DotProduct(plane->normal, p2) - plane->dist;
+		t1 = DotProduct(node->normal, p1) - dist;
+		t2 = DotProduct(node->normal, p2) - dist;
 
-		if (trace_ispoint)
+		if (ctx->ispoint)
 		{
 			offset = 0;
 		}
 		else
 		{
-			offset = (float)fabsf(trace_extents[0] * plane->normal[0]) +
-			        (float)fabsf(trace_extents[1] * plane->normal[1]) +
-			        (float)fabsf(trace_extents[2] * plane->normal[2]);
+			offset = (float)fabsf(ctx->extents[0] * node->normal[0]) +
+			        (float)fabsf(ctx->extents[1] * node->normal[1]) +
+			        (float)fabsf(ctx->extents[2] * node->normal[2]);
 		}
 	}
 
 	/* see which sides we need to consider */
 	if ((t1 >= offset) && (t2 >= offset))
 	{
-		CM_RecursiveHullCheck(node->children[0], p1f, p2f, p1, p2);
+		CM_RecursiveHullCheck(ctx, node->children[0], p1f, p2f, p1, p2);
 		return;
 	}
 
 	if ((t1 < -offset) && (t2 < -offset))
 	{
-		CM_RecursiveHullCheck(node->children[1], p1f, p2f, p1, p2);
+		CM_RecursiveHullCheck(ctx, node->children[1], p1f, p2f, p1, p2);
 		return;
 	}
 
@@ -949,7 +1311,7 @@ void CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 		mid[i] = p1[i] + frac * (p2[i] - p1[i]);
 	}
 
-	CM_RecursiveHullCheck(node->children[side], p1f, midf, p1, mid);
+	CM_RecursiveHullCheck(ctx, node->children[side], p1f, midf, p1, mid);
 
 	/* go past the node */
 	if (frac2 < 0)
@@ -969,34 +1331,35 @@ void CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
 		mid[i] = p1[i] + frac2 * (p2[i] - p1[i]);
 	}
 
-	CM_RecursiveHullCheck(node->children[side ^ 1], midf, p2f, mid, p2);
+	CM_RecursiveHullCheck(ctx, node->children[side ^ 1], midf, p2f, mid, p2);
 }
 
-trace_t CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask)
+/*
+ * Like CM_BoxTrace, but with the given context. A context
+ * must not be used by two threads at the same time.
+ */
+trace_t CM_BoxTraceContext(cmtrace_t *ctx, vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask)
 {
 	int i;
 
-	checkcount++; /* for multi-check avoidance */
-
-	#ifndef DEDICATED_ONLY
-	c_traces++; /* for statistics, may be zeroed */
-	#endif
+	ctx->checkcount++; /* for multi-check avoidance */
 
 	/* fill in a default trace */
-	memset(&trace_trace, 0, sizeof(trace_trace));
-	trace_trace.fraction = 1;
-	trace_trace.surface = &(nullsurface.c);
+	memset(&ctx->trace, 0, sizeof(ctx->trace));
+	ctx->trace.fraction = 1;
+	ctx->trace.surface = &(nullsurface.c);
 
 	if (!numnodes) /* map not loaded */
 	{
-		return trace_trace;
+		return ctx->trace;
 	}
 
-	trace_contents = brushmask;
-	VectorCopy(start, trace_start);
-	VectorCopy(end, trace_end);
-	VectorCopy(mins, trace_mins);
-	VectorCopy(maxs, trace_maxs);
+	ctx->contents = brushmask;
+	ctx->simd = cm_sideblocks && cm_simd->value;
+	VectorCopy(start, ctx->start);
+	VectorCopy(end, ctx->end);
+	VectorCopy(mins, ctx->mins);
+	VectorCopy(maxs, ctx->maxs);
 
 	/* check for position test special case */
 	if ((start[0] == end[0]) && (start[1] == end[1]) && (start[2] == end[2]))
@@ -1016,74 +1379,142 @@ trace_t CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int head
 		}
 
 		numleafs = CM_BoxLeafnums_headnode(c1, c2, leafs, 1024,
-				headnode, &topnode);
+				headnode, &topnode, ctx->boxplanes);
 
 		for (i = 0; i < numleafs; i++)
 		{
-			CM_TestInLeaf(leafs[i]);
+			CM_TestInLeaf(ctx, leafs[i]);
 
-			if (trace_trace.allsolid)
+			if (ctx->trace.allsolid)
 			{
 				break;
 			}
 		}
 
-		VectorCopy(start, trace_trace.endpos);
-		return trace_trace;
+		VectorCopy(start, ctx->trace.endpos);
+		return ctx->trace;
 	}
 
 	/* check for point special case */
 	if ((mins[0] == 0) && (mins[1] == 0) && (mins[2] == 0) &&
 	    (maxs[0] == 0) && (maxs[1] == 0) && (maxs[2] == 0))
 	{
-		trace_ispoint = true;
-		VectorClear(trace_extents);
+		ctx->ispoint = true;
+		VectorClear(ctx->extents);
 	}
 	else
 	{
-		trace_ispoint = false;
-		trace_extents[0] = -mins[0] > maxs[0] ? -mins[0] : maxs[0];
-		trace_extents[1] = -mins[1] > maxs[1] ? -mins[1] : maxs[1];
-		trace_extents[2] = -mins[2] > maxs[2] ? -mins[2] : maxs[2];
+		ctx->ispoint = false;
+		ctx->extents[0] = -mins[0] > maxs[0] ? -mins[0] : maxs[0];
+		ctx->extents[1] = -mins[1] > maxs[1] ? -mins[1] : maxs[1];
+		ctx->extents[2] = -mins[2] > maxs[2] ? -mins[2] : maxs[2];
 	}
 
 	/* general sweeping through world */
-	CM_RecursiveHullCheck(headnode, 0, 1, start, end);
+	CM_RecursiveHullCheck(ctx, headnode, 0, 1, start, end);
 
-	if (trace_trace.fraction == 1)
+	if (ctx->trace.fraction == 1)
 	{
-		VectorCopy(end, trace_trace.endpos);
+		VectorCopy(end, ctx->trace.endpos);
 	}
 	else
 	{
 		for (i = 0; i < 3; i++)
 		{
-			trace_trace.endpos[i] = start[i] + trace_trace.fraction *
+			ctx->trace.endpos[i] = start[i] + ctx->trace.fraction *
 			        (end[i] - start[i]);
 		}
 	}
 
-	return trace_trace;
+	return ctx->trace;
 }
 
 /*
- * Handles offseting and rotation of the end points for moving and
- * rotating entities
+ * Records a trace of the main thread for cm_tracebench
  */
-trace_t CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask, vec3_t origin, vec3_t angles)
+static void CM_CaptureTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask, vec3_t origin, vec3_t angles)
 {
-	trace_t trace;
-	vec3_t start_l, end_l;
-	vec3_t a;
-	vec3_t forward, right, up;
-	vec3_t temp;
-	qboolean rotated;
-
-	/* subtract origin offset */
-	VectorSubtract(start, origin, start_l);
-	VectorSubtract(end, origin, end_l);
+	cmcapture_t *c;
 
-	/* rotate start and end into the models frame of reference */
+	if (cm_numcaptures == CM_MAXCAPTURES)
+	{
+		return;
+	}
+
+	if (!cm_captures)
+	{
+		cm_captures = Z_Malloc(CM_MAXCAPTURES * sizeof(cmcapture_t));
+	}
+
+	c = &cm_captures[cm_numcaptures++];
+	VectorCopy(start, c->start);
+	VectorCopy(end, c->end);
+	VectorCopy(mins, c->mins);
+	VectorCopy(maxs, c->maxs);
+	c->headnode = headnode;
+	c->brushmask = brushmask;
+	c->transformed = (origin != NULL);
+
+	if (origin)
+	{
+		VectorCopy(origin, c->origin);
+		VectorCopy(angles, c->angles);
+	}
+
+	/* see CM_HeadnodeForBoxContext */
+	if (headnode == box_headnode)
+	{
+		c->boxmaxs[0] = box_planes[0].dist;
+		c->boxmins[0] = box_planes[2].dist;
+		c->boxmaxs[1] = box_planes[4].dist;
+		c->boxmins[1] = box_planes[6].dist;
+		c->boxmaxs[2] = box_planes[8].dist;
+		c->boxmins[2] = box_planes[10].dist;
+	}
+}
+
+trace_t CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask)
+{
+	trace_t trace;
+
+	if (cm_tracecapture && cm_tracecapture->value)
+	{
+		CM_CaptureTrace(start, end, mins, maxs, headnode, brushmask, NULL, NULL);
+	}
+
+	c_traces++; /* for statistics, may be zeroed */
+
+	#ifndef DEDICATED_ONLY
+	cm_trace.brushtraces = 0;
+	#endif
+
+	trace = CM_BoxTraceContext(&cm_trace, start, end, mins, maxs, headnode, brushmask);
+
+	#ifndef DEDICATED_ONLY
+	c_brush_traces += cm_trace.brushtraces;
+	#endif
+
+	return trace;
+}
+
+/*
+ * Handles offseting and rotation of the end points for moving and
+ * rotating entities
+ */
+trace_t CM_TransformedBoxTraceContext(cmtrace_t *ctx, vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask, vec3_t origin, vec3_t angles)
+{
+	trace_t trace;
+	vec3_t start_l, end_l;
+	vec3_t a;
+	vec3_t forward, right, up;
+	vec3_t temp;
+	qboolean rotated;
+
+	/* subtract origin offset */
+	VectorSubtract(start, origin, start_l);
+	VectorSubtract(end, origin, end_l);
+
+	/* rotate start and end into the models frame of reference */
 	if ((headnode != box_headnode) &&
 	    (angles[0] || angles[1] || angles[2]))
 	{
@@ -1110,7 +1541,7 @@ trace_t CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t max
 	}
 
 	/* sweep the box through the model */
-	trace = CM_BoxTrace(start_l, end_l, mins, maxs, headnode, brushmask);
+	trace = CM_BoxTraceContext(ctx, start_l, end_l, mins, maxs, headnode, brushmask);
 
 	if (rotated && (trace.fraction != 1.0f))
 	{
@@ -1130,6 +1561,266 @@ trace_t CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t max
 	return trace;
 }
 
+trace_t CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask, vec3_t origin, vec3_t angles)
+{
+	trace_t trace;
+
+	if (cm_tracecapture && cm_tracecapture->value)
+	{
+		CM_CaptureTrace(start, end, mins, maxs, headnode, brushmask, origin, angles);
+	}
+
+	c_traces++;
+
+	#ifndef DEDICATED_ONLY
+	cm_trace.brushtraces = 0;
+	#endif
+
+	trace = CM_TransformedBoxTraceContext(&cm_trace, start, end, mins, maxs, headnode, brushmask, origin, angles);
+
+	#ifndef DEDICATED_ONLY
+	c_brush_traces += cm_trace.brushtraces;
+	#endif
+
+	return trace;
+}
+
+/*
+ * Replays the traces recorded with cm_tracecapture, while playing
+ * a demo or a game on this map, and prints how fast they ran
+ */
+void CM_TraceBench_f(void)
+{
+	cmcapture_t *c;
+	long long start, usec;
+	double fractions;
+	int rounds;
+	int i, r;
+
+	if (!numnodes)
+	{
+		Com_Printf("No map loaded.\n");
+		return;
+	}
+
+	if (!cm_numcaptures)
+	{
+		Com_Printf("No traces captured, set cm_tracecapture 1 and play a demo.\n");
+		return;
+	}
+
+	rounds = (Cmd_Argc() > 1) ? atoi(Cmd_Argv(1)) : 10;
+
+	if (rounds < 1)
+	{
+		rounds = 1;
+	}
+
+	fractions = 0;
+	start = Sys_Microseconds();
+
+	for (r = 0; r < rounds; r++)
+	{
+		for (i = 0; i < cm_numcaptures; i++)
+		{
+			c = &cm_captures[i];
+
+			if (c->headnode == box_headnode)
+			{
+				CM_HeadnodeForBoxContext(&cm_trace, c->boxmins, c->boxmaxs);
+			}
+
+			if (c->transformed)
+			{
+				fractions += CM_TransformedBoxTraceContext(&cm_trace, c->start,
+						c->end, c->mins, c->maxs, c->headnode, c->brushmask,
+						c->origin, c->angles).fraction;
+			}
+			else
+			{
+				fractions += CM_BoxTraceContext(&cm_trace, c->start, c->end,
+						c->mins, c->maxs, c->headnode, c->brushmask).fraction;
+			}
+		}
+	}
+
+	usec = Sys_Microseconds() - start;
+
+	if (usec < 1)
+	{
+		usec = 1;
+	}
+
+	Com_Printf("%i traces %i times in %.1f ms\n", cm_numcaptures, rounds,
+			usec / 1000.0f);
+	Com_Printf("%.0f traces/sec, %.3f us per trace, average fraction %.4f\n",
+			(double)cm_numcaptures * rounds * 1000000 / usec,
+			(double)usec / ((double)cm_numcaptures * rounds),
+			fractions / ((double)cm_numcaptures * rounds));
+}
+
+static qboolean CM_TracesDiffer(trace_t *a, trace_t *b)
+{
+	/* field by field, the padding doesn't matter */
+	return memcmp(&a->fraction, &b->fraction, sizeof(float)) ||
+		memcmp(a->endpos, b->endpos, sizeof(vec3_t)) ||
+		memcmp(a->plane.normal, b->plane.normal, sizeof(vec3_t)) ||
+		memcmp(&a->plane.dist, &b->plane.dist, sizeof(float)) ||
+		(a->plane.type != b->plane.type) ||
+		(a->surface != b->surface) || (a->contents != b->contents) ||
+		(a->startsolid != b->startsolid) || (a->allsolid != b->allsolid);
+}
+
+/*
+ * Compares the side blocks with the scalar code on the brushes
+ * of this map: random boxes and points are clipped against each
+ * brush and tested in it, and random traces run through the map.
+ * Everything has to come out the same to the bit.
+ */
+void CM_SimdTest_f(void)
+{
+	cmtrace_t *ctx;
+	cbrush_t *brush;
+	cplane_t *plane;
+	trace_t scalar, vector;
+	trace_t *traces;
+	struct
+	{
+		vec3_t start, end, mins, maxs;
+	} *moves;
+	vec3_t center, start, end, mins, maxs;
+	float simd;
+	int count, clips, tests, differ;
+	int i, j;
+
+	if (!numnodes || !cm_sideblocks)
+	{
+		Com_Printf("No map loaded.\n");
+		return;
+	}
+
+	count = (Cmd_Argc() > 1) ? atoi(Cmd_Argv(1)) : 100000;
+
+	if (count < 1)
+	{
+		count = 1;
+	}
+
+	ctx = CM_CreateTraceContext();
+	clips = tests = differ = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		brush = &map_brushes[randk() % numbrushes];
+
+		if (brush->firstsideblock < 0)
+		{
+			continue;
+		}
+
+		/* somewhere around the brush */
+		VectorClear(center);
+
+		for (j = 0; j < brush->numsides; j++)
+		{
+			plane = map_brushsides[brush->firstbrushside + j].plane;
+			VectorMA(center, plane->dist, plane->normal, center);
+		}
+
+		VectorScale(center, 1.0f / brush->numsides, center);
+
+		for (j = 0; j < 3; j++)
+		{
+			start[j] = center[j] + crandk() * 128;
+			end[j] = (i & 7) ? center[j] + crandk() * 128 : start[j];
+			mins[j] = (i & 3) ? -frandk() * 32 : 0;
+			maxs[j] = (i & 3) ? frandk() * 32 : 0;
+		}
+
+		ctx->ispoint = !(i & 3);
+
+		memset(&scalar, 0, sizeof(scalar));
+		memset(&vector, 0, sizeof(vector));
+		scalar.fraction = vector.fraction = 1;
+
+		ctx->simd = false;
+		CM_ClipBoxToBrush(ctx, mins, maxs, start, end, &scalar, brush);
+		ctx->simd = true;
+		CM_ClipBoxToBrush(ctx, mins, maxs, start, end, &vector, brush);
+
+		if (CM_TracesDiffer(&scalar, &vector))
+		{
+			differ++;
+		}
+
+		memset(&scalar, 0, sizeof(scalar));
+		memset(&vector, 0, sizeof(vector));
+		scalar.fraction = vector.fraction = 1;
+
+		ctx->simd = false;
+		CM_TestBoxInBrush(ctx, mins, maxs, start, &scalar, brush);
+		ctx->simd = true;
+		CM_TestBoxInBrush(ctx, mins, maxs, start, &vector, brush);
+
+		if (CM_TracesDiffer(&scalar, &vector))
+		{
+			differ++;
+		}
+
+		clips++;
+		tests++;
+	}
+
+	/* whole traces through the world, in two passes
+	   because CM_BoxTraceContext looks at cm_simd */
+	count = count / 10 + 1;
+	moves = Z_Malloc(count * sizeof(*moves));
+	traces = Z_Malloc(count * sizeof(trace_t));
+	simd = cm_simd->value;
+
+	for (i = 0; i < count; i++)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			moves[i].start[j] = map_cmodels[0].mins[j] + frandk() *
+				(map_cmodels[0].maxs[j] - map_cmodels[0].mins[j]);
+			moves[i].end[j] = (i & 7) ? moves[i].start[j] + crandk() * 256 :
+				moves[i].start[j];
+			moves[i].mins[j] = (i & 3) ? -frandk() * 32 : 0;
+			moves[i].maxs[j] = (i & 3) ? frandk() * 32 : 0;
+		}
+	}
+
+	Cvar_SetValue("cm_simd", 0);
+
+	for (i = 0; i < count; i++)
+	{
+		traces[i] = CM_BoxTraceContext(ctx, moves[i].start, moves[i].end,
+				moves[i].mins, moves[i].maxs, 0, MASK_ALL);
+	}
+
+	Cvar_SetValue("cm_simd", 1);
+
+	for (i = 0; i < count; i++)
+	{
+		vector = CM_BoxTraceContext(ctx, moves[i].start, moves[i].end,
+				moves[i].mins, moves[i].maxs, 0, MASK_ALL);
+
+		if (CM_TracesDiffer(&traces[i], &vector))
+		{
+			differ++;
+		}
+	}
+
+	Cvar_SetValue("cm_simd", simd);
+	Z_Free(moves);
+	Z_Free(traces);
+	CM_FreeTraceContext(ctx);
+
+	Com_Printf("%i brush clips, %i box tests, %i traces, %i differ\n",
+			clips, tests, count, differ);
+}
+
 void CMod_LoadSubmodels(lump_t *l)
 {
 	dmodel_t *in;
@@ -1215,6 +1906,7 @@ void CMod_LoadNodes(lump_t *l)
 	dnode_t *in;
 	int child;
 	cnode_t *out;
+	cplane_t *plane;
 	int i, j, count;
 
 	in = (void *)(cmod_base + l->fileofs);
@@ -1242,7 +1934,11 @@ void CMod_LoadNodes(lump_t *l)
 
 	for (i = 0; i < count; i++, out++, in++)
 	{
-		out->plane = map_planes + LittleLong(in->planenum);
+		plane = map_planes + LittleLong(in->planenum);
+		VectorCopy(plane->normal, out->normal);
+		out->dist = plane->dist;
+		out->type = plane->type;
+		out->boxplane = -1;
 
 		for (j = 0; j < 2; j++)
 		{
@@ -1281,6 +1977,7 @@ void CMod_LoadBrushes(lump_t *l)
 		out->firstbrushside = LittleLong(in->firstside);
 		out->numsides = LittleLong(in->numsides);
 		out->contents = LittleLong(in->contents);
+		out->firstsideblock = -1;
 	}
 }
 
@@ -1480,6 +2177,68 @@ void CMod_LoadBrushSides(lump_t *l)
 	}
 }
 
+/*
+ * Lays out the brush side planes for CM_SideDists4
+ */
+static void CM_BuildSideBlocks(void)
+{
+	cbrush_t *brush;
+	cplane_t *plane;
+	int numblocks;
+	int i, j, k;
+
+	numblocks = 0;
+
+	for (i = 0; i < numbrushes; i++)
+	{
+		numblocks += (map_brushes[i].numsides + 3) >> 2;
+	}
+
+	if (!numblocks)
+	{
+		return;
+	}
+
+	cm_sideblocks = Z_Malloc(numblocks * sizeof(csideblock_t));
+	numblocks = 0;
+
+	for (i = 0; i < numbrushes; i++)
+	{
+		brush = &map_brushes[i];
+
+		if ((brush->firstbrushside < 0) || (brush->numsides < 1) ||
+			(brush->firstbrushside + brush->numsides > numbrushsides))
+		{
+			continue; /* left to the scalar code */
+		}
+
+		brush->firstsideblock = numblocks;
+
+		for (j = 0; j < brush->numsides; j++)
+		{
+			plane = map_brushsides[brush->firstbrushside + j].plane;
+
+			for (k = 0; k < 3; k++)
+			{
+				cm_sideblocks[numblocks + (j >> 2)].normal[k][j & 3] = plane->normal[k];
+			}
+
+			cm_sideblocks[numblocks + (j >> 2)].dist[j & 3] = plane->dist;
+		}
+
+		numblocks += (brush->numsides + 3) >> 2;
+	}
+}
+
+static void CM_FreeSideBlocks(void)
+{
+	if (cm_sideblocks)
+	{
+		Z_Free(cm_sideblocks);
+		cm_sideblocks = NULL;
+	}
+}
+
 void CMod_LoadAreas(lump_t *l)
 {
 	int i;
@@ -1553,6 +2312,99 @@ void CMod_LoadVisibility(lump_t *l)
 	map_vis->numclusters = LittleLong(map_vis->numclusters);
 }
 
+void CM_DecompressVis(byte *in, byte *out)
+{
+	int c;
+	byte *out_p;
+	int row;
+
+	row = (numclusters + 7) >> 3;
+	out_p = out;
+
+	if (!in || !numvisibility)
+	{
+		/* no vis info, so make all visible */
+		while (row)
+		{
+			*out_p++ = 0xff;
+			row--;
+		}
+
+		return;
+	}
+
+	do
+	{
+		if (*in)
+		{
+			*out_p++ = *in++;
+			continue;
+		}
+
+		c = in[1];
+		in += 2;
+
+		if ((out_p - out) + c > row)
+		{
+			c = row - (out_p - out);
+			Com_DPrintf("warning: Vis decompression overrun\n");
+		}
+
+		while (c)
+		{
+			*out_p++ = 0;
+			c--;
+		}
+	}
+	while (out_p - out < row);
+}
+
+/*
+ * Decompresses the PVS and PHS of every cluster into one block,
+ * if it fits into cm_viscache megabytes. The rows are padded to
+ * 16 bytes and stay valid until the next map is loaded.
+ */
+static void CM_BuildVisCache(void)
+{
+	int i;
+	int size;
+	byte *phsrows;
+
+	cm_visrowbytes = (((numclusters + 7) >> 3) + 15) & ~15;
+	cm_visdecompressed = 0;
+	size = numclusters * cm_visrowbytes * 2;
+
+	if ((size <= 0) || (size > cm_viscache->value * 1024 * 1024))
+	{
+		return;
+	}
+
+	cm_visrows = Z_Malloc(size);
+	cm_viscachesize = size;
+	phsrows = cm_visrows + numclusters * cm_visrowbytes;
+
+	for (i = 0; i < numclusters; i++)
+	{
+		CM_DecompressVis(map_visibility +
+			LittleLong(map_vis->bitofs[i][DVIS_PVS]),
+			cm_visrows + i * cm_visrowbytes);
+		CM_DecompressVis(map_visibility +
+			LittleLong(map_vis->bitofs[i][DVIS_PHS]),
+			phsrows + i * cm_visrowbytes);
+	}
+}
+
+static void CM_FreeVisCache(void)
+{
+	if (cm_visrows)
+	{
+		Z_Free(cm_visrows);
+		cm_visrows = NULL;
+	}
+
+	cm_viscachesize = 0;
+}
+
 void CMod_LoadEntityString(lump_t *l)
 {
 	numentitychars = l->filelen;
@@ -1577,6 +2429,9 @@ cmodel_t* CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 	static unsigned last_checksum;
 
 	map_noareas = Cvar_Get("map_noareas", "0", 0);
+	cm_viscache = Cvar_Get("cm_viscache", "16", CVAR_ARCHIVE);
+	cm_tracecapture = Cvar_Get("cm_tracecapture", "0", 0);
+	cm_simd = Cvar_Get("cm_simd", "1", 0);
 
 	if (name != NULL && !strcmp(map_name, name) && (clientload || !Cvar_VariableValue("flushmap")))
 	{
@@ -1592,6 +2447,9 @@ cmodel_t* CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 	}
 
 	/* free old stuff */
+	CM_FreeVisCache();
+	CM_FreeSideBlocks();
+	cm_numcaptures = 0; /* the headnodes were of the old map */
 	numplanes = 0;
 	numnodes = 0;
 	numleafs = 0;
@@ -1643,6 +2501,7 @@ cmodel_t* CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 	CMod_LoadPlanes(&header.lumps[LUMP_PLANES]);
 	CMod_LoadBrushes(&header.lumps[LUMP_BRUSHES]);
 	CMod_LoadBrushSides(&header.lumps[LUMP_BRUSHSIDES]);
+	CM_BuildSideBlocks();
 	CMod_LoadSubmodels(&header.lumps[LUMP_MODELS]);
 	CMod_LoadNodes(&header.lumps[LUMP_NODES]);
 	CMod_LoadAreas(&header.lumps[LUMP_AREAS]);
@@ -1653,6 +2512,7 @@ cmodel_t* CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 	FS_FreeFile(buf);
 
 	CM_InitBoxHull();
+	CM_BuildVisCache();
 
 	memset(portalopen, 0, sizeof(portalopen));
 	FloodAreaConnections();
@@ -1726,79 +2586,80 @@ int CM_LeafArea(int leafnum)
 	return map_leafs[leafnum].area;
 }
 
-void CM_DecompressVis(byte *in, byte *out)
+/*
+ * With the vis cache the returned row stays valid until
+ * the next map is loaded, otherwise until the next call.
+ * Cluster -1 gets a shared empty row, so that the send
+ * workers can ask for it at the same time.
+ */
+const byte* CM_ClusterPVS(int cluster)
 {
-	int c;
-	byte *out_p;
-	int row;
-
-	row = (numclusters + 7) >> 3;
-	out_p = out;
-
-	if (!in || !numvisibility)
+	if (cluster == -1)
 	{
-		/* no vis info, so make all visible */
-		while (row)
-		{
-			*out_p++ = 0xff;
-			row--;
-		}
-
-		return;
+		return nullrow;
 	}
-
-	do
-	{
-		if (*in)
-		{
-			*out_p++ = *in++;
-			continue;
-		}
-
-		c = in[1];
-		in += 2;
-
-		if ((out_p - out) + c > row)
-		{
-			c = row - (out_p - out);
-			Com_DPrintf("warning: Vis decompression overrun\n");
-		}
-
-		while (c)
-		{
-			*out_p++ = 0;
-			c--;
-		}
-	}
-	while (out_p - out < row);
-}
-
-byte* CM_ClusterPVS(int cluster)
-{
-	if (cluster == -1)
+	else
+	if (cm_visrows)
 	{
-		memset(pvsrow, 0, (numclusters + 7) >> 3);
+		return cm_visrows + cluster * cm_visrowbytes;
 	}
 	else
 	{
 		CM_DecompressVis(map_visibility +
 			LittleLong(map_vis->bitofs[cluster][DVIS_PVS]), pvsrow);
+		cm_visdecompressed++;
 	}
 
 	return pvsrow;
 }
 
-byte* CM_ClusterPHS(int cluster)
+const byte* CM_ClusterPHS(int cluster)
 {
 	if (cluster == -1)
 	{
-		memset(phsrow, 0, (numclusters + 7) >> 3);
+		return nullrow;
+	}
+	else
+	if (cm_visrows)
+	{
+		return cm_visrows + (numclusters + cluster) * cm_visrowbytes;
 	}
 	else
 	{
 		CM_DecompressVis(map_visibility +
 			LittleLong(map_vis->bitofs[cluster][DVIS_PHS]), phsrow);
+		cm_visdecompressed++;
 	}
 
 	return phsrow;
 }
+
+qboolean CM_ClusterVisCached(void)
+{
+	return cm_visrows != NULL;
+}
+
+void CM_Stats_f(void)
+{
+	if (!numnodes)
+	{
+		Com_Printf("No map loaded.\n");
+		return;
+	}
+
+	Com_Printf("%i clusters, %i bytes per vis row.\n", numclusters,
+			(numclusters + 7) >> 3);
+
+	if (cm_visrows)
+	{
+		Com_Printf("PVS and PHS of all clusters cached in %i KB.\n",
+				cm_viscachesize >> 10);
+	}
+	else
+	{
+		Com_Printf("PVS and PHS not cached, %i KB needed, cm_viscache is %i MB.\n",
+				(numclusters * cm_visrowbytes * 2) >> 10, (int)cm_viscache->value);
+		Com_Printf("%i rows decompressed since the map was loaded.\n",
+				cm_visdecompressed);
+	}
+}
@@ -106,6 +106,7 @@ void MSG_ReadPos(sizebuf_t *sb, vec3_t pos);
 float MSG_ReadAngle(sizebuf_t *sb);
 float MSG_ReadAngle16(sizebuf_t *sb);
 void MSG_ReadDeltaUsercmd(sizebuf_t *sb, struct usercmd_s *from, struct usercmd_s *cmd);
+void MSG_ReadDeltaEntity(sizebuf_t *sb, struct entity_state_s *from, struct entity_state_s *to, int number, int bits);
 
 void MSG_ReadDir(sizebuf_t *sb, vec3_t vector);
 
@@ -143,6 +144,23 @@ void Info_Print(char *s);
 
 #define PROTOCOL_VERSION 34
 
+/* protocol extensions, offered as an extra argument to connect
+   and accepted as an argument to client_connect. Peers that don't
+   know them ignore the argument and talk plain version 34. */
+#define PROTOCOL_EXT_ZPACKET (1 << 0) /* svc_zpacket */
+#define PROTOCOL_EXT_DLSTREAM (1 << 1) /* svc_dlchunk and clc_dlack */
+#define PROTOCOL_EXT_FRAGMENT (1 << 2) /* netchan fragments */
+
+#ifdef ZIP
+ #define PROTOCOL_EXTENSIONS (PROTOCOL_EXT_ZPACKET | PROTOCOL_EXT_DLSTREAM | \
+                              PROTOCOL_EXT_FRAGMENT)
+#else
+ #define PROTOCOL_EXTENSIONS PROTOCOL_EXT_FRAGMENT
+#endif
+
+#define MAX_ZPACKETSIZE 0x4000 /* unpacked size of a svc_zpacket */
+#define MAX_DLCHUNKSIZE 0x1000 /* file bytes in a svc_dlchunk */
+
 /* ========================================= */
 
 #define PORT_MASTER 27900
@@ -181,7 +199,11 @@ enum svc_ops_e
 	svc_playerinfo, /* variable */
 	svc_packetentities, /* [...] */
 	svc_deltapacketentities, /* [...] */
-	svc_frame
+	svc_frame,
+
+	/* only sent if the protocol extension was accepted */
+	svc_zpacket, /* [short] size [short] unpacked size [size bytes] of zlib compressed messages */
+	svc_dlchunk /* [byte] stream [long] offset [short] length [short] size [byte] percent [size or length bytes] */
 };
 
 /* ============================================== */
@@ -193,7 +215,8 @@ enum clc_ops_e
 	clc_nop,
 	clc_move, /* [[usercmd_t] */
 	clc_userinfo, /* [[userinfo string] */
-	clc_stringcmd /* [string] message */
+	clc_stringcmd, /* [string] message */
+	clc_dlack /* [byte] stream [long] bytes received, only with PROTOCOL_EXT_DLSTREAM */
 };
 
 /* ============================================== */
@@ -365,6 +388,10 @@ qboolean Cmd_Exists(char *cmd_name);
 
 /* used by the cvar code to check for cvar / command name overlap */
 
+unsigned Cmd_HashName(const char *name);
+
+/* case insensitive hash of a command, alias or cvar name */
+
 char* Cmd_CompleteCommand(char *partial);
 
 /* attempts to match a partial command for automatic command line completion */
@@ -439,6 +466,10 @@ const char* Cvar_VariableString(const char *var_name);
 
 /* returns an empty string if not defined */
 
+cvar_t* Cvar_FindVar(const char *var_name);
+
+/* returns NULL if the variable doesn't exist */
+
 char* Cvar_CompleteVariable(char *partial);
 
 /* attempts to match a partial variable name for command line completion */
@@ -479,6 +510,11 @@ extern qboolean userinfo_modified;
 #define MAX_MSGLEN 1400 /* max length of a message */
 #define PACKET_HEADER 10 /* two ints and a short */
 
+/* with PROTOCOL_EXT_FRAGMENT, longer messages are split into packets */
+#define MAX_FRAGMENTS 8 /* most packets of a message */
+#define FRAGMENT_SIZE (MAX_MSGLEN - PACKET_HEADER - 4) /* payload of each but the last */
+#define MAX_FRAGMSGLEN (PACKET_HEADER + MAX_FRAGMENTS * FRAGMENT_SIZE) /* max length of a fragmented message */
+
 typedef enum
 {
 	NA_LOOPBACK,
@@ -510,12 +546,16 @@ void NET_Config(qboolean multiplayer);
 qboolean NET_GetPacket(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_message);
 void NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to);
 
+/* NET_SendPacket() may hold packets back until NET_FlushPackets() */
+void NET_BeginPacketBatch(netsrc_t sock);
+void NET_FlushPackets(netsrc_t sock);
+
 qboolean NET_CompareAdr(netadr_t a, netadr_t b);
 qboolean NET_CompareBaseAdr(netadr_t a, netadr_t b);
 qboolean NET_IsLocalAddress(netadr_t adr);
 char* NET_AdrToString(netadr_t a);
 qboolean NET_StringToAdr(char *s, netadr_t *a);
-void NET_Sleep(int msec);
+void NET_Sleep(int usec, qboolean packets);
 
 /*=================================================================== */
 
@@ -554,16 +594,29 @@ typedef struct
 	/* message is copied to this buffer when it is first transfered */
 	int reliable_length;
 	byte reliable_buf[MAX_MSGLEN - 16]; /* unacked reliable message */
+
+	/* fragmented messages, only if both sides know PROTOCOL_EXT_FRAGMENT */
+	qboolean fragments;
+	qboolean fragments_paused; /* send whole packets only, still receive fragments */
+	int fragment_sequence; /* of the message being put together */
+	int fragment_length;
+	byte fragment_buf[MAX_FRAGMENTS * FRAGMENT_SIZE];
+
+	/* totals since Netchan_Setup, fragments count as packets */
+	int packets_sent, bytes_sent;
+	int packets_received, bytes_received;
+	int unreliable_dumped; /* unreliable messages that didn't fit */
 } netchan_t;
 
 extern netadr_t net_from;
 extern sizebuf_t net_message;
-extern byte net_message_buffer[MAX_MSGLEN];
+extern byte net_message_buffer[MAX_FRAGMSGLEN];
 
 void Netchan_Init(void);
 void Netchan_Setup(netsrc_t sock, netchan_t *chan, netadr_t adr, int qport);
 
 qboolean Netchan_NeedReliable(netchan_t *chan);
+int Netchan_MaxMessageLength(netchan_t *chan);
 void Netchan_Transmit(netchan_t *chan, int length, byte *data);
 void Netchan_OutOfBand(int net_socket, netadr_t adr, int length, byte *data);
 void Netchan_OutOfBandPrint(int net_socket, netadr_t adr, char *format, ...);
@@ -592,8 +645,23 @@ int CM_TransformedPointContents(vec3_t p, int headnode, vec3_t origin, vec3_t an
 trace_t CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask);
 trace_t CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask, vec3_t origin, vec3_t angles);
 
-byte* CM_ClusterPVS(int cluster);
-byte* CM_ClusterPHS(int cluster);
+/* reentrant traces, each thread needs a context of its own */
+typedef struct cmtrace_s cmtrace_t;
+
+cmtrace_t* CM_CreateTraceContext(void);
+void CM_FreeTraceContext(cmtrace_t *ctx);
+int CM_HeadnodeForBoxContext(cmtrace_t *ctx, vec3_t mins, vec3_t maxs);
+trace_t CM_BoxTraceContext(cmtrace_t *ctx, vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask);
+trace_t CM_TransformedBoxTraceContext(cmtrace_t *ctx, vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs, int headnode, int brushmask, vec3_t origin, vec3_t angles);
+
+const byte* CM_ClusterPVS(int cluster);
+const byte* CM_ClusterPHS(int cluster);
+
+/* true if the rows above may be asked for from several threads */
+qboolean CM_ClusterVisCached(void);
+void CM_Stats_f(void);
+void CM_TraceBench_f(void);
+void CM_SimdTest_f(void);
 
 int CM_PointLeafnum(vec3_t p);
 
@@ -671,6 +739,9 @@ int FS_LoadFile(char *path, void **buffer);
 
 void FS_FreeFile(void *buffer);
 qboolean FS_CreatePath(char *path);
+void FS_FlushNegativeCache(void);
+void FS_PreloadFile(const char *name);
+void FS_PreloadClear(void);
 
 /* MISC */
 
@@ -707,11 +778,14 @@ extern cvar_t *log_stats;
 
 extern FILE *log_stats_file;
 
-/* host_speeds times */
-extern int time_before_game;
-extern int time_after_game;
-extern int time_before_ref;
-extern int time_after_ref;
+/* host_speeds times, in Sys_Microseconds() */
+extern long long time_before_game;
+extern long long time_after_game;
+extern long long time_before_ref;
+extern long long time_after_ref;
+
+/* Sys_Microseconds() up to which time was handed to Qcommon_Frame */
+extern long long com_frameclock;
 
 void Z_Free(void *ptr);
 void* Z_Malloc(int size); /* returns 0 filled memory */
@@ -746,6 +820,15 @@ void Sys_FreeLibrary(void *handle);
 void* Sys_LoadLibrary(const char *path, const char *sym, void **handle);
 void* Sys_GetProcAddress(void *handle, const char *sym);
 
+/* threads for background jobs, never running game code */
+void* Sys_CreateThread(int (*function)(void *), void *data);
+void* Sys_CreateMutex();
+void Sys_LockMutex(void *mutex);
+void Sys_UnlockMutex(void *mutex);
+void* Sys_CreateSemaphore(int value);
+void Sys_SemWait(void *sem);
+void Sys_SemPost(void *sem);
+
 /* CLIENT / SERVER SYSTEMS */
 
 void CL_Init();
@@ -28,6 +28,12 @@
 
 cvar_t *cvar_vars;
 
+/* Open addressing index into cvar_vars. Cvars are never
+   freed, so there are no deleted slots to care about. */
+static cvar_t **cvar_hash;
+static int cvar_hashSize; /* Power of two. */
+static int cvar_count;
+
 static qboolean Cvar_InfoValidate(char *s)
 {
 	if (strstr(s, "\\"))
@@ -48,16 +54,71 @@ static qboolean Cvar_InfoValidate(char *s)
 	return true;
 }
 
-static cvar_t* Cvar_FindVar(const char *var_name)
+static void Cvar_HashInsert(cvar_t *var)
+{
+	unsigned i;
+
+	i = Cmd_HashName(var->name) & (cvar_hashSize - 1);
+
+	while (cvar_hash[i])
+	{
+		i = (i + 1) & (cvar_hashSize - 1);
+	}
+
+	cvar_hash[i] = var;
+}
+
+/*
+ * Adds a new variable to the index, growing
+ * it if it would become more than half full.
+ */
+static void Cvar_HashVar(cvar_t *var)
+{
+	cvar_t *v;
+
+	if ((cvar_count + 1) * 2 > cvar_hashSize)
+	{
+		if (cvar_hash)
+		{
+			Z_Free(cvar_hash);
+		}
+
+		cvar_hashSize = cvar_hashSize ? cvar_hashSize * 2 : 512;
+		cvar_hash = Z_Malloc(cvar_hashSize * sizeof(cvar_t *));
+
+		for (v = cvar_vars; v; v = v->next)
+		{
+			if (v != var)
+			{
+				Cvar_HashInsert(v);
+			}
+		}
+	}
+
+	Cvar_HashInsert(var);
+	cvar_count++;
+}
+
+cvar_t* Cvar_FindVar(const char *var_name)
 {
 	cvar_t *var;
+	unsigned i;
 
-	for (var = cvar_vars; var; var = var->next)
+	if (!cvar_hash)
+	{
+		return NULL;
+	}
+
+	i = Cmd_HashName(var_name) & (cvar_hashSize - 1);
+
+	while ((var = cvar_hash[i]) != NULL)
 	{
 		if (!strcmp(var_name, var->name))
 		{
 			return var;
 		}
+
+		i = (i + 1) & (cvar_hashSize - 1);
 	}
 
 	return NULL;
@@ -104,12 +165,9 @@ char* Cvar_CompleteVariable(char *partial)
 	}
 
 	/* check exact match */
-	for (cvar = cvar_vars; cvar; cvar = cvar->next)
+	if ((cvar = Cvar_FindVar(partial)) != NULL)
 	{
-		if (!strcmp(partial, cvar->name))
-		{
-			return cvar->name;
-		}
+		return cvar->name;
 	}
 
 	/* check partial match */
@@ -179,6 +237,8 @@ cvar_t* Cvar_Get(char *var_name, char *var_value, int flags)
 	var->next = *pos;
 	*pos = var;
 
+	Cvar_HashVar(var);
+
 	var->flags = flags;
 
 	return var;
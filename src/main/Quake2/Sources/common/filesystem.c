@@ -28,6 +28,13 @@
 #include "common/common.h"
 #include "common/glob.h"
 
+#include <ctype.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #ifdef ZIP
 #include "unzip/unzip.h"
 #endif
@@ -35,15 +42,13 @@
 #define MAX_HANDLES 512
 #define MAX_PAKS 100
 
-typedef struct
-{
-	char name[MAX_QPATH];
-	fsMode_t mode;
-	FILE *file; /* Only one will be used. */
-	#ifdef ZIP
-	unzFile *zip; /* (file or zip) */
-	#endif
-} fsHandle_t;
+#define FS_NEGCACHE_HASH 256 /* Must be a power of two. */
+#define FS_NEGCACHE_MAX 4096 /* Per search path, flushed when full. */
+
+/* Files at least that big are mapped instead of read by FS_LoadFile. */
+#define FS_MMAP_THRESHOLD 16384
+
+#define MAX_PRELOADS 1024
 
 typedef struct fsLink_s
 {
@@ -53,11 +58,16 @@ typedef struct fsLink_s
 	struct fsLink_s *next;
 } fsLink_t;
 
-typedef struct
+typedef struct fsPackFile_s
 {
 	char name[MAX_QPATH];
 	int size;
-	int offset; /* Ignored in PK3 files. */
+	int offset; /* PK3: offset of the data of stored members, -1 if unknown. */
+	#ifdef ZIP
+	qboolean stored; /* PK3 member that isn't compressed. */
+	unz_file_pos zipPos; /* Position in the PK3 central directory. */
+	#endif
+	struct fsPackFile_s *hashNext; /* Next file in the same hash bucket. */
 } fsPackFile_t;
 
 typedef struct
@@ -67,17 +77,87 @@ typedef struct
 	FILE *pak;
 	#ifdef ZIP
 	unzFile *pk3;
+	FILE *pk3Raw; /* Direct access to stored members. */
+	struct fsHandle_s *pk3Owner; /* Handle currently reading from pk3. */
 	#endif
 	fsPackFile_t *files;
+	int hashSize; /* Power of two. */
+	fsPackFile_t **hashTable; /* Case insensitive index into files. */
 } fsPack_t;
 
+typedef struct fsHandle_s
+{
+	char name[MAX_QPATH];
+	fsMode_t mode;
+	FILE *file; /* Only one will be used. */
+	#ifdef ZIP
+	unzFile *zip; /* (file or zip or pack) */
+	#endif
+	fsPack_t *pack; /* Set when reading from an archive. */
+	fsPackFile_t *packFile;
+	int position; /* Read position inside a PAK member. */
+} fsHandle_t;
+
+typedef enum
+{
+	PRELOAD_QUEUED,
+	PRELOAD_LOADING,
+	PRELOAD_DONE
+} fsPreloadState_t;
+
+/*
+ * A file read ahead of time by the preload thread. Where to read
+ * from is resolved by the main thread, the preload thread never
+ * looks at the search path.
+ */
+typedef struct
+{
+	char name[MAX_QPATH];
+	unsigned hash;
+	fsPreloadState_t state;
+	int size;
+	FILE *file; /* Directory tree, closed by the preload thread. */
+	fsPack_t *pack;
+	fsPackFile_t *packFile;
+	byte *data; /* NULL if it couldn't be read. */
+} fsPreload_t;
+
+/* A zero copy file returned by FS_LoadFile. */
+typedef struct
+{
+	void *data;
+	void *base; /* Page aligned start of the mapping. */
+	size_t length;
+} fsView_t;
+
+/* A file name known to be missing from a directory tree. */
+typedef struct fsNegEntry_s
+{
+	char name[MAX_QPATH];
+	struct fsNegEntry_s *next;
+} fsNegEntry_t;
+
 typedef struct fsSearchPath_s
 {
 	char path[MAX_OSPATH]; /* Only one used. */
 	fsPack_t *pack; /* (path or pack) */
+	int numNegEntries;
+	fsNegEntry_t *negCache[FS_NEGCACHE_HASH]; /* Only used with path. */
 	struct fsSearchPath_s *next;
 } fsSearchPath_t;
 
+typedef struct
+{
+	int lookups;
+	int packHits;
+	int dirHits;
+	int misses;
+	int negHits; /* Directory probes answered by the negative cache. */
+	int mapped; /* Loads served by FS_LoadFile without a copy. */
+	int preloaded; /* Loads served from the preload cache. */
+	long long usec; /* Time spent in lookups, microseconds. */
+} fsStats_t;
+
 typedef enum
 {
 	PAK,
@@ -93,9 +173,19 @@ typedef struct
 } fsPackTypes_t;
 
 fsHandle_t fs_handles[MAX_HANDLES];
+fsView_t fs_views[MAX_HANDLES];
+
+/* Preload cache, filled by a background thread. */
+static fsPreload_t fs_preloads[MAX_PRELOADS];
+static int fs_numPreloads;
+static int fs_preloadBytes;
+static void *fs_preloadLock;
+static void *fs_preloadWork; /* Posted for each queued file. */
+static void *fs_preloadDone; /* Posted for each file read. */
 fsLink_t *fs_links;
 fsSearchPath_t *fs_searchPaths;
 fsSearchPath_t *fs_baseSearchPaths;
+fsStats_t fs_stats;
 
 /* Pack formats / suffixes. */
 fsPackTypes_t fs_packtypes[] =
@@ -126,6 +216,8 @@ cvar_t *fs_basedir;
 cvar_t *fs_cddir;
 cvar_t *fs_gamedirvar;
 cvar_t *fs_debug;
+cvar_t *fs_negcache;
+cvar_t *fs_preload;
 
 fsHandle_t* FS_GetFileByHandle(fileHandle_t f);
 char* Sys_GetCurrentDirectory();
@@ -198,6 +290,300 @@ int FS_FileLength(FILE *f)
 	return end;
 }
 
+/*
+ * Hashes a file name. Lookups inside packs are case
+ * insensitive, lookups in directory trees are not.
+ */
+static unsigned FS_HashFileName(const char *name, qboolean caseless)
+{
+	unsigned hash = 0;
+
+	while (*name)
+	{
+		int c = (unsigned char)*name++;
+
+		if (caseless)
+		{
+			c = tolower(c);
+		}
+
+		hash = hash * 31 + c;
+	}
+
+	return hash;
+}
+
+/*
+ * Builds the case insensitive name index of a pack. Files are
+ * inserted back to front so that when a name appears twice the
+ * first entry wins, exactly like the linear search did.
+ */
+static void FS_BuildPackHash(fsPack_t *pack)
+{
+	int i;
+	unsigned hash;
+
+	pack->hashSize = 64;
+
+	while (pack->hashSize < pack->numFiles)
+	{
+		pack->hashSize <<= 1;
+	}
+
+	pack->hashTable = Z_Malloc(pack->hashSize * sizeof(fsPackFile_t *));
+
+	for (i = pack->numFiles - 1; i >= 0; i--)
+	{
+		hash = FS_HashFileName(pack->files[i].name, true) & (pack->hashSize - 1);
+		pack->files[i].hashNext = pack->hashTable[hash];
+		pack->hashTable[hash] = &pack->files[i];
+	}
+}
+
+static fsPackFile_t* FS_FindInPack(fsPack_t *pack, const char *name)
+{
+	fsPackFile_t *file;
+	unsigned hash;
+
+	hash = FS_HashFileName(name, true) & (pack->hashSize - 1);
+
+	for (file = pack->hashTable[hash]; file; file = file->hashNext)
+	{
+		if (Q_stricmp(file->name, name) == 0)
+		{
+			return file;
+		}
+	}
+
+	return NULL;
+}
+
+static void FS_FreePack(fsPack_t *pack)
+{
+	int i;
+
+	/* Handles may still read from the pack. */
+	for (i = 0; i < MAX_HANDLES; i++)
+	{
+		if (fs_handles[i].pack == pack)
+		{
+			FS_FCloseFile(i + 1);
+		}
+	}
+
+	if (pack->pak)
+	{
+		fclose(pack->pak);
+	}
+
+	#ifdef ZIP
+	if (pack->pk3)
+	{
+		unzClose(pack->pk3);
+	}
+
+	if (pack->pk3Raw)
+	{
+		fclose(pack->pk3Raw);
+	}
+	#endif
+
+	Z_Free(pack->hashTable);
+	Z_Free(pack->files);
+	Z_Free(pack);
+}
+
+/*
+ * Reads straight from an archive kept open since mount time.
+ * Returns the number of bytes read or -1 on error. Without pread()
+ * the file position is shared, so on Windows no two threads may
+ * read through the same FILE.
+ */
+static int FS_PackRead(FILE *f, int offset, void *buffer, int length)
+{
+	#ifdef _WIN32
+	if (fseek(f, offset, SEEK_SET) != 0)
+	{
+		return -1;
+	}
+
+	return (int)fread(buffer, 1, length, f);
+	#else
+	return (int)pread(fileno(f), buffer, length, offset);
+	#endif
+}
+
+/*
+ * Tells whether FS_LoadFile can map the file behind the handle.
+ * Members that aren't at least 4 byte aligned inside the archive
+ * are read as usual, since the loaders cast the buffer to
+ * structures of ints and floats.
+ */
+static qboolean FS_CanMapFile(fsHandle_t *handle, int size, FILE **raw, int *offset)
+{
+	#ifdef _WIN32
+	return false;
+	#else
+	if ((handle->pack == NULL) || (size < FS_MMAP_THRESHOLD))
+	{
+		return false;
+	}
+
+	*offset = handle->packFile->offset;
+
+	if (handle->pack->pak)
+	{
+		*raw = handle->pack->pak;
+	}
+	#ifdef ZIP
+	else
+	if (handle->packFile->stored && (*offset != -1))
+	{
+		*raw = handle->pack->pk3Raw;
+	}
+	#endif
+	else
+	{
+		return false;
+	}
+
+	return (*raw != NULL) && !(*offset & 3);
+	#endif
+}
+
+/*
+ * Maps an uncompressed archive member into memory. Every view is a
+ * private copy on write mapping, so callers may still modify the
+ * buffer they got from FS_LoadFile.
+ */
+static void* FS_MapFile(fsHandle_t *handle, int size)
+{
+	#ifdef _WIN32
+	return NULL;
+	#else
+	FILE *raw;
+	fsView_t *view;
+	long pageSize;
+	int offset;
+	int aligned;
+	int i;
+
+	if (!FS_CanMapFile(handle, size, &raw, &offset))
+	{
+		return NULL;
+	}
+
+	for (i = 0, view = fs_views; i < MAX_HANDLES; i++, view++)
+	{
+		if (view->data == NULL)
+		{
+			break;
+		}
+	}
+
+	if (i == MAX_HANDLES)
+	{
+		return NULL;
+	}
+
+	pageSize = sysconf(_SC_PAGESIZE);
+	aligned = offset & ~(pageSize - 1);
+
+	view->length = size + (offset - aligned);
+	view->base = mmap(NULL, view->length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, fileno(raw), aligned);
+
+	if (view->base == MAP_FAILED)
+	{
+		memset(view, 0, sizeof(*view));
+		return NULL;
+	}
+
+	view->data = (byte *)view->base + (offset - aligned);
+	fs_stats.mapped++;
+
+	return view->data;
+	#endif
+}
+
+/*
+ * Negative lookup cache. Remembers names that could not be opened
+ * in a directory tree, so precaching thousands of assets doesn't
+ * hit the disk again for every search path that lacks them.
+ */
+static qboolean FS_NegCacheCheck(fsSearchPath_t *search, const char *name)
+{
+	fsNegEntry_t *entry;
+	unsigned hash;
+
+	hash = FS_HashFileName(name, false) & (FS_NEGCACHE_HASH - 1);
+
+	for (entry = search->negCache[hash]; entry; entry = entry->next)
+	{
+		if (strcmp(entry->name, name) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void FS_NegCacheFlush(fsSearchPath_t *search)
+{
+	fsNegEntry_t *entry, *next;
+	int i;
+
+	for (i = 0; i < FS_NEGCACHE_HASH; i++)
+	{
+		for (entry = search->negCache[i]; entry; entry = next)
+		{
+			next = entry->next;
+			Z_Free(entry);
+		}
+
+		search->negCache[i] = NULL;
+	}
+
+	search->numNegEntries = 0;
+}
+
+static void FS_NegCacheAdd(fsSearchPath_t *search, const char *name)
+{
+	fsNegEntry_t *entry;
+	unsigned hash;
+
+	if (search->numNegEntries >= FS_NEGCACHE_MAX)
+	{
+		FS_NegCacheFlush(search);
+	}
+
+	hash = FS_HashFileName(name, false) & (FS_NEGCACHE_HASH - 1);
+
+	entry = Z_Malloc(sizeof(fsNegEntry_t));
+	Q_strlcpy(entry->name, name, sizeof(entry->name));
+	entry->next = search->negCache[hash];
+	search->negCache[hash] = entry;
+	search->numNegEntries++;
+}
+
+/*
+ * Must be called whenever files may have been created inside
+ * the game tree behind the filesystem's back (downloads, etc).
+ */
+void FS_FlushNegativeCache(void)
+{
+	fsSearchPath_t *search;
+
+	for (search = fs_searchPaths; search; search = search->next)
+	{
+		if (search->numNegEntries)
+		{
+			FS_NegCacheFlush(search);
+		}
+	}
+}
+
 /*
  * Creates any directories needed to store the given filename.
  */
@@ -208,6 +594,9 @@ qboolean FS_CreatePath(char *path)
 
 	FS_DPrintf("FS_CreatePath(%s)\n", path);
 
+	/* Whatever gets written there must be found afterwards. */
+	FS_FlushNegativeCache();
+
 	if (strstr(path, "..") != NULL)
 	{
 		Com_Printf("WARNING: refusing to create relative path '%s'.\n", path);
@@ -270,7 +659,7 @@ fsHandle_t* FS_HandleForFile(const char *path, fileHandle_t *f)
 	fsHandle_t *handle = fs_handles;
 	for (int i = 0; i < MAX_HANDLES; i++, handle++)
 	{
-		if ((handle->file == NULL)
+		if ((handle->file == NULL) && (handle->pack == NULL)
 		    #ifdef ZIP
 		    && (handle->zip == NULL)
 		    #endif
@@ -369,7 +758,16 @@ void FS_FCloseFile(fileHandle_t f)
 	if (handle->zip)
 	{
 		unzCloseCurrentFile(handle->zip);
-		unzClose(handle->zip);
+
+		if (handle->pack && (handle->pack->pk3Owner == handle))
+		{
+			/* Stays open until the pack is freed. */
+			handle->pack->pk3Owner = NULL;
+		}
+		else
+		{
+			unzClose(handle->zip);
+		}
 	}
 	#endif
 
@@ -393,13 +791,13 @@ int Developer_searchpath(int who)
  * Finds the file in the search path. Returns filesize and an open FILE *. Used
  * for streaming data out of either a pak file or a seperate file.
  */
-int FS_FOpenFile(const char *name, fileHandle_t *f, qboolean gamedir_only)
+static int FS_FOpenFileSearch(const char *name, fileHandle_t *f, qboolean gamedir_only)
 {
 	char path[MAX_OSPATH];
 	fsHandle_t *handle;
 	fsPack_t *pack;
+	fsPackFile_t *file;
 	fsSearchPath_t *search;
-	int i;
 
 	file_from_pak = 0;
 	#ifdef ZIP
@@ -426,63 +824,81 @@ int FS_FOpenFile(const char *name, fileHandle_t *f, qboolean gamedir_only)
 		{
 			pack = search->pack;
 
-			for (i = 0; i < pack->numFiles; i++)
+			if ((file = FS_FindInPack(pack, handle->name)) != NULL)
 			{
-				if (Q_stricmp(pack->files[i].name, handle->name) == 0)
+				/* Found it! */
+				Com_FilePath(pack->name, fs_fileInPath, sizeof(fs_fileInPath));
+				fs_fileInPack = true;
+
+				if (fs_debug->value)
 				{
-					/* Found it! */
-					Com_FilePath(pack->name, fs_fileInPath, sizeof(fs_fileInPath));
-					fs_fileInPack = true;
+					Com_Printf("FS_FOpenFile: '%s' (found in '%s').\n",
+						handle->name, pack->name);
+				}
 
-					if (fs_debug->value)
-					{
-						Com_Printf("FS_FOpenFile: '%s' (found in '%s').\n",
-							handle->name, pack->name);
-					}
+				if (pack->pak)
+				{
+					/* PAK, read through the handle opened at mount time. */
+					file_from_pak = 1;
+					handle->pack = pack;
+					handle->packFile = file;
+					handle->position = 0;
+					return file->size;
+				}
+				#ifdef ZIP
+				else
+				if (pack->pk3)
+				{
+					/* PK3 */
+					file_from_pk3 = 1;
+					Q_strlcpy(file_from_pk3_name, strrchr(pack->name, '/') + 1, sizeof(file_from_pk3_name));
+					handle->pack = pack;
+					handle->packFile = file;
 
-					if (pack->pak)
+					if (pack->pk3Owner == NULL)
 					{
-						/* PAK */
-						file_from_pak = 1;
-						handle->file = fopen(pack->name, "rb");
-
-						if (handle->file)
-						{
-							fseek(handle->file, pack->files[i].offset, SEEK_SET);
-							return pack->files[i].size;
-						}
+						/* Reuse the archive opened at mount time. */
+						handle->zip = pack->pk3;
+						pack->pk3Owner = handle;
 					}
-					#ifdef ZIP
 					else
-					if (pack->pk3)
 					{
-						/* PK3 */
-						file_from_pk3 = 1;
-						Q_strlcpy(file_from_pk3_name, strrchr(pack->name, '/') + 1, sizeof(file_from_pk3_name));
+						/* Already streaming another member. */
 						handle->zip = unzOpen(pack->name);
+					}
 
-						if (handle->zip)
+					if (handle->zip)
+					{
+						if (unzGoToFilePos(handle->zip, &file->zipPos) == UNZ_OK)
 						{
-							if (unzLocateFile(handle->zip, handle->name, 2) == UNZ_OK)
+							if (unzOpenCurrentFile(handle->zip) == UNZ_OK)
 							{
-								if (unzOpenCurrentFile(handle->zip) == UNZ_OK)
+								if (file->stored && (file->offset == -1))
 								{
-									return pack->files[i].size;
+									file->offset = unzGetCurrentFileZStreamPos(handle->zip);
 								}
-							}
 
-							unzClose(handle->zip);
+								return file->size;
+							}
 						}
-					}
-					#endif
 
-					Com_Error(ERR_FATAL, "Couldn't reopen '%s'", pack->name);
+						FS_FCloseFile(*f);
+					}
 				}
+				#endif
+
+				Com_Error(ERR_FATAL, "Couldn't reopen '%s'", pack->name);
 			}
 		}
 		else
 		{
 			/* Search in a directory tree. */
+			if (fs_negcache->value && FS_NegCacheCheck(search, handle->name))
+			{
+				fs_stats.negHits++;
+				continue;
+			}
+
 			Com_sprintf(path, sizeof(path), "%s/%s", search->path, handle->name);
 
 			handle->file = fopen(path, "rb");
@@ -495,6 +911,11 @@ int FS_FOpenFile(const char *name, fileHandle_t *f, qboolean gamedir_only)
 
 			if (!handle->file)
 			{
+				if (fs_negcache->value)
+				{
+					FS_NegCacheAdd(search, handle->name);
+				}
+
 				continue;
 			}
 
@@ -504,30 +925,92 @@ int FS_FOpenFile(const char *name, fileHandle_t *f, qboolean gamedir_only)
 				Q_strlcpy(fs_fileInPath, search->path, sizeof(fs_fileInPath));
 				fs_fileInPack = false;
 
-				if (fs_debug->value)
-				{
-					Com_Printf("FS_FOpenFile: '%s' (found in '%s').\n",
-						handle->name, search->path);
-				}
+				if (fs_debug->value)
+				{
+					Com_Printf("FS_FOpenFile: '%s' (found in '%s').\n",
+						handle->name, search->path);
+				}
+
+				return FS_FileLength(handle->file);
+			}
+		}
+	}
+
+	/* Not found! */
+	fs_fileInPath[0] = 0;
+	fs_fileInPack = false;
+
+	if (fs_debug->value)
+	{
+		Com_Printf("FS_FOpenFile: couldn't find '%s'.\n", handle->name);
+	}
+
+	/* Couldn't open, so free the handle. */
+	memset(handle, 0, sizeof(*handle));
+	*f = 0;
+	return -1;
+}
+
+int FS_FOpenFile(const char *name, fileHandle_t *f, qboolean gamedir_only)
+{
+	int size;
+	long long start;
+
+	if (fs_negcache->modified)
+	{
+		/* Don't trust entries gathered before a toggle. */
+		FS_FlushNegativeCache();
+		fs_negcache->modified = false;
+	}
+
+	start = Sys_Microseconds();
+	size = FS_FOpenFileSearch(name, f, gamedir_only);
+	fs_stats.usec += Sys_Microseconds() - start;
+
+	fs_stats.lookups++;
+
+	if (size == -1)
+	{
+		fs_stats.misses++;
+	}
+	else if (fs_fileInPack)
+	{
+		fs_stats.packHits++;
+	}
+	else
+	{
+		fs_stats.dirHits++;
+	}
+
+	return size;
+}
+
+/*
+ * Reads from a PAK member, never past its end.
+ */
+static int FS_PackFileRead(fsHandle_t *handle, void *buffer, int length)
+{
+	int r;
+
+	if (length > handle->packFile->size - handle->position)
+	{
+		length = handle->packFile->size - handle->position;
+	}
 
-				return FS_FileLength(handle->file);
-			}
-		}
+	if (length <= 0)
+	{
+		return 0;
 	}
 
-	/* Not found! */
-	fs_fileInPath[0] = 0;
-	fs_fileInPack = false;
+	r = FS_PackRead(handle->pack->pak, handle->packFile->offset + handle->position,
+			buffer, length);
 
-	if (fs_debug->value)
+	if (r > 0)
 	{
-		Com_Printf("FS_FOpenFile: couldn't find '%s'.\n", handle->name);
+		handle->position += r;
 	}
 
-	/* Couldn't open, so free the handle. */
-	memset(handle, 0, sizeof(*handle));
-	*f = 0;
-	return -1;
+	return r;
 }
 
 /*
@@ -561,6 +1044,11 @@ int FS_Read(void *buffer, int size, fileHandle_t f)
 		}
 		#endif
 		else
+		if (handle->pack)
+		{
+			r = FS_PackFileRead(handle, buf, remaining);
+		}
+		else
 		{
 			return 0;
 		}
@@ -633,6 +1121,11 @@ int FS_FRead(void *buffer, int size, int count, fileHandle_t f)
 			}
 			#endif
 			else
+			if (handle->pack)
+			{
+				r = FS_PackFileRead(handle, buf, remaining);
+			}
+			else
 			{
 				return 0;
 			}
@@ -668,6 +1161,351 @@ int FS_FRead(void *buffer, int size, int count, fileHandle_t f)
 	return size;
 }
 
+/*
+ * The preload thread. Reads queued files one after another, in the
+ * order they were queued.
+ */
+static int FS_PreloadThread(void *data)
+{
+	fsPreload_t *preload;
+	byte *buf;
+	qboolean ok;
+	int i, num;
+	#ifdef _WIN32
+	FILE *pak = NULL; /* Own handle, the main thread seeks pack->pak. */
+	char pakName[MAX_OSPATH] = "";
+	#endif
+	#ifdef ZIP
+	unzFile *zip = NULL;
+	char zipName[MAX_OSPATH] = "";
+	#endif
+
+	while (1)
+	{
+		Sys_SemWait(fs_preloadWork);
+
+		Sys_LockMutex(fs_preloadLock);
+
+		num = fs_numPreloads;
+
+		for (i = 0, preload = fs_preloads; i < num; i++, preload++)
+		{
+			if (preload->state == PRELOAD_QUEUED)
+			{
+				preload->state = PRELOAD_LOADING;
+				break;
+			}
+		}
+
+		Sys_UnlockMutex(fs_preloadLock);
+
+		if (i == num)
+		{
+			#ifdef _WIN32
+			if (pak)
+			{
+				fclose(pak);
+				pak = NULL;
+				pakName[0] = '\0';
+			}
+			#endif
+
+			#ifdef ZIP
+			/* Idle, don't keep an archive that may go away. */
+			if (zip)
+			{
+				unzClose(zip);
+				zip = NULL;
+				zipName[0] = '\0';
+			}
+			#endif
+
+			continue;
+		}
+
+		buf = malloc(preload->size);
+		ok = false;
+
+		if (buf == NULL)
+		{
+			if (preload->file)
+			{
+				fclose(preload->file);
+			}
+		}
+		else
+		if (preload->file)
+		{
+			ok = (fread(buf, 1, preload->size, preload->file) == (size_t)preload->size);
+			fclose(preload->file);
+		}
+		else
+		if (preload->pack->pak)
+		{
+			#ifdef _WIN32
+			if (strcmp(pakName, preload->pack->name) != 0)
+			{
+				if (pak)
+				{
+					fclose(pak);
+				}
+
+				pak = fopen(preload->pack->name, "rb");
+				Q_strlcpy(pakName, preload->pack->name, sizeof(pakName));
+			}
+
+			ok = pak && (FS_PackRead(pak, preload->packFile->offset,
+						buf, preload->size) == preload->size);
+			#else
+			ok = (FS_PackRead(preload->pack->pak, preload->packFile->offset,
+						buf, preload->size) == preload->size);
+			#endif
+		}
+		#ifdef ZIP
+		else
+		{
+			if (strcmp(zipName, preload->pack->name) != 0)
+			{
+				if (zip)
+				{
+					unzClose(zip);
+				}
+
+				zip = unzOpen(preload->pack->name);
+				Q_strlcpy(zipName, preload->pack->name, sizeof(zipName));
+			}
+
+			if (zip &&
+			    (unzGoToFilePos(zip, &preload->packFile->zipPos) == UNZ_OK) &&
+			    (unzOpenCurrentFile(zip) == UNZ_OK))
+			{
+				ok = (unzReadCurrentFile(zip, buf, preload->size) == preload->size);
+				unzCloseCurrentFile(zip);
+			}
+		}
+		#endif
+
+		if (!ok)
+		{
+			free(buf);
+			buf = NULL;
+		}
+
+		Sys_LockMutex(fs_preloadLock);
+		preload->file = NULL;
+		preload->data = buf;
+		preload->state = PRELOAD_DONE;
+		Sys_UnlockMutex(fs_preloadLock);
+
+		Sys_SemPost(fs_preloadDone);
+	}
+
+	return 0;
+}
+
+static fsPreload_t* FS_FindPreload(const char *name)
+{
+	fsPreload_t *preload;
+	unsigned hash;
+	int i;
+
+	hash = FS_HashFileName(name, true);
+
+	for (i = 0, preload = fs_preloads; i < fs_numPreloads; i++, preload++)
+	{
+		if ((preload->hash == hash) && (Q_stricmp(preload->name, name) == 0))
+		{
+			return preload;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Queues a file to be read by the preload thread, so that a later
+ * FS_LoadFile doesn't have to wait for the disk or inflate. Files
+ * that FS_LoadFile maps anyway aren't worth queueing.
+ */
+void FS_PreloadFile(const char *name)
+{
+	fsPreload_t *preload;
+	fsHandle_t *handle;
+	fileHandle_t f;
+	FILE *raw;
+	int offset;
+	int size;
+
+	if ((fs_preload->value <= 0) || (fs_numPreloads == MAX_PRELOADS))
+	{
+		return;
+	}
+
+	if (FS_FindPreload(name))
+	{
+		return;
+	}
+
+	if (fs_preloadLock == NULL)
+	{
+		fs_preloadLock = Sys_CreateMutex();
+		fs_preloadWork = Sys_CreateSemaphore(0);
+		fs_preloadDone = Sys_CreateSemaphore(0);
+
+		if (Sys_CreateThread(FS_PreloadThread, NULL) == NULL)
+		{
+			Com_Printf("FS_PreloadFile: couldn't start the preload thread.\n");
+			Cvar_ForceSet("fs_preload", "0");
+			return;
+		}
+	}
+
+	if ((size = FS_FOpenFile(name, &f, false)) <= 0)
+	{
+		if (f)
+		{
+			FS_FCloseFile(f);
+		}
+
+		return;
+	}
+
+	handle = FS_GetFileByHandle(f);
+
+	if ((fs_preloadBytes + size > fs_preload->value * 1024 * 1024) ||
+	    FS_CanMapFile(handle, size, &raw, &offset))
+	{
+		FS_FCloseFile(f);
+		return;
+	}
+
+	preload = &fs_preloads[fs_numPreloads];
+	memset(preload, 0, sizeof(*preload));
+	Q_strlcpy(preload->name, name, sizeof(preload->name));
+	preload->hash = FS_HashFileName(name, true);
+	preload->size = size;
+
+	if (handle->file)
+	{
+		/* Handed over to the preload thread. */
+		preload->file = handle->file;
+		handle->file = NULL;
+	}
+	else
+	{
+		preload->pack = handle->pack;
+		preload->packFile = handle->packFile;
+	}
+
+	FS_FCloseFile(f);
+	fs_preloadBytes += size;
+
+	Sys_LockMutex(fs_preloadLock);
+	preload->state = PRELOAD_QUEUED;
+	fs_numPreloads++;
+	Sys_UnlockMutex(fs_preloadLock);
+
+	Sys_SemPost(fs_preloadWork);
+}
+
+/*
+ * Returns the size of a preloaded file and a copy of it in buffer,
+ * or -1 when the file has to be loaded as usual. A file the preload
+ * thread didn't start on yet is taken back instead of waited for.
+ */
+static int FS_LoadPreloadedFile(const char *path, void **buffer)
+{
+	fsPreload_t *preload;
+	int size = -1;
+
+	if ((preload = FS_FindPreload(path)) == NULL)
+	{
+		return -1;
+	}
+
+	Sys_LockMutex(fs_preloadLock);
+
+	while (preload->state == PRELOAD_LOADING)
+	{
+		Sys_UnlockMutex(fs_preloadLock);
+		Sys_SemWait(fs_preloadDone);
+		Sys_LockMutex(fs_preloadLock);
+	}
+
+	if (preload->state == PRELOAD_QUEUED)
+	{
+		if (preload->file)
+		{
+			fclose(preload->file);
+			preload->file = NULL;
+		}
+
+		preload->state = PRELOAD_DONE;
+	}
+
+	Sys_UnlockMutex(fs_preloadLock);
+
+	if (preload->data)
+	{
+		size = preload->size;
+
+		if (buffer)
+		{
+			*buffer = Z_Malloc(size);
+			memcpy(*buffer, preload->data, size);
+		}
+
+		fs_stats.preloaded++;
+	}
+
+	return size;
+}
+
+/*
+ * Drops everything that was preloaded. Must be called before the
+ * packs are freed, and once loading is over.
+ */
+void FS_PreloadClear(void)
+{
+	fsPreload_t *preload;
+	int i;
+
+	if (fs_numPreloads == 0)
+	{
+		return;
+	}
+
+	Sys_LockMutex(fs_preloadLock);
+
+	for (i = 0, preload = fs_preloads; i < fs_numPreloads; i++, preload++)
+	{
+		if (preload->state == PRELOAD_QUEUED)
+		{
+			if (preload->file)
+			{
+				fclose(preload->file);
+				preload->file = NULL;
+			}
+
+			preload->state = PRELOAD_DONE;
+		}
+
+		while (preload->state == PRELOAD_LOADING)
+		{
+			Sys_UnlockMutex(fs_preloadLock);
+			Sys_SemWait(fs_preloadDone);
+			Sys_LockMutex(fs_preloadLock);
+		}
+
+		free(preload->data);
+	}
+
+	fs_numPreloads = 0;
+	fs_preloadBytes = 0;
+
+	Sys_UnlockMutex(fs_preloadLock);
+}
+
 /*
  * Filename are reletive to the quake search path. A null buffer will just
  * return the file length without loading.
@@ -679,6 +1517,12 @@ int FS_LoadFile(char *path, void **buffer)
 	fileHandle_t f; /* File handle. */
 
 	buf = NULL;
+
+	if (fs_numPreloads && ((size = FS_LoadPreloadedFile(path, buffer)) != -1))
+	{
+		return size;
+	}
+
 	size = FS_FOpenFile(path, &f, false);
 
 	if (size <= 0)
@@ -697,10 +1541,16 @@ int FS_LoadFile(char *path, void **buffer)
 		return size;
 	}
 
-	buf = Z_Malloc(size);
-	*buffer = buf;
+	/* Uncompressed archive members are mapped, not copied. */
+	buf = FS_MapFile(FS_GetFileByHandle(f), size);
+
+	if (buf == NULL)
+	{
+		buf = Z_Malloc(size);
+		FS_Read(buf, size, f);
+	}
 
-	FS_Read(buf, size, f);
+	*buffer = buf;
 	FS_FCloseFile(f);
 
 	return size;
@@ -708,12 +1558,29 @@ int FS_LoadFile(char *path, void **buffer)
 
 void FS_FreeFile(void *buffer)
 {
+	#ifndef _WIN32
+	fsView_t *view;
+	int i;
+	#endif
+
 	if (buffer == NULL)
 	{
 		FS_DPrintf("FS_FreeFile: NULL buffer.\n");
 		return;
 	}
 
+	#ifndef _WIN32
+	for (i = 0, view = fs_views; i < MAX_HANDLES; i++, view++)
+	{
+		if (view->data == buffer)
+		{
+			munmap(view->base, view->length);
+			memset(view, 0, sizeof(*view));
+			return;
+		}
+	}
+	#endif
+
 	Z_Free(buffer);
 }
 
@@ -783,6 +1650,7 @@ fsPack_t* FS_LoadPAK(const char *packPath)
 	#endif
 	pack->numFiles = numFiles;
 	pack->files = files;
+	FS_BuildPackHash(pack);
 
 	Com_Printf("Added packfile '%s' (%i files).\n", pack, numFiles);
 
@@ -841,8 +1709,10 @@ fsPack_t* FS_LoadPK3(const char *packPath)
 		unzGetCurrentFileInfo(handle, &info, fileName, MAX_QPATH,
 			NULL, 0, NULL, 0);
 		Q_strlcpy(files[i].name, fileName, sizeof(files[i].name));
-		files[i].offset = -1; /* Not used in ZIP files */
+		files[i].offset = -1; /* Found on first open. */
 		files[i].size = info.uncompressed_size;
+		files[i].stored = (info.compression_method == 0) && !(info.flag & 1);
+		unzGetFilePos(handle, &files[i].zipPos);
 		i++;
 		status = unzGoToNextFile(handle);
 	}
@@ -851,8 +1721,10 @@ fsPack_t* FS_LoadPK3(const char *packPath)
 	Q_strlcpy(pack->name, packPath, sizeof(pack->name));
 	pack->pak = NULL;
 	pack->pk3 = handle;
+	pack->pk3Raw = fopen(packPath, "rb");
 	pack->numFiles = numFiles;
 	pack->files = files;
+	FS_BuildPackHash(pack);
 
 	Com_Printf("Added packfile '%s' (%i files).\n", pack, numFiles);
 
@@ -1068,7 +1940,7 @@ void FS_Path_f()
 
 	for (i = 0, handle = fs_handles; i < MAX_HANDLES; i++, handle++)
 	{
-		if ((handle->file != NULL)
+		if ((handle->file != NULL) || (handle->pack != NULL)
 		    #ifdef ZIP
 		    || (handle->zip != NULL)
 		    #endif
@@ -1091,6 +1963,24 @@ void FS_Path_f()
 	#endif
 }
 
+void FS_Stats_f()
+{
+	if ((Cmd_Argc() == 2) && (Q_stricmp(Cmd_Argv(1), "reset") == 0))
+	{
+		memset(&fs_stats, 0, sizeof(fs_stats));
+		return;
+	}
+
+	Com_Printf("%i lookups, %i hits (%i in packs, %i in directories), %i misses.\n",
+		fs_stats.lookups, fs_stats.packHits + fs_stats.dirHits,
+		fs_stats.packHits, fs_stats.dirHits, fs_stats.misses);
+	Com_Printf("%i directory probes skipped by the negative cache.\n",
+		fs_stats.negHits);
+	Com_Printf("%i files loaded without a copy, %i from the preload cache.\n",
+		fs_stats.mapped, fs_stats.preloaded);
+	Com_Printf("%lld usec spent in lookups.\n", fs_stats.usec);
+}
+
 /*
  * Sets the gamedir and path to a different directory.
  */
@@ -1105,25 +1995,19 @@ void FS_SetGamedir(char *dir)
 		return;
 	}
 
+	/* Nothing may read from the old packs anymore. */
+	FS_PreloadClear();
+
 	/* Free up any current game dir info. */
 	while (fs_searchPaths != fs_baseSearchPaths)
 	{
 		if (fs_searchPaths->pack)
 		{
-			if (fs_searchPaths->pack->pak)
-			{
-				fclose(fs_searchPaths->pack->pak);
-			}
-
-			#ifdef ZIP
-			if (fs_searchPaths->pack->pk3)
-			{
-				unzClose(fs_searchPaths->pack->pk3);
-			}
-			#endif
-
-			Z_Free(fs_searchPaths->pack->files);
-			Z_Free(fs_searchPaths->pack);
+			FS_FreePack(fs_searchPaths->pack);
+		}
+		else
+		{
+			FS_NegCacheFlush(fs_searchPaths);
 		}
 
 		next = fs_searchPaths->next;
@@ -1135,13 +2019,13 @@ void FS_SetGamedir(char *dir)
 	for (i = 0; i < MAX_HANDLES; i++)
 	{
 		if (strstr(fs_handles[i].name, dir) &&
-		    ((fs_handles[i].file != NULL)
+		    ((fs_handles[i].file != NULL) || (fs_handles[i].pack != NULL)
 		     #ifdef ZIP
 		     || (fs_handles[i].zip != NULL)
 		     #endif
 		    ))
 		{
-			FS_FCloseFile(i);
+			FS_FCloseFile(i + 1);
 		}
 	}
 
@@ -1533,6 +2417,7 @@ void FS_InitFilesystem()
 	Cmd_AddCommand("path", FS_Path_f);
 	Cmd_AddCommand("link", FS_Link_f);
 	Cmd_AddCommand("dir", FS_Dir_f);
+	Cmd_AddCommand("fs_stats", FS_Stats_f);
 
 	/* basedir <path> Allows the game to run from outside the data tree.  */
 	fs_basedir = Cvar_Get("basedir", ".", CVAR_NOSET);
@@ -1544,6 +2429,13 @@ void FS_InitFilesystem()
 	/* Debug flag. */
 	fs_debug = Cvar_Get("fs_debug", "0", 0);
 
+	/* Remember files missing from directory trees. */
+	fs_negcache = Cvar_Get("fs_negcache", "1", 0);
+
+	/* Megabytes of files read ahead in the background while
+	   a level loads, 0 disables the preload thread. */
+	fs_preload = Cvar_Get("fs_preload", "64", CVAR_ARCHIVE);
+
 	/* Game directory. */
 	fs_gamedirvar = Cvar_Get("game", "", CVAR_LATCH | CVAR_SERVERINFO);
 
@@ -45,7 +45,6 @@ cvar_t *dedicated;
 
 extern cvar_t *consoleLogFile;
 extern jmp_buf abortframe; /* an ERR_DROP occured, exit the entire frame */
-extern zhead_t z_chain;
 
 static byte chktbl[1024] =
 {
@@ -116,10 +115,12 @@ static byte chktbl[1024] =
 };
 
 /* host_speeds times */
-int time_before_game;
-int time_after_game;
-int time_before_ref;
-int time_after_ref;
+long long time_before_game;
+long long time_after_game;
+long long time_before_ref;
+long long time_after_ref;
+
+long long com_frameclock;
 
 /*
  * For proxy protecting
@@ -189,8 +190,6 @@ static void Qcommon_Init(int argc, char **argv)
 		Sys_Error("Error during initialization");
 	}
 
-	z_chain.next = z_chain.prev = &z_chain;
-
 //	extern bool IN_processEvent(SDL_Event *event);
 //	sdlwInitialize(IN_processEvent, 0);
 //	sdlwEnableDefaultEventManagement(false);
@@ -227,6 +226,9 @@ static void Qcommon_Init(int argc, char **argv)
 
 	/* init commands and vars */
 	Cmd_AddCommand("z_stats", Z_Stats_f);
+	Cmd_AddCommand("cm_stats", CM_Stats_f);
+	Cmd_AddCommand("cm_tracebench", CM_TraceBench_f);
+	Cmd_AddCommand("cm_simdtest", CM_SimdTest_f);
 	Cmd_AddCommand("error", Com_Error_f);
 
 	host_speeds = Cvar_Get("host_speeds", "0", 0);
@@ -343,11 +345,14 @@ void Qcommon_Frame(int msec_)
 	{
 		extern int c_traces, c_brush_traces;
 		extern int c_pointcontents;
+		extern int c_cachedtraces;
 
-		Com_Printf("%4i traces  %4i points\n", c_traces, c_pointcontents);
+		Com_Printf("%4i traces  %4i points  %4i cached\n", c_traces,
+				c_pointcontents, c_cachedtraces);
 		c_traces = 0;
 		c_brush_traces = 0;
 		c_pointcontents = 0;
+		c_cachedtraces = 0;
 	}
 	#endif
 
@@ -366,15 +371,15 @@ void Qcommon_Frame(int msec_)
 	Cbuf_Execute();
 
 	#ifndef DEDICATED_ONLY
-	int time_before = 0;
-	int time_between = 0;
-	int time_after;
+	long long time_before = 0;
+	long long time_between = 0;
+	long long time_after;
 	#endif
 
 	#ifndef DEDICATED_ONLY
 	if (host_speeds->value)
 	{
-		time_before = Sys_Milliseconds();
+		time_before = Sys_Microseconds();
 	}
 	#endif
 
@@ -383,16 +388,16 @@ void Qcommon_Frame(int msec_)
 	#ifndef DEDICATED_ONLY
 	if (host_speeds->value)
 	{
-		time_between = Sys_Milliseconds();
+		time_between = Sys_Microseconds();
 	}
 
 	CL_Frame(msec);
 
 	if (host_speeds->value)
 	{
-		int all, sv, gm, cl, rf;
+		long long all, sv, gm, cl, rf;
 
-		time_after = Sys_Milliseconds();
+		time_after = Sys_Microseconds();
 		all = time_after - time_before;
 		sv = time_between - time_before;
 		cl = time_after - time_between;
@@ -400,8 +405,8 @@ void Qcommon_Frame(int msec_)
 		rf = time_after_ref - time_before_ref;
 		sv -= gm;
 		cl -= rf;
-		Com_Printf("all:%3i sv:%3i gm:%3i cl:%3i rf:%3i\n",
-			all, sv, gm, cl, rf);
+		Com_Printf("all:%7.3f sv:%7.3f gm:%7.3f cl:%7.3f rf:%7.3f\n",
+			all * 0.001, sv * 0.001, gm * 0.001, cl * 0.001, rf * 0.001);
 	}
 	#endif
 }
@@ -459,7 +464,7 @@ void Qcommon_Run(int argc, char **argv)
 	/* Do not delay reads on stdin*/
 	//fcntl(fileno(stdin), F_SETFL, fcntl(fileno(stdin), F_GETFL, NULL) | O_NONBLOCK);
 
-	int oldtime = Sys_Milliseconds();
+	com_frameclock = Sys_Microseconds();
 
 	/* The legendary Quake II mainloop */
 	while (1)
@@ -467,16 +472,18 @@ void Qcommon_Run(int argc, char **argv)
 //		if (sdlwIsExitRequested())
 //			Com_Quit();
 
-		/* find time spent rendering last frame */
-		int newtime, time;
+		/* find time spent rendering last frame, the part
+		   of a millisecond left over goes to the next one */
+		int time;
 		do
 		{
-			newtime = Sys_Milliseconds();
-			time = newtime - oldtime;
+			time = (int)((Sys_Microseconds() - com_frameclock) / 1000);
 		}
 		while (time < 1);
 
+		com_frameclock += time * 1000LL;
+		Sys_Milliseconds(); /* update curtime */
+
 		Qcommon_Frame(time);
-		oldtime = newtime;
 	}
 }
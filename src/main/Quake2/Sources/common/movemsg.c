@@ -25,6 +25,7 @@
  */
 
 #include "common/common.h"
+#include "common/msgblock.h"
 
 vec3_t bytedirs[NUMVERTEXNORMALS] =
 {
@@ -417,6 +418,8 @@ void MSG_ReadDir(sizebuf_t *sb, vec3_t dir)
  */
 void MSG_WriteDeltaEntity(entity_state_t *from, entity_state_t *to, sizebuf_t *msg, qboolean force, qboolean newentity)
 {
+	byte scratch[MSG_MAXDELTAENTITY];
+	byte *p, *start;
 	int bits;
 
 	if (!to->number)
@@ -592,161 +595,318 @@ void MSG_WriteDeltaEntity(entity_state_t *from, entity_state_t *to, sizebuf_t *m
 		bits |= U_MOREBITS1;
 	}
 
-	MSG_WriteByte(msg, bits & 255);
+	p = start = MSG_BeginBlock(msg, scratch, MSG_MAXDELTAENTITY);
+
+	p = MSG_PutByte(p, bits & 255);
 
 	if (bits & 0xff000000)
 	{
-		MSG_WriteByte(msg, (bits >> 8) & 255);
-		MSG_WriteByte(msg, (bits >> 16) & 255);
-		MSG_WriteByte(msg, (bits >> 24) & 255);
+		p = MSG_PutByte(p, (bits >> 8) & 255);
+		p = MSG_PutByte(p, (bits >> 16) & 255);
+		p = MSG_PutByte(p, (bits >> 24) & 255);
 	}
 	else
 	if (bits & 0x00ff0000)
 	{
-		MSG_WriteByte(msg, (bits >> 8) & 255);
-		MSG_WriteByte(msg, (bits >> 16) & 255);
+		p = MSG_PutByte(p, (bits >> 8) & 255);
+		p = MSG_PutByte(p, (bits >> 16) & 255);
 	}
 	else
 	if (bits & 0x0000ff00)
 	{
-		MSG_WriteByte(msg, (bits >> 8) & 255);
+		p = MSG_PutByte(p, (bits >> 8) & 255);
 	}
 
 	if (bits & U_NUMBER16)
 	{
-		MSG_WriteShort(msg, to->number);
+		p = MSG_PutShort(p, to->number);
 	}
 	else
 	{
-		MSG_WriteByte(msg, to->number);
+		p = MSG_PutByte(p, to->number);
 	}
 
 	if (bits & U_MODEL)
 	{
-		MSG_WriteByte(msg, to->modelindex);
+		p = MSG_PutByte(p, to->modelindex);
 	}
 
 	if (bits & U_MODEL2)
 	{
-		MSG_WriteByte(msg, to->modelindex2);
+		p = MSG_PutByte(p, to->modelindex2);
 	}
 
 	if (bits & U_MODEL3)
 	{
-		MSG_WriteByte(msg, to->modelindex3);
+		p = MSG_PutByte(p, to->modelindex3);
 	}
 
 	if (bits & U_MODEL4)
 	{
-		MSG_WriteByte(msg, to->modelindex4);
+		p = MSG_PutByte(p, to->modelindex4);
 	}
 
 	if (bits & U_FRAME8)
 	{
-		MSG_WriteByte(msg, to->frame);
+		p = MSG_PutByte(p, to->frame);
 	}
 
 	if (bits & U_FRAME16)
 	{
-		MSG_WriteShort(msg, to->frame);
+		p = MSG_PutShort(p, to->frame);
 	}
 
 	if ((bits & U_SKIN8) && (bits & U_SKIN16)) /*used for laser colors */
 	{
-		MSG_WriteLong(msg, to->skinnum);
+		p = MSG_PutLong(p, to->skinnum);
 	}
 	else
 	if (bits & U_SKIN8)
 	{
-		MSG_WriteByte(msg, to->skinnum);
+		p = MSG_PutByte(p, to->skinnum);
 	}
 	else
 	if (bits & U_SKIN16)
 	{
-		MSG_WriteShort(msg, to->skinnum);
+		p = MSG_PutShort(p, to->skinnum);
 	}
 
 	if ((bits & (U_EFFECTS8 | U_EFFECTS16)) == (U_EFFECTS8 | U_EFFECTS16))
 	{
-		MSG_WriteLong(msg, to->effects);
+		p = MSG_PutLong(p, to->effects);
 	}
 	else
 	if (bits & U_EFFECTS8)
 	{
-		MSG_WriteByte(msg, to->effects);
+		p = MSG_PutByte(p, to->effects);
 	}
 	else
 	if (bits & U_EFFECTS16)
 	{
-		MSG_WriteShort(msg, to->effects);
+		p = MSG_PutShort(p, to->effects);
 	}
 
 	if ((bits & (U_RENDERFX8 | U_RENDERFX16)) == (U_RENDERFX8 | U_RENDERFX16))
 	{
-		MSG_WriteLong(msg, to->renderfx);
+		p = MSG_PutLong(p, to->renderfx);
 	}
 	else
 	if (bits & U_RENDERFX8)
 	{
-		MSG_WriteByte(msg, to->renderfx);
+		p = MSG_PutByte(p, to->renderfx);
 	}
 	else
 	if (bits & U_RENDERFX16)
 	{
-		MSG_WriteShort(msg, to->renderfx);
+		p = MSG_PutShort(p, to->renderfx);
 	}
 
 	if (bits & U_ORIGIN1)
 	{
-		MSG_WriteCoord(msg, to->origin[0]);
+		p = MSG_PutCoord(p, to->origin[0]);
 	}
 
 	if (bits & U_ORIGIN2)
 	{
-		MSG_WriteCoord(msg, to->origin[1]);
+		p = MSG_PutCoord(p, to->origin[1]);
 	}
 
 	if (bits & U_ORIGIN3)
 	{
-		MSG_WriteCoord(msg, to->origin[2]);
+		p = MSG_PutCoord(p, to->origin[2]);
 	}
 
 	if (bits & U_ANGLE1)
 	{
-		MSG_WriteAngle(msg, to->angles[0]);
+		p = MSG_PutAngle(p, to->angles[0]);
 	}
 
 	if (bits & U_ANGLE2)
 	{
-		MSG_WriteAngle(msg, to->angles[1]);
+		p = MSG_PutAngle(p, to->angles[1]);
 	}
 
 	if (bits & U_ANGLE3)
 	{
-		MSG_WriteAngle(msg, to->angles[2]);
+		p = MSG_PutAngle(p, to->angles[2]);
 	}
 
 	if (bits & U_OLDORIGIN)
 	{
-		MSG_WriteCoord(msg, to->old_origin[0]);
-		MSG_WriteCoord(msg, to->old_origin[1]);
-		MSG_WriteCoord(msg, to->old_origin[2]);
+		p = MSG_PutCoord(p, to->old_origin[0]);
+		p = MSG_PutCoord(p, to->old_origin[1]);
+		p = MSG_PutCoord(p, to->old_origin[2]);
 	}
 
 	if (bits & U_SOUND)
 	{
-		MSG_WriteByte(msg, to->sound);
+		p = MSG_PutByte(p, to->sound);
 	}
 
 	if (bits & U_EVENT)
 	{
-		MSG_WriteByte(msg, to->event);
+		p = MSG_PutByte(p, to->event);
 	}
 
 	if (bits & U_SOLID)
 	{
-		MSG_WriteShort(msg, to->solid);
+		p = MSG_PutShort(p, to->solid);
+	}
+
+	MSG_EndBlock(msg, scratch, start, p);
+}
+
+/*
+ * Reads the fields of an entity delta, the header bits and the
+ * number were already read by the caller. Can go from either a
+ * baseline or a previous packet_entity.
+ */
+void MSG_ReadDeltaEntity(sizebuf_t *msg, entity_state_t *from, entity_state_t *to, int number, int bits)
+{
+	byte scratch[MSG_MAXDELTAENTITY];
+	const byte *p, *start;
+
+	/* set everything to the state we are delta'ing from */
+	*to = *from;
+
+	VectorCopy(from->origin, to->old_origin);
+	to->number = number;
+
+	p = start = MSG_BeginReadBlock(msg, scratch, MSG_MAXDELTAENTITY);
+
+	if (bits & U_MODEL)
+	{
+		to->modelindex = MSG_GetByte(&p);
+	}
+
+	if (bits & U_MODEL2)
+	{
+		to->modelindex2 = MSG_GetByte(&p);
+	}
+
+	if (bits & U_MODEL3)
+	{
+		to->modelindex3 = MSG_GetByte(&p);
+	}
+
+	if (bits & U_MODEL4)
+	{
+		to->modelindex4 = MSG_GetByte(&p);
+	}
+
+	if (bits & U_FRAME8)
+	{
+		to->frame = MSG_GetByte(&p);
+	}
+
+	if (bits & U_FRAME16)
+	{
+		to->frame = MSG_GetShort(&p);
+	}
+
+	/* used for laser colors */
+	if ((bits & U_SKIN8) && (bits & U_SKIN16))
+	{
+		to->skinnum = MSG_GetLong(&p);
+	}
+	else
+	if (bits & U_SKIN8)
+	{
+		to->skinnum = MSG_GetByte(&p);
+	}
+	else
+	if (bits & U_SKIN16)
+	{
+		to->skinnum = MSG_GetShort(&p);
+	}
+
+	if ((bits & (U_EFFECTS8 | U_EFFECTS16)) == (U_EFFECTS8 | U_EFFECTS16))
+	{
+		to->effects = MSG_GetLong(&p);
+	}
+	else
+	if (bits & U_EFFECTS8)
+	{
+		to->effects = MSG_GetByte(&p);
+	}
+	else
+	if (bits & U_EFFECTS16)
+	{
+		to->effects = MSG_GetShort(&p);
 	}
+
+	if ((bits & (U_RENDERFX8 | U_RENDERFX16)) == (U_RENDERFX8 | U_RENDERFX16))
+	{
+		to->renderfx = MSG_GetLong(&p);
+	}
+	else
+	if (bits & U_RENDERFX8)
+	{
+		to->renderfx = MSG_GetByte(&p);
+	}
+	else
+	if (bits & U_RENDERFX16)
+	{
+		to->renderfx = MSG_GetShort(&p);
+	}
+
+	if (bits & U_ORIGIN1)
+	{
+		to->origin[0] = MSG_GetCoord(&p);
+	}
+
+	if (bits & U_ORIGIN2)
+	{
+		to->origin[1] = MSG_GetCoord(&p);
+	}
+
+	if (bits & U_ORIGIN3)
+	{
+		to->origin[2] = MSG_GetCoord(&p);
+	}
+
+	if (bits & U_ANGLE1)
+	{
+		to->angles[0] = MSG_GetAngle(&p);
+	}
+
+	if (bits & U_ANGLE2)
+	{
+		to->angles[1] = MSG_GetAngle(&p);
+	}
+
+	if (bits & U_ANGLE3)
+	{
+		to->angles[2] = MSG_GetAngle(&p);
+	}
+
+	if (bits & U_OLDORIGIN)
+	{
+		to->old_origin[0] = MSG_GetCoord(&p);
+		to->old_origin[1] = MSG_GetCoord(&p);
+		to->old_origin[2] = MSG_GetCoord(&p);
+	}
+
+	if (bits & U_SOUND)
+	{
+		to->sound = MSG_GetByte(&p);
+	}
+
+	if (bits & U_EVENT)
+	{
+		to->event = MSG_GetByte(&p);
+	}
+	else
+	{
+		to->event = 0;
+	}
+
+	if (bits & U_SOLID)
+	{
+		to->solid = MSG_GetShort(&p);
+	}
+
+	MSG_EndReadBlock(msg, start, p);
 }
 
 void MSG_BeginReading(sizebuf_t *msg)
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 1997-2001 Id Software, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Message blocks. A block is a run of fields with a known maximum size,
+ * like an entity delta or a player state. Its bounds are checked once,
+ * then the fields are stored or loaded through a plain pointer instead
+ * of going through SZ_GetSpace and the MSG_Read* checks one by one.
+ *
+ * When a sizebuf has less room than the maximum the block goes through
+ * a scratch buffer, so overflows and over-reads behave as if the block
+ * was a single SZ_Write or MSG_ReadData.
+ *
+ * =======================================================================
+ */
+
+#ifndef CO_MSGBLOCK_H
+#define CO_MSGBLOCK_H
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+ #define MSGBLOCK_LITTLE
+#elif defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64)
+ #define MSGBLOCK_LITTLE
+#endif
+
+/* largest entity delta, header bits included and both
+   frame sizes, which only a broken server sends */
+#define MSG_MAXDELTAENTITY 44
+
+/*
+ * Returns where the block is written to, maxlength must be
+ * large enough for every field that will be put.
+ */
+static inline byte *MSG_BeginBlock(sizebuf_t *sb, byte *scratch, int maxlength)
+{
+	if (sb->cursize + maxlength <= sb->maxsize)
+	{
+		return sb->data + sb->cursize;
+	}
+
+	return scratch;
+}
+
+static inline void MSG_EndBlock(sizebuf_t *sb, byte *scratch, byte *start, byte *end)
+{
+	if (start == scratch)
+	{
+		SZ_Write(sb, scratch, (int)(end - start));
+	}
+	else
+	{
+		sb->cursize += (int)(end - start);
+	}
+}
+
+static inline byte *MSG_PutByte(byte *p, int c)
+{
+	p[0] = c;
+	return p + 1;
+}
+
+static inline byte *MSG_PutShort(byte *p, int c)
+{
+#ifdef MSGBLOCK_LITTLE
+	short s = c;
+
+	memcpy(p, &s, 2);
+#else
+	p[0] = c & 0xff;
+	p[1] = (c >> 8) & 0xff;
+#endif
+	return p + 2;
+}
+
+static inline byte *MSG_PutLong(byte *p, int c)
+{
+#ifdef MSGBLOCK_LITTLE
+	memcpy(p, &c, 4);
+#else
+	p[0] = c & 0xff;
+	p[1] = (c >> 8) & 0xff;
+	p[2] = (c >> 16) & 0xff;
+	p[3] = (c >> 24) & 0xff;
+#endif
+	return p + 4;
+}
+
+static inline byte *MSG_PutCoord(byte *p, float f)
+{
+	return MSG_PutShort(p, (int)(f * 8));
+}
+
+static inline byte *MSG_PutAngle(byte *p, float f)
+{
+	return MSG_PutByte(p, (int)(f * 256 / 360) & 255);
+}
+
+/*
+ * Returns where the block is read from. Past the end of the
+ * message the scratch buffer is zero filled, the caller still
+ * sees the over-read through readcount > cursize.
+ */
+static inline const byte *MSG_BeginReadBlock(sizebuf_t *sb, byte *scratch, int maxlength)
+{
+	int left;
+
+	left = sb->cursize - sb->readcount;
+
+	if (left >= maxlength)
+	{
+		return sb->data + sb->readcount;
+	}
+
+	memset(scratch, 0, maxlength);
+
+	if (left > 0)
+	{
+		memcpy(scratch, sb->data + sb->readcount, left);
+	}
+
+	return scratch;
+}
+
+static inline void MSG_EndReadBlock(sizebuf_t *sb, const byte *start, const byte *end)
+{
+	sb->readcount += (int)(end - start);
+}
+
+static inline int MSG_GetByte(const byte **p)
+{
+	int c;
+
+	c = (*p)[0];
+	*p += 1;
+
+	return c;
+}
+
+static inline int MSG_GetShort(const byte **p)
+{
+	short s;
+
+#ifdef MSGBLOCK_LITTLE
+	memcpy(&s, *p, 2);
+#else
+	s = (short)((*p)[0] + ((*p)[1] << 8));
+#endif
+	*p += 2;
+
+	return s;
+}
+
+static inline int MSG_GetLong(const byte **p)
+{
+	int c;
+
+#ifdef MSGBLOCK_LITTLE
+	memcpy(&c, *p, 4);
+#else
+	c = (*p)[0] + ((*p)[1] << 8) + ((*p)[2] << 16) + ((unsigned)(*p)[3] << 24);
+#endif
+	*p += 4;
+
+	return c;
+}
+
+static inline float MSG_GetCoord(const byte **p)
+{
+	return MSG_GetShort(p) * 0.125f;
+}
+
+static inline float MSG_GetAngle(const byte **p)
+{
+	return ((signed char)MSG_GetByte(p)) * 1.40625f;
+}
+
+#endif
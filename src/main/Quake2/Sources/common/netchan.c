@@ -79,15 +79,53 @@
  * frame, such as during the connection stage while waiting for the
  * client to load, then a packet only needs to be delivered if there is
  * something in the unacknowledged reliable
+ *
+ * fragments
+ * ---------
+ * If both sides know PROTOCOL_EXT_FRAGMENT, a message that doesn't
+ * fit into a packet is sent as up to net_maxfragments packets with
+ * the same sequence and bit 30 of it set. Each of them carries
+ *
+ * 16	offset of the fragment in the message
+ * 16	length of the fragment
+ *
+ * after the header. All but the last one are FRAGMENT_SIZE long,
+ * so a message of a multiple of that ends with an empty fragment.
+ * The fragments must arrive in order, if one is missing the whole
+ * message is lost, just like a single packet.
  */
 
+#define FRAGMENT_BIT (1 << 30)
+
 cvar_t *showpackets;
 cvar_t *showdrop;
 cvar_t *qport;
+cvar_t *net_maxfragments;
 
 netadr_t net_from;
 sizebuf_t net_message;
-byte net_message_buffer[MAX_MSGLEN];
+byte net_message_buffer[MAX_FRAGMSGLEN];
+
+/* for net_fragstats */
+static int net_fragmentedSent; /* messages */
+static int net_fragmentsSent;
+static int net_fragmentsDumped; /* messages over net_maxfragments */
+static int net_fragmentedReceived;
+static int net_fragmentedLost;
+
+static void Netchan_FragStats_f(void)
+{
+	Com_Printf("sent %i messages in %i fragments, %i too long\n",
+		net_fragmentedSent, net_fragmentsSent, net_fragmentsDumped);
+	Com_Printf("received %i messages, lost %i\n",
+		net_fragmentedReceived, net_fragmentedLost);
+
+	net_fragmentedSent = 0;
+	net_fragmentsSent = 0;
+	net_fragmentsDumped = 0;
+	net_fragmentedReceived = 0;
+	net_fragmentedLost = 0;
+}
 
 void Netchan_Init(void)
 {
@@ -99,6 +137,9 @@ void Netchan_Init(void)
 	showpackets = Cvar_Get("showpackets", "0", 0);
 	showdrop = Cvar_Get("showdrop", "0", 0);
 	qport = Cvar_Get("qport", va("%i", port), CVAR_NOSET);
+	net_maxfragments = Cvar_Get("net_maxfragments", "4", CVAR_ARCHIVE);
+
+	Cmd_AddCommand("net_fragstats", Netchan_FragStats_f);
 }
 
 /*
@@ -187,6 +228,90 @@ qboolean Netchan_NeedReliable(netchan_t *chan)
 	return send_reliable;
 }
 
+/*
+ * Length of reliable and unreliable data that fits
+ * into net_maxfragments fragments.
+ */
+static int Netchan_MaxFragmentedLength(void)
+{
+	int fragments;
+
+	fragments = (int)net_maxfragments->value;
+
+	if (fragments < 1)
+	{
+		fragments = 1;
+	}
+	else if (fragments > MAX_FRAGMENTS)
+	{
+		fragments = MAX_FRAGMENTS;
+	}
+
+	return fragments * FRAGMENT_SIZE - 1;
+}
+
+/*
+ * Returns how long the unreliable messages for the channel may
+ * be. For plain channels that's MAX_MSGLEN, they are dumped if
+ * reliable data goes first and leaves less room. Fragmented ones
+ * keep room for a whole reliable message.
+ */
+int Netchan_MaxMessageLength(netchan_t *chan)
+{
+	int length;
+
+	if (!chan->fragments || chan->fragments_paused)
+	{
+		return MAX_MSGLEN;
+	}
+
+	length = Netchan_MaxFragmentedLength() - (int)sizeof(chan->reliable_buf);
+
+	return (length > MAX_MSGLEN) ? length : MAX_MSGLEN;
+}
+
+/*
+ * Splits the packet in send into fragments after
+ * the header bytes.
+ */
+static void Netchan_TransmitFragments(netchan_t *chan, sizebuf_t *send, int header)
+{
+	sizebuf_t fragment;
+	byte fragment_buf[MAX_MSGLEN];
+	int offset, length;
+
+	offset = 0;
+
+	do
+	{
+		length = send->cursize - header - offset;
+
+		if (length > FRAGMENT_SIZE)
+		{
+			length = FRAGMENT_SIZE;
+		}
+
+		SZ_Init(&fragment, fragment_buf, sizeof(fragment_buf));
+		SZ_Write(&fragment, send->data, header);
+		fragment.data[3] |= FRAGMENT_BIT >> 24;
+
+		MSG_WriteShort(&fragment, offset);
+		MSG_WriteShort(&fragment, length);
+		SZ_Write(&fragment, send->data + header + offset, length);
+
+		chan->packets_sent++;
+		chan->bytes_sent += fragment.cursize;
+		NET_SendPacket(chan->sock, fragment.cursize, fragment.data,
+			chan->remote_address);
+
+		offset += length;
+		net_fragmentsSent++;
+	}
+	while (length == FRAGMENT_SIZE);
+
+	net_fragmentedSent++;
+}
+
 /*
  * tries to send an unreliable message to a connection, and handles the
  * transmition / retransmition of the reliable messages.
@@ -196,9 +321,10 @@ qboolean Netchan_NeedReliable(netchan_t *chan)
 void Netchan_Transmit(netchan_t *chan, int length, byte *data)
 {
 	sizebuf_t send;
-	byte send_buf[MAX_MSGLEN];
+	byte send_buf[MAX_FRAGMSGLEN];
 	qboolean send_reliable;
 	unsigned w1, w2;
+	int header;
 
 	/* check for message overflow */
 	if (chan->message.overflowed)
@@ -220,7 +346,7 @@ void Netchan_Transmit(netchan_t *chan, int length, byte *data)
 	}
 
 	/* write the packet header */
-	SZ_Init(&send, send_buf, sizeof(send_buf));
+	SZ_Init(&send, send_buf, MAX_MSGLEN);
 
 	w1 = (chan->outgoing_sequence & ~(1 << 31)) | (send_reliable << 31);
 	w2 =
@@ -239,6 +365,13 @@ void Netchan_Transmit(netchan_t *chan, int length, byte *data)
 		MSG_WriteShort(&send, qport->value);
 	}
 
+	header = send.cursize;
+
+	if (chan->fragments && !chan->fragments_paused)
+	{
+		send.maxsize = header + Netchan_MaxFragmentedLength();
+	}
+
 	/* copy the reliable message to the packet first */
 	if (send_reliable)
 	{
@@ -254,10 +387,25 @@ void Netchan_Transmit(netchan_t *chan, int length, byte *data)
 	else
 	{
 		Com_Printf("Netchan_Transmit: dumped unreliable\n");
+		chan->unreliable_dumped++;
+
+		if (chan->fragments && !chan->fragments_paused)
+		{
+			net_fragmentsDumped++;
+		}
 	}
 
 	/* send the datagram */
-	NET_SendPacket(chan->sock, send.cursize, send.data, chan->remote_address);
+	if (send.cursize > MAX_MSGLEN)
+	{
+		Netchan_TransmitFragments(chan, &send, header);
+	}
+	else
+	{
+		chan->packets_sent++;
+		chan->bytes_sent += send.cursize;
+		NET_SendPacket(chan->sock, send.cursize, send.data, chan->remote_address);
+	}
 
 	if (showpackets->value)
 	{
@@ -278,6 +426,87 @@ void Netchan_Transmit(netchan_t *chan, int length, byte *data)
 	}
 }
 
+/*
+ * Adds the fragment in msg to the message of the given sequence.
+ * Once it's complete, msg is made to look like it came in one
+ * packet and true is returned.
+ */
+static qboolean Netchan_Reassemble(netchan_t *chan, sizebuf_t *msg, int sequence)
+{
+	int header;
+	int offset, length;
+
+	header = msg->readcount;
+	offset = MSG_ReadShort(msg);
+	length = MSG_ReadShort(msg);
+
+	if ((length < 0) || (length > FRAGMENT_SIZE) ||
+	    (msg->readcount + length > msg->cursize))
+	{
+		if (showdrop->value)
+		{
+			Com_Printf("%s:Bad fragment at %i\n",
+				NET_AdrToString(chan->remote_address), sequence);
+		}
+
+		return false;
+	}
+
+	/* a fragment of a later message, the last one is lost */
+	if (sequence != chan->fragment_sequence)
+	{
+		if (chan->fragment_length)
+		{
+			net_fragmentedLost++;
+		}
+
+		chan->fragment_sequence = sequence;
+		chan->fragment_length = 0;
+	}
+
+	/* one in between got lost or is late */
+	if ((offset != chan->fragment_length) ||
+	    (offset + length > (int)sizeof(chan->fragment_buf)))
+	{
+		if (chan->fragment_length)
+		{
+			net_fragmentedLost++;
+		}
+
+		if (showdrop->value)
+		{
+			Com_Printf("%s:Dropped fragment at %i\n",
+				NET_AdrToString(chan->remote_address), sequence);
+		}
+
+		chan->fragment_length = 0;
+		return false;
+	}
+
+	memcpy(chan->fragment_buf + offset, msg->data + msg->readcount, length);
+	chan->fragment_length += length;
+
+	if (length == FRAGMENT_SIZE)
+	{
+		return false; /* more to come */
+	}
+
+	if (header + chan->fragment_length > msg->maxsize)
+	{
+		chan->fragment_length = 0;
+		return false;
+	}
+
+	memcpy(msg->data + header, chan->fragment_buf, chan->fragment_length);
+	msg->cursize = header + chan->fragment_length;
+	msg->readcount = header;
+
+	chan->fragment_length = 0;
+	net_fragmentedReceived++;
+
+	return true;
+}
+
 /*
  * called when the current net_message is from remote_address
  * modifies net_message so that it points to the packet payload
@@ -286,6 +515,10 @@ qboolean Netchan_Process(netchan_t *chan, sizebuf_t *msg)
 {
 	unsigned sequence, sequence_ack;
 	unsigned reliable_ack, reliable_message;
+	qboolean fragment;
+
+	chan->packets_received++;
+	chan->bytes_received += msg->cursize;
 
 	/* get sequence numbers */
 	MSG_BeginReading(msg);
@@ -300,10 +533,16 @@ qboolean Netchan_Process(netchan_t *chan, sizebuf_t *msg)
 
 	reliable_message = sequence >> 31;
 	reliable_ack = sequence_ack >> 31;
+	fragment = chan->fragments && (sequence & FRAGMENT_BIT);
 
 	sequence &= ~(1 << 31);
 	sequence_ack &= ~(1 << 31);
 
+	if (chan->fragments)
+	{
+		sequence &= ~FRAGMENT_BIT;
+	}
+
 	if (showpackets->value)
 	{
 		if (reliable_message)
@@ -334,6 +573,12 @@ qboolean Netchan_Process(netchan_t *chan, sizebuf_t *msg)
 		return false;
 	}
 
+	/* wait for the rest of the message */
+	if (fragment && !Netchan_Reassemble(chan, msg, sequence))
+	{
+		return false;
+	}
+
 	/* dropped packets don't keep the message from being used */
 	chan->dropped = sequence - (chan->incoming_sequence + 1);
 
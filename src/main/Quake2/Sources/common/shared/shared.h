@@ -286,6 +286,7 @@ void randk_seed(void);
 extern int curtime; /* time returned by last Sys_Milliseconds */
 
 int Sys_Milliseconds(void);
+long long Sys_Microseconds(void); /* monotonic, for time spans only */
 qboolean Sys_Mkdir(char *path);
 
 /* large block stack allocation routines */
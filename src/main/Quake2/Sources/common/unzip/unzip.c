@@ -1474,6 +1474,29 @@ unzFile file;
 	return (z_off_t)pfile_in_zip_read_info->stream.total_out;
 }
 
+/*
+   Give the position of the first byte of the (compressed) data of the
+   current file in the zipfile. Only meaningful right after
+   unzOpenCurrentFile, before anything was read.
+ */
+extern uLong ZEXPORT unzGetCurrentFileZStreamPos(file)
+unzFile file;
+{
+	unz_s * s;
+	file_in_zip_read_info_s * pfile_in_zip_read_info;
+	if (file == NULL)
+		return 0;
+
+	s = (unz_s *)file;
+	pfile_in_zip_read_info = s->pfile_in_zip_read;
+
+	if (pfile_in_zip_read_info == NULL)
+		return 0;
+
+	return pfile_in_zip_read_info->pos_in_zipfile +
+	       pfile_in_zip_read_info->byte_before_the_zipfile;
+}
+
 /*
    return 1 if the end of file was reached, 0 elsewhere
  */
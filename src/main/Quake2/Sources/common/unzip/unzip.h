@@ -316,6 +316,12 @@ extern int ZEXPORT unzeof OF((unzFile file));
    return 1 if the end of file was reached, 0 elsewhere
  */
 
+extern uLong ZEXPORT unzGetCurrentFileZStreamPos OF((unzFile file));
+/*
+   Give the position of the data of the current file in the zipfile,
+   valid right after unzOpenCurrentFile.
+ */
+
 extern int ZEXPORT unzGetLocalExtrafield OF((unzFile file,
 	                                     voidp buf,
 	                                     unsigned len));
@@ -19,7 +19,11 @@
  *
  * =======================================================================
  *
- * Zone malloc. It's just a normal malloc with tags.
+ * Zone malloc. Every tag owns its memory: small blocks are carved
+ * from per tag chunks, one chunk per size class, and handed out from
+ * the chunk's freelist. Larger blocks are malloc'ed on their own and
+ * linked to their tag. Freeing a tag releases its chunks and large
+ * blocks without looking at any other tag.
  *
  * =======================================================================
  */
@@ -28,13 +32,181 @@
 #include "common/zone.h"
 
 #define Z_MAGIC 0x1d1d
+#define Z_MAXTAGS 64 /* must be a power of two */
+#define Z_NUMCLASSES 6
+#define Z_MINCLASS 64 /* header included */
+#define Z_CHUNKSIZE 16384
 
-zhead_t z_chain;
+typedef struct zchunk_s
+{
+	struct zchunk_s *prev, *next;
+	struct ztag_s *owner;
+	zhead_t *free;
+	int size; /* of a slot */
+	int numSlots;
+	int used;
+	int pad;
+} zchunk_t;
+
+typedef struct ztag_s
+{
+	qboolean inuse;
+	short tag;
+	zhead_t blocks; /* large blocks */
+	zchunk_t *partial[Z_NUMCLASSES]; /* chunks with free slots */
+	zchunk_t *full[Z_NUMCLASSES];
+	int numChunks;
+	int count;
+	int bytes;
+	int peak;
+} ztag_t;
+
+static ztag_t z_tags[Z_MAXTAGS];
+static ztag_t *z_lastTag;
 int z_count, z_bytes;
 
+static ztag_t* Z_FindTag(int tag, qboolean create)
+{
+	ztag_t *t = NULL;
+	int i, j;
+
+	if (z_lastTag && (z_lastTag->tag == (short)tag))
+	{
+		return z_lastTag;
+	}
+
+	for (i = 0; i < Z_MAXTAGS; i++)
+	{
+		j = ((unsigned short)tag + i) & (Z_MAXTAGS - 1);
+		t = &z_tags[j];
+
+		if (!t->inuse)
+		{
+			if (!create)
+			{
+				return NULL;
+			}
+
+			t->inuse = true;
+			t->tag = (short)tag;
+			t->blocks.next = t->blocks.prev = &t->blocks;
+			break;
+		}
+
+		if (t->tag == (short)tag)
+		{
+			break;
+		}
+	}
+
+	if (i == Z_MAXTAGS)
+	{
+		if (!create)
+		{
+			return NULL;
+		}
+
+		Com_Error(ERR_FATAL, "Z_TagMalloc: more than %i tags", Z_MAXTAGS);
+	}
+
+	z_lastTag = t;
+
+	return t;
+}
+
+static void Z_UnlinkChunk(zchunk_t **list, zchunk_t *c)
+{
+	if (c->prev)
+	{
+		c->prev->next = c->next;
+	}
+	else
+	{
+		*list = c->next;
+	}
+
+	if (c->next)
+	{
+		c->next->prev = c->prev;
+	}
+
+	c->prev = c->next = NULL;
+}
+
+static void Z_LinkChunk(zchunk_t **list, zchunk_t *c)
+{
+	c->prev = NULL;
+	c->next = *list;
+
+	if (*list)
+	{
+		(*list)->prev = c;
+	}
+
+	*list = c;
+}
+
+static zchunk_t* Z_NewChunk(ztag_t *t, int cls)
+{
+	zchunk_t *c;
+	zhead_t *z;
+	byte *slots;
+	int i;
+
+	/* The chunk header is a multiple of 8 bytes, so
+	   the blocks are aligned like large blocks. */
+	c = malloc(sizeof(zchunk_t) + Z_CHUNKSIZE);
+
+	if (!c)
+	{
+		Com_Error(ERR_FATAL, "Z_Malloc: failed on allocation of %i bytes",
+				(int)sizeof(zchunk_t) + Z_CHUNKSIZE);
+	}
+
+	c->owner = t;
+	c->size = Z_MINCLASS << cls;
+	c->numSlots = Z_CHUNKSIZE / c->size;
+	c->used = 0;
+	c->free = NULL;
+
+	slots = (byte *)(c + 1);
+
+	for (i = c->numSlots - 1; i >= 0; i--)
+	{
+		z = (zhead_t *)(slots + i * c->size);
+		z->magic = 0;
+		z->chunk = c;
+		z->next = c->free;
+		c->free = z;
+	}
+
+	Z_LinkChunk(&t->partial[cls], c);
+	t->numChunks++;
+
+	return c;
+}
+
+static int Z_SizeClass(int size)
+{
+	int cls;
+
+	for (cls = 0; cls < Z_NUMCLASSES; cls++)
+	{
+		if (size <= (Z_MINCLASS << cls))
+		{
+			return cls;
+		}
+	}
+
+	return -1;
+}
+
 void Z_Free(void *ptr)
 {
 	zhead_t *z;
+	zchunk_t *c;
+	ztag_t *t;
+	int cls = 0;
 
 	z = ((zhead_t *)ptr) - 1;
 
@@ -45,57 +217,173 @@ void Z_Free(void *ptr)
 		Com_Error(ERR_FATAL, "Z_Free: bad magic");
 	}
 
-	z->prev->next = z->next;
-	z->next->prev = z->prev;
+	z->magic = 0;
+
+	if ((c = z->chunk) == NULL)
+	{
+		t = Z_FindTag(z->tag, false);
+
+		z->prev->next = z->next;
+		z->next->prev = z->prev;
+	}
+	else
+	{
+		t = c->owner;
+		cls = Z_SizeClass(c->size);
+
+		if (c->free == NULL)
+		{
+			Z_UnlinkChunk(&t->full[cls], c);
+			Z_LinkChunk(&t->partial[cls], c);
+		}
+
+		z->next = c->free;
+		c->free = z;
+		c->used--;
+	}
 
+	t->count--;
+	t->bytes -= z->size;
 	z_count--;
 	z_bytes -= z->size;
-	free(z);
+
+	if (c == NULL)
+	{
+		free(z);
+	}
+	else
+	if ((c->used == 0) && ((c->prev != NULL) || (c->next != NULL)))
+	{
+		/* Keep one empty chunk per class around, not more. */
+		Z_UnlinkChunk(&t->partial[cls], c);
+		t->numChunks--;
+		free(c);
+	}
 }
 
 void Z_Stats_f(void)
 {
+	ztag_t *t;
+	int i;
+
 	Com_Printf("%i bytes in %i blocks\n", z_bytes, z_count);
+
+	for (i = 0, t = z_tags; i < Z_MAXTAGS; i++, t++)
+	{
+		if (!t->inuse)
+		{
+			continue;
+		}
+
+		Com_Printf("  tag %5i: %i bytes in %i blocks, %i chunks, %i peak\n",
+				t->tag, t->bytes, t->count, t->numChunks, t->peak);
+	}
 }
 
 void Z_FreeTags(int tag)
 {
+	ztag_t *t;
 	zhead_t *z, *next;
+	zchunk_t *c, *nextChunk;
+	int cls;
+
+	if ((t = Z_FindTag(tag, false)) == NULL)
+	{
+		return;
+	}
 
-	for (z = z_chain.next; z != &z_chain; z = next)
+	for (z = t->blocks.next; z != &t->blocks; z = next)
 	{
 		next = z->next;
+		free(z);
+	}
 
-		if (z->tag == tag)
+	t->blocks.next = t->blocks.prev = &t->blocks;
+
+	for (cls = 0; cls < Z_NUMCLASSES; cls++)
+	{
+		for (c = t->partial[cls]; c; c = nextChunk)
 		{
-			Z_Free((void *)(z + 1));
+			nextChunk = c->next;
+			free(c);
 		}
+
+		for (c = t->full[cls]; c; c = nextChunk)
+		{
+			nextChunk = c->next;
+			free(c);
+		}
+
+		t->partial[cls] = t->full[cls] = NULL;
 	}
+
+	z_count -= t->count;
+	z_bytes -= t->bytes;
+	t->numChunks = 0;
+	t->count = 0;
+	t->bytes = 0;
 }
 
 void* Z_TagMalloc(int size, int tag)
 {
 	zhead_t *z;
+	zchunk_t *c;
+	ztag_t *t;
+	int cls;
 
 	size = size + sizeof(zhead_t);
-	z = malloc(size);
+	t = Z_FindTag(tag, true);
+
+	if ((cls = Z_SizeClass(size)) < 0)
+	{
+		z = malloc(size);
 
-	if (!z)
+		if (!z)
+		{
+			Com_Error(ERR_FATAL, "Z_Malloc: failed on allocation of %i bytes", size);
+		}
+
+		memset(z, 0, size);
+
+		z->next = t->blocks.next;
+		z->prev = &t->blocks;
+		t->blocks.next->prev = z;
+		t->blocks.next = z;
+	}
+	else
 	{
-		Com_Error(ERR_FATAL, "Z_Malloc: failed on allocation of %i bytes", size);
+		if ((c = t->partial[cls]) == NULL)
+		{
+			c = Z_NewChunk(t, cls);
+		}
+
+		z = c->free;
+		c->free = z->next;
+		c->used++;
+
+		if (c->free == NULL)
+		{
+			Z_UnlinkChunk(&t->partial[cls], c);
+			Z_LinkChunk(&t->full[cls], c);
+		}
+
+		memset(z, 0, size);
+		z->chunk = c;
 	}
 
-	memset(z, 0, size);
 	z_count++;
 	z_bytes += size;
 	z->magic = Z_MAGIC;
 	z->tag = tag;
 	z->size = size;
 
-	z->next = z_chain.next;
-	z->prev = &z_chain;
-	z_chain.next->prev = z;
-	z_chain.next = z;
+	t->count++;
+	t->bytes += size;
+
+	if (t->bytes > t->peak)
+	{
+		t->peak = t->bytes;
+	}
 
 	return (void *)(z + 1);
 }
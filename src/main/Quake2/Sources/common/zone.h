@@ -29,10 +29,12 @@
 
 typedef struct zhead_s
 {
-	struct zhead_s *prev, *next;
+	struct zhead_s *prev, *next; /* free slots are linked by next */
+	struct zchunk_s *chunk; /* NULL for blocks of their own */
 	short magic;
 	short tag; /* for group free */
 	int size;
+	int pad; /* keeps the block 8 byte aligned on 32 bit */
 } zhead_t;
 
 void Z_Stats_f(void);
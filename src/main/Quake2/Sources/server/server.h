@@ -98,6 +98,17 @@ typedef struct
 	int senttime; /* for ping calculations */
 } client_frame_t;
 
+#define SV_MAXDLWINDOW 64 /* most svc_dlchunks in flight */
+
+/* traffic totals of a client, see SV_RecordTelemetry */
+typedef struct
+{
+	int packetsIn, bytesIn;
+	int packetsOut, bytesOut;
+	int drops; /* unreliable messages lost to overflows */
+	int rateDrops;
+} svtraffic_t;
+
 typedef struct client_s
 {
 	client_state_t state;
@@ -116,6 +127,9 @@ typedef struct client_s
 	int message_size[RATE_MESSAGES]; /* used to rate drop packets */
 	int rate;
 	int surpressCount; /* number of messages rate supressed */
+	int rateDrops; /* messages rate supressed since connect */
+	int overflowDrops; /* datagrams lost to overflows since connect */
+	svtraffic_t sampled; /* totals at the last telemetry frame */
 
 	edict_t *edict; /* EDICT_NUM(clientnum+1) */
 	char name[32]; /* extracted from userinfo, high bits masked */
@@ -132,12 +146,27 @@ typedef struct client_s
 	int downloadsize; /* total bytes (can't use EOF because of paks) */
 	int downloadcount; /* bytes sent */
 
+	/* windowed download, see SV_SendDownloadChunks */
+	int dlstream; /* stream id from the client, 0 if it's sent by nextdl */
+	int dlsent; /* offset of the next chunk */
+	int dlacked; /* bytes the client has written */
+	int dlends[SV_MAXDLWINDOW]; /* end offsets of the chunks in flight */
+	int dlnumends;
+	int dltime; /* svs.realtime of the last ack or resend */
+	int dlretries; /* resends since the last ack */
+	int dlcredit; /* bytes sv_dlrate allows to send */
+	int dlclock; /* svs.realtime dlcredit was last topped up */
+
 	int lastmessage; /* sv.framenum when packet was last received */
 	int lastconnect;
 
 	int challenge; /* challenge of this user, randomly generated */
+	int protocolext; /* PROTOCOL_EXT_* bits accepted on connect */
+	qboolean recording; /* records a demo, no extended messages */
 
 	netchan_t netchan;
+
+	struct client_s *addressNext; /* next client in the same svs.clientsByAddress bucket */
 } client_t;
 
 typedef struct
@@ -147,6 +176,8 @@ typedef struct
 	int time;
 } challenge_t;
 
+#define SV_ADDRESSHASH 256 /* Must be a power of two. */
+
 typedef struct
 {
 	qboolean initialized; /* sv_init has completed */
@@ -158,6 +189,7 @@ typedef struct
 	/* used to check late spawns */
 
 	client_t *clients; /* [maxclients->value]; */
+	client_t *clientsByAddress[SV_ADDRESSHASH]; /* hashed by base address and qport */
 	int num_client_entities; /* maxclients->value*UPDATE_BACKUP*MAX_PACKET_ENTITIES */
 	int next_client_entities; /* next client_entity to use */
 	entity_state_t *client_entities; /* [num_client_entities] */
@@ -186,12 +218,18 @@ extern cvar_t *sv_noreload; /* don't reload level state when reentering */
 extern cvar_t *sv_airaccelerate; /* don't reload level state when reentering */
 /* development tool */
 extern cvar_t *sv_enforcetime;
+extern cvar_t *sv_threads;
+extern cvar_t *sv_dlwindow;
+extern cvar_t *sv_dlrate;
+extern cvar_t *sv_tracecache;
 
 extern client_t *sv_client;
 extern edict_t *sv_player;
 
 void SV_FinalMessage(char *message, qboolean reconnect);
 void SV_DropClient(client_t *drop);
+void SV_LinkClientAddress(client_t *cl);
+void SV_UnlinkClientAddress(client_t *cl);
 
 int SV_ModelIndex(char *name);
 int SV_SoundIndex(char *name);
@@ -210,6 +248,7 @@ void Master_Packet(void);
 
 void SV_InitGame(void);
 void SV_Map(qboolean attractloop, char *levelstring, qboolean loadgame);
+void SV_PreloadMap(const char *levelstring);
 
 void SV_PrepWorldFrame(void);
 
@@ -230,13 +269,25 @@ void SV_BroadcastCommand(char *fmt, ...);
 
 void SV_Nextserver(void);
 void SV_ExecuteClientMessage(client_t *cl);
+void SV_SendDownloadChunks(client_t *cl);
 
 void SV_ReadLevelFile(void);
 void SV_Status_f(void);
+void SV_Telemetry_f(void);
+
+typedef struct svdeltamemo_s svdeltamemo_t;
 
-void SV_WriteFrameToClient(client_t *client, sizebuf_t *msg);
+svdeltamemo_t *SV_CreateDeltaMemo(void);
+void SV_DeltaStats_f(void);
+void SV_WriteFrameToClient(client_t *client, sizebuf_t *msg, svdeltamemo_t *memo);
 void SV_RecordDemoMessage(void);
+void SV_BuildSendableEntities(void);
 void SV_BuildClientFrame(client_t *client);
+int SV_CullClientFrame(client_t *client, byte *pvs, unsigned short *visible);
+void SV_ReserveClientFrame(client_t *client, int count);
+void SV_StoreClientFrame(client_t *client, const unsigned short *visible, int count);
+void SV_VisBench_f(void);
+void SV_MsgBench_f(void);
 
 void SV_Error(char *error, ...);
 
@@ -256,6 +307,8 @@ void SV_Savegame_f(void);
 
 /* high level object sorting to reduce interaction tests */
 void SV_ClearWorld(void);
+void SV_AreaStats_f(void);
+void SV_ClearTraceCache(void);
 
 /* called after the world model has been loaded, before linking any entities */
 void SV_UnlinkEdict(edict_t *ent);
@@ -184,6 +184,9 @@ void SV_GameMap_f()
 
 	Com_DPrintf("SV_GameMap(%s)\n", Cmd_Argv(1));
 
+	/* read while the level just exited is saved */
+	SV_PreloadMap(Cmd_Argv(1));
+
 	FS_CreatePath(va("%s/save/current/", FS_WritableGamedir()));
 
 	/* check for clearing the current savegame */
@@ -601,6 +604,7 @@ void SV_InitOperatorCommands(void)
 	Cmd_AddCommand("heartbeat", SV_Heartbeat_f);
 	Cmd_AddCommand("kick", SV_Kick_f);
 	Cmd_AddCommand("status", SV_Status_f);
+	Cmd_AddCommand("telemetry", SV_Telemetry_f);
 	Cmd_AddCommand("serverinfo", SV_Serverinfo_f);
 	Cmd_AddCommand("dumpuser", SV_DumpUser_f);
 
@@ -623,4 +627,8 @@ void SV_InitOperatorCommands(void)
 	Cmd_AddCommand("killserver", SV_KillServer_f);
 
 	Cmd_AddCommand("sv", SV_ServerCommand_f);
+	Cmd_AddCommand("sv_visbench", SV_VisBench_f);
+	Cmd_AddCommand("sv_msgbench", SV_MsgBench_f);
+	Cmd_AddCommand("sv_deltastats", SV_DeltaStats_f);
+	Cmd_AddCommand("sv_areastats", SV_AreaStats_f);
 }
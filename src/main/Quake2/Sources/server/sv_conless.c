@@ -153,6 +153,7 @@ void SVC_DirectConnect(void)
 	int version;
 	int qport;
 	int challenge;
+	int protocolext;
 
 	adr = net_from;
 
@@ -174,6 +175,9 @@ void SVC_DirectConnect(void)
 
 	Q_strlcpy(userinfo, Cmd_Argv(4), sizeof(userinfo));
 
+	/* extensions we know of, old clients don't send any */
+	protocolext = (int)strtol(Cmd_Argv(5), (char **)NULL, 10) & PROTOCOL_EXTENSIONS;
+
 	/* force the IP key/value pair so the game can filter based on ip */
 	Info_SetValueForKey(userinfo, "ip", NET_AdrToString(net_from));
 
@@ -266,12 +270,14 @@ gotnewcl:
 
 	/* build a new connection  accept the new client this
 	   is the only place a client_t is ever initialized */
+	SV_UnlinkClientAddress(newcl);
 	*newcl = temp;
 	sv_client = newcl;
 	edictnum = (newcl - svs.clients) + 1;
 	ent = EDICT_NUM(edictnum);
 	newcl->edict = ent;
 	newcl->challenge = challenge; /* save challenge for checksumming */
+	newcl->protocolext = protocolext;
 
 	/* get the game a chance to reject this connection or modify the userinfo */
 	if (!(ge->ClientConnect(ent, userinfo)))
@@ -297,9 +303,18 @@ gotnewcl:
 	SV_UserinfoChanged(newcl);
 
 	/* send the connect packet to the client */
-	Netchan_OutOfBandPrint(NS_SERVER, adr, "client_connect");
+	if (protocolext)
+	{
+		Netchan_OutOfBandPrint(NS_SERVER, adr, "client_connect %i", protocolext);
+	}
+	else
+	{
+		Netchan_OutOfBandPrint(NS_SERVER, adr, "client_connect");
+	}
 
 	Netchan_Setup(NS_SERVER, &newcl->netchan, adr, qport);
+	newcl->netchan.fragments = (protocolext & PROTOCOL_EXT_FRAGMENT) != 0;
+	SV_LinkClientAddress(newcl);
 
 	newcl->state = cs_connected;
 
@@ -27,13 +27,160 @@
  */
 
 #include "server/server.h"
+#include "common/bitset.h"
+#include "common/msgblock.h"
 
-byte fatpvs[65536 / 8];
+byte fatpvs[BITSET_BYTES(MAX_MAP_LEAFS)];
+
+/* entities that may be sent this frame */
+typedef struct
+{
+	edict_t *ent;
+	int areanum, areanum2;
+	int num_clusters; /* if -1, use headnode instead */
+	const int *clusternums;
+	int headnode;
+	qboolean beam;
+	qboolean soundonly;
+} sv_sendable_t;
+
+static sv_sendable_t sv_sendable[MAX_EDICTS];
+static int sv_numSendable;
+
+/* The bytes MSG_WriteDeltaEntity writes only depend on its
+   arguments. Clients that got the same frame of an entity
+   need the same delta, so the last two deltas of each entity
+   number are remembered and copied for the next client. */
+#define SV_DELTAWAYS 2
+#define SV_MAXDELTABYTES 64 /* at least MSG_MAXDELTAENTITY */
+#define SV_MAXDELTAMEMOS 32
+
+typedef struct
+{
+	entity_state_t from, to;
+	int key; /* 1 + force + 2 * newentity, 0 if unused */
+	int length;
+	byte data[SV_MAXDELTABYTES];
+} svdelta_t;
+
+struct svdeltamemo_s
+{
+	svdelta_t deltas[MAX_EDICTS][SV_DELTAWAYS];
+	int hits, misses;
+};
+
+static svdeltamemo_t *sv_deltaMemos[SV_MAXDELTAMEMOS];
+static int sv_numDeltaMemos;
+
+/*
+ * One memo must only be used by one thread at a time.
+ * Memos live as long as the program.
+ */
+svdeltamemo_t* SV_CreateDeltaMemo(void)
+{
+	svdeltamemo_t *memo;
+
+	if (sv_numDeltaMemos == SV_MAXDELTAMEMOS)
+	{
+		Com_Error(ERR_FATAL, "SV_CreateDeltaMemo: too many memos");
+	}
+
+	memo = Z_Malloc(sizeof(svdeltamemo_t));
+	sv_deltaMemos[sv_numDeltaMemos++] = memo;
+
+	return memo;
+}
+
+void SV_DeltaStats_f(void)
+{
+	int hits, misses;
+	int i;
+
+	hits = misses = 0;
+
+	for (i = 0; i < sv_numDeltaMemos; i++)
+	{
+		hits += sv_deltaMemos[i]->hits;
+		misses += sv_deltaMemos[i]->misses;
+		sv_deltaMemos[i]->hits = 0;
+		sv_deltaMemos[i]->misses = 0;
+	}
+
+	Com_Printf("%i entity deltas, %i encoded, %i copied (%.1f%%)\n",
+		hits + misses, misses, hits,
+		(hits + misses) ? hits * 100.0f / (hits + misses) : 0.0f);
+}
+
+/*
+ * MSG_WriteDeltaEntity through the memo
+ */
+static void SV_WriteDeltaEntity(svdeltamemo_t *memo, entity_state_t *from,
+		entity_state_t *to, sizebuf_t *msg, qboolean force, qboolean newentity)
+{
+	svdelta_t *ways;
+	svdelta_t hit;
+	sizebuf_t buf;
+	int key;
+	int i;
+
+	/* MSG_WriteDeltaEntity complains about bad numbers */
+	if (!memo || (to->number <= 0) || (to->number >= MAX_EDICTS))
+	{
+		MSG_WriteDeltaEntity(from, to, msg, force, newentity);
+		return;
+	}
+
+	key = 1 + (force ? 1 : 0) + (newentity ? 2 : 0);
+	ways = memo->deltas[to->number];
+
+	for (i = 0; i < SV_DELTAWAYS; i++)
+	{
+		if ((ways[i].key == key) &&
+			!memcmp(&ways[i].to, to, sizeof(entity_state_t)) &&
+			!memcmp(&ways[i].from, from, sizeof(entity_state_t)))
+		{
+			if (ways[i].length)
+			{
+				SZ_Write(msg, ways[i].data, ways[i].length);
+			}
+
+			/* most recently used first */
+			if (i)
+			{
+				hit = ways[i];
+				memmove(&ways[1], &ways[0], i * sizeof(svdelta_t));
+				ways[0] = hit;
+			}
+
+			memo->hits++;
+			return;
+		}
+	}
+
+	memmove(&ways[1], &ways[0], (SV_DELTAWAYS - 1) * sizeof(svdelta_t));
+
+	SZ_Init(&buf, ways[0].data, sizeof(ways[0].data));
+	MSG_WriteDeltaEntity(from, to, &buf, force, newentity);
+
+	ways[0].from = *from;
+	ways[0].to = *to;
+	ways[0].key = key;
+	ways[0].length = buf.cursize;
+
+	if (buf.cursize)
+	{
+		SZ_Write(msg, buf.data, buf.cursize);
+	}
+
+	memo->misses++;
+}
 
 /*
- * Writes a delta update of an entity_state_t list to the message.
+ * Writes a delta update of an entity_state_t list to the message,
+ * as much of it as fits into maxsize bytes.
  */
-void SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
+static void SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to,
+		sizebuf_t *msg, int maxsize, svdeltamemo_t *memo)
 {
 	entity_state_t *oldent, *newent;
 	int oldindex, newindex;
@@ -59,7 +206,7 @@ void SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *
 
 	while (newindex < to->num_entities || oldindex < from_num_entities)
 	{
-		if (msg->cursize > MAX_MSGLEN - 150)
+		if (msg->cursize > maxsize - 150)
 		{
 			break;
 		}
@@ -93,7 +240,7 @@ void SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *
 			   being emited if the entity has not changed at all
 			   note that players are always 'newentities', this
 			   updates their oldorigin always and prevents warping */
-			MSG_WriteDeltaEntity(oldent, newent, msg,
+			SV_WriteDeltaEntity(memo, oldent, newent, msg,
 				false, newent->number <= maxclients->value);
 			oldindex++;
 			newindex++;
@@ -103,7 +250,7 @@ void SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *
 		if (newnum < oldnum)
 		{
 			/* this is a new entity, send it from the baseline */
-			MSG_WriteDeltaEntity(&sv.baselines[newnum], newent, msg, true, true);
+			SV_WriteDeltaEntity(memo, &sv.baselines[newnum], newent, msg, true, true);
 			newindex++;
 			continue;
 		}
@@ -142,6 +289,9 @@ void SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *
 	MSG_WriteShort(msg, 0);
 }
 
+/* svc_playerinfo with every field and stat */
+#define SV_MAXPLAYERSTATE (58 + 4 + MAX_STATS * 2)
+
 void SV_WritePlayerstateToClient(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
 {
 	int i;
@@ -149,6 +299,8 @@ void SV_WritePlayerstateToClient(client_frame_t *from, client_frame_t *to, sizeb
 	player_state_t *ps, *ops;
 	player_state_t dummy;
 	int statbits;
+	byte scratch[SV_MAXPLAYERSTATE];
+	byte *p, *start;
 
 	ps = &to->ps;
 
@@ -252,131 +404,138 @@ void SV_WritePlayerstateToClient(client_frame_t *from, client_frame_t *to, sizeb
 
 	pflags |= PS_WEAPONINDEX;
 
+	statbits = 0;
+
+	for (i = 0; i < MAX_STATS; i++)
+	{
+		if (ps->stats[i] != ops->stats[i])
+		{
+			statbits |= 1 << i;
+		}
+	}
+
 	/* write it */
-	MSG_WriteByte(msg, svc_playerinfo);
-	MSG_WriteShort(msg, pflags);
+	p = start = MSG_BeginBlock(msg, scratch, SV_MAXPLAYERSTATE);
+
+	p = MSG_PutByte(p, svc_playerinfo);
+	p = MSG_PutShort(p, pflags);
 
 	/* write the pmove_state_t */
 	if (pflags & PS_M_TYPE)
 	{
-		MSG_WriteByte(msg, ps->pmove.pm_type);
+		p = MSG_PutByte(p, ps->pmove.pm_type);
 	}
 
 	if (pflags & PS_M_ORIGIN)
 	{
-		MSG_WriteShort(msg, ps->pmove.origin[0]);
-		MSG_WriteShort(msg, ps->pmove.origin[1]);
-		MSG_WriteShort(msg, ps->pmove.origin[2]);
+		p = MSG_PutShort(p, ps->pmove.origin[0]);
+		p = MSG_PutShort(p, ps->pmove.origin[1]);
+		p = MSG_PutShort(p, ps->pmove.origin[2]);
 	}
 
 	if (pflags & PS_M_VELOCITY)
 	{
-		MSG_WriteShort(msg, ps->pmove.velocity[0]);
-		MSG_WriteShort(msg, ps->pmove.velocity[1]);
-		MSG_WriteShort(msg, ps->pmove.velocity[2]);
+		p = MSG_PutShort(p, ps->pmove.velocity[0]);
+		p = MSG_PutShort(p, ps->pmove.velocity[1]);
+		p = MSG_PutShort(p, ps->pmove.velocity[2]);
 	}
 
 	if (pflags & PS_M_TIME)
 	{
-		MSG_WriteByte(msg, ps->pmove.pm_time);
+		p = MSG_PutByte(p, ps->pmove.pm_time);
 	}
 
 	if (pflags & PS_M_FLAGS)
 	{
-		MSG_WriteByte(msg, ps->pmove.pm_flags);
+		p = MSG_PutByte(p, ps->pmove.pm_flags);
 	}
 
 	if (pflags & PS_M_GRAVITY)
 	{
-		MSG_WriteShort(msg, ps->pmove.gravity);
+		p = MSG_PutShort(p, ps->pmove.gravity);
 	}
 
 	if (pflags & PS_M_DELTA_ANGLES)
 	{
-		MSG_WriteShort(msg, ps->pmove.delta_angles[0]);
-		MSG_WriteShort(msg, ps->pmove.delta_angles[1]);
-		MSG_WriteShort(msg, ps->pmove.delta_angles[2]);
+		p = MSG_PutShort(p, ps->pmove.delta_angles[0]);
+		p = MSG_PutShort(p, ps->pmove.delta_angles[1]);
+		p = MSG_PutShort(p, ps->pmove.delta_angles[2]);
 	}
 
 	/* write the rest of the player_state_t */
 	if (pflags & PS_VIEWOFFSET)
 	{
-		MSG_WriteChar(msg, ps->viewoffset[0] * 4);
-		MSG_WriteChar(msg, ps->viewoffset[1] * 4);
-		MSG_WriteChar(msg, ps->viewoffset[2] * 4);
+		p = MSG_PutByte(p, ps->viewoffset[0] * 4);
+		p = MSG_PutByte(p, ps->viewoffset[1] * 4);
+		p = MSG_PutByte(p, ps->viewoffset[2] * 4);
 	}
 
 	if (pflags & PS_VIEWANGLES)
 	{
-		MSG_WriteAngle16(msg, ps->viewangles[0]);
-		MSG_WriteAngle16(msg, ps->viewangles[1]);
-		MSG_WriteAngle16(msg, ps->viewangles[2]);
+		p = MSG_PutShort(p, ANGLE2SHORT(ps->viewangles[0]));
+		p = MSG_PutShort(p, ANGLE2SHORT(ps->viewangles[1]));
+		p = MSG_PutShort(p, ANGLE2SHORT(ps->viewangles[2]));
 	}
 
 	if (pflags & PS_KICKANGLES)
 	{
-		MSG_WriteChar(msg, ps->kick_angles[0] * 4);
-		MSG_WriteChar(msg, ps->kick_angles[1] * 4);
-		MSG_WriteChar(msg, ps->kick_angles[2] * 4);
+		p = MSG_PutByte(p, ps->kick_angles[0] * 4);
+		p = MSG_PutByte(p, ps->kick_angles[1] * 4);
+		p = MSG_PutByte(p, ps->kick_angles[2] * 4);
 	}
 
 	if (pflags & PS_WEAPONINDEX)
 	{
-		MSG_WriteByte(msg, ps->gunindex);
+		p = MSG_PutByte(p, ps->gunindex);
 	}
 
 	if (pflags & PS_WEAPONFRAME)
 	{
-		MSG_WriteByte(msg, ps->gunframe);
-		MSG_WriteChar(msg, ps->gunoffset[0] * 4);
-		MSG_WriteChar(msg, ps->gunoffset[1] * 4);
-		MSG_WriteChar(msg, ps->gunoffset[2] * 4);
-		MSG_WriteChar(msg, ps->gunangles[0] * 4);
-		MSG_WriteChar(msg, ps->gunangles[1] * 4);
-		MSG_WriteChar(msg, ps->gunangles[2] * 4);
+		p = MSG_PutByte(p, ps->gunframe);
+		p = MSG_PutByte(p, ps->gunoffset[0] * 4);
+		p = MSG_PutByte(p, ps->gunoffset[1] * 4);
+		p = MSG_PutByte(p, ps->gunoffset[2] * 4);
+		p = MSG_PutByte(p, ps->gunangles[0] * 4);
+		p = MSG_PutByte(p, ps->gunangles[1] * 4);
+		p = MSG_PutByte(p, ps->gunangles[2] * 4);
 	}
 
 	if (pflags & PS_BLEND)
 	{
-		MSG_WriteByte(msg, ps->blend[0] * 255);
-		MSG_WriteByte(msg, ps->blend[1] * 255);
-		MSG_WriteByte(msg, ps->blend[2] * 255);
-		MSG_WriteByte(msg, ps->blend[3] * 255);
+		p = MSG_PutByte(p, ps->blend[0] * 255);
+		p = MSG_PutByte(p, ps->blend[1] * 255);
+		p = MSG_PutByte(p, ps->blend[2] * 255);
+		p = MSG_PutByte(p, ps->blend[3] * 255);
 	}
 
 	if (pflags & PS_FOV)
 	{
-		MSG_WriteByte(msg, ps->fov);
+		p = MSG_PutByte(p, ps->fov);
 	}
 
 	if (pflags & PS_RDFLAGS)
 	{
-		MSG_WriteByte(msg, ps->rdflags);
+		p = MSG_PutByte(p, ps->rdflags);
 	}
 
 	/* send stats */
-	statbits = 0;
-
-	for (i = 0; i < MAX_STATS; i++)
-	{
-		if (ps->stats[i] != ops->stats[i])
-		{
-			statbits |= 1 << i;
-		}
-	}
-
-	MSG_WriteLong(msg, statbits);
+	p = MSG_PutLong(p, statbits);
 
 	for (i = 0; i < MAX_STATS; i++)
 	{
 		if (statbits & (1 << i))
 		{
-			MSG_WriteShort(msg, ps->stats[i]);
+			p = MSG_PutShort(p, ps->stats[i]);
 		}
 	}
+
+	MSG_EndBlock(msg, scratch, start, p);
 }
 
-void SV_WriteFrameToClient(client_t *client, sizebuf_t *msg)
+/*
+ * memo may be NULL
+ */
+void SV_WriteFrameToClient(client_t *client, sizebuf_t *msg, svdeltamemo_t *memo)
 {
 	client_frame_t *frame, *oldframe;
 	int lastframe;
@@ -418,19 +577,20 @@ void SV_WriteFrameToClient(client_t *client, sizebuf_t *msg)
 	SV_WritePlayerstateToClient(oldframe, frame, msg);
 
 	/* delta encode the entities */
-	SV_EmitPacketEntities(oldframe, frame, msg);
+	SV_EmitPacketEntities(oldframe, frame, msg,
+		Netchan_MaxMessageLength(&client->netchan), memo);
 }
 
 /*
  * The client will interpolate the view position,
  * so we can't use a single PVS point
  */
-void SV_FatPVS(vec3_t org)
+void SV_FatPVS(vec3_t org, byte *pvs)
 {
 	int leafs[64];
 	int i, j, count;
-	int longs;
-	byte *src;
+	int bytes;
+	int cluster;
 	vec3_t mins, maxs;
 
 	for (i = 0; i < 3; i++)
@@ -446,65 +606,111 @@ void SV_FatPVS(vec3_t org)
 		Com_Error(ERR_FATAL, "SV_FatPVS: count < 1");
 	}
 
-	longs = (CM_NumClusters() + 31) >> 5;
-
-	/* convert leafs to clusters */
+	/* convert leafs to clusters and sort them,
+	   so that duplicates are next to each other */
 	for (i = 0; i < count; i++)
 	{
-		leafs[i] = CM_LeafCluster(leafs[i]);
+		cluster = CM_LeafCluster(leafs[i]);
+
+		for (j = i; (j > 0) && (leafs[j - 1] > cluster); j--)
+		{
+			leafs[j] = leafs[j - 1];
+		}
+
+		leafs[j] = cluster;
 	}
 
-	memcpy(fatpvs, CM_ClusterPVS(leafs[0]), longs << 2);
+	bytes = BITSET_BYTES(CM_NumClusters());
+	memset(pvs, 0, bytes);
 
-	/* or in all the other leaf bits */
-	for (i = 1; i < count; i++)
+	/* or in all the leaf bits */
+	for (i = 0; i < count; i++)
 	{
-		for (j = 0; j < i; j++)
+		if ((leafs[i] == -1) || ((i > 0) && (leafs[i] == leafs[i - 1])))
 		{
-			if (leafs[i] == leafs[j])
-			{
-				break;
-			}
+			continue; /* outside the map or already have it */
 		}
 
-		if (j != i)
+		Bitset_Or(pvs, CM_ClusterPVS(leafs[i]), bytes);
+	}
+}
+
+/*
+ * Finds the entities that may be sent to any client this frame,
+ * so SV_BuildClientFrame only has to check their visibility.
+ * Called once per frame, before the client frames are built.
+ */
+void SV_BuildSendableEntities(void)
+{
+	int e;
+	edict_t *ent;
+	sv_sendable_t *sendable;
+
+	sv_numSendable = 0;
+
+	for (e = 1; e < ge->num_edicts; e++)
+	{
+		ent = EDICT_NUM(e);
+
+		/* ignore ents without visible models */
+		if (ent->svflags & SVF_NOCLIENT)
 		{
-			continue; /* already have the cluster we want */
+			continue;
 		}
 
-		src = CM_ClusterPVS(leafs[i]);
+		/* ignore ents without visible models unless they have an effect */
+		if (!ent->s.modelindex && !ent->s.effects &&
+		    !ent->s.sound && !ent->s.event)
+		{
+			continue;
+		}
 
-		for (j = 0; j < longs; j++)
+		if (ent->s.number != e)
 		{
-			((long *)fatpvs)[j] |= ((long *)src)[j];
+			Com_DPrintf("FIXING ENT->S.NUMBER!!!\n");
+			ent->s.number = e;
 		}
+
+		sendable = &sv_sendable[sv_numSendable++];
+		sendable->ent = ent;
+		sendable->areanum = ent->areanum;
+		sendable->areanum2 = ent->areanum2;
+		sendable->num_clusters = ent->num_clusters;
+		sendable->clusternums = ent->clusternums;
+		sendable->headnode = ent->headnode;
+		sendable->beam = (ent->s.renderfx & RF_BEAM) != 0;
+		sendable->soundonly = !ent->s.modelindex;
 	}
 }
 
 /*
  * Decides which entities are going to be visible to the client, and
- * copies off the playerstat and areabits.
+ * copies off the playerstat and areabits. Only writes to the client
+ * and the given buffers, so it may run for several clients at once.
+ * Returns the number of entities put into visible, or -1 if the
+ * client isn't in the game yet.
  */
-void SV_BuildClientFrame(client_t *client)
+int SV_CullClientFrame(client_t *client, byte *pvs, unsigned short *visible)
 {
 	int e, i;
+	int count;
 	vec3_t org;
 	edict_t *ent;
 	edict_t *clent;
+	sv_sendable_t *sendable;
 	client_frame_t *frame;
-	entity_state_t *state;
-	int l;
 	int clientarea, clientcluster;
 	int leafnum;
 	int c_fullsend;
-	byte *clientphs;
+	const byte *clientphs;
+	const byte *areabits;
 	byte *bitvector;
 
 	clent = client->edict;
 
 	if (!clent->client)
 	{
-		return; /* not in game yet */
+		return -1; /* not in game yet */
 	}
 
 	/* this is the frame we are creating */
@@ -529,65 +735,54 @@ void SV_BuildClientFrame(client_t *client)
 	/* grab the current player_state_t */
 	frame->ps = clent->client->ps;
 
-	SV_FatPVS(org);
+	SV_FatPVS(org, pvs);
 	clientphs = CM_ClusterPHS(clientcluster);
 
-	/* build up the list of visible entities */
-	frame->num_entities = 0;
-	frame->first_entity = svs.next_client_entities;
+	/* outside of all areas every area bit is set,
+	   but no area is connected to the client's */
+	areabits = clientarea ? frame->areabits : NULL;
 
+	/* build up the list of visible entities */
+	count = 0;
 	c_fullsend = 0;
 
-	for (e = 1; e < ge->num_edicts; e++)
+	for (e = 0, sendable = sv_sendable; e < sv_numSendable; e++, sendable++)
 	{
-		ent = EDICT_NUM(e);
-
-		/* ignore ents without visible models */
-		if (ent->svflags & SVF_NOCLIENT)
-		{
-			continue;
-		}
-
-		/* ignore ents without visible models unless they have an effect */
-		if (!ent->s.modelindex && !ent->s.effects &&
-		    !ent->s.sound && !ent->s.event)
-		{
-			continue;
-		}
+		ent = sendable->ent;
 
 		/* ignore if not touching a PV leaf */
 		if (ent != clent)
 		{
 			/* check area */
-			if (!CM_AreasConnected(clientarea, ent->areanum))
+			if (areabits ? !Bitset_Test(areabits, sendable->areanum) :
+			    !CM_AreasConnected(clientarea, sendable->areanum))
 			{
 				/* doors can legally straddle two areas,
 				   so we may need to check another one */
-				if (!ent->areanum2 ||
-				    !CM_AreasConnected(clientarea, ent->areanum2))
+				if (!sendable->areanum2 ||
+				    (areabits ? !Bitset_Test(areabits, sendable->areanum2) :
+				     !CM_AreasConnected(clientarea, sendable->areanum2)))
 				{
 					continue; /* blocked by a door */
 				}
 			}
 
 			/* beams just check one point for PHS */
-			if (ent->s.renderfx & RF_BEAM)
+			if (sendable->beam)
 			{
-				l = ent->clusternums[0];
-
-				if (!(clientphs[l >> 3] & (1 << (l & 7))))
+				if (!Bitset_Test(clientphs, sendable->clusternums[0]))
 				{
 					continue;
 				}
 			}
 			else
 			{
-				bitvector = fatpvs;
+				bitvector = pvs;
 
-				if (ent->num_clusters == -1)
+				if (sendable->num_clusters == -1)
 				{
 					/* too many leafs for individual check, go by headnode */
-					if (!CM_HeadnodeVisible(ent->headnode, bitvector))
+					if (!CM_HeadnodeVisible(sendable->headnode, bitvector))
 					{
 						continue;
 					}
@@ -597,23 +792,14 @@ void SV_BuildClientFrame(client_t *client)
 				else
 				{
 					/* check individual leafs */
-					for (i = 0; i < ent->num_clusters; i++)
-					{
-						l = ent->clusternums[i];
-
-						if (bitvector[l >> 3] & (1 << (l & 7)))
-						{
-							break;
-						}
-					}
-
-					if (i == ent->num_clusters)
+					if (!Bitset_TestAny(bitvector, sendable->clusternums,
+								sendable->num_clusters))
 					{
 						continue; /* not visible */
 					}
 				}
 
-				if (!ent->s.modelindex)
+				if (sendable->soundonly)
 				{
 					/* don't send sounds if they
 					   will be attenuated away */
@@ -631,16 +817,46 @@ void SV_BuildClientFrame(client_t *client)
 			}
 		}
 
-		/* add it to the circular client_entities array */
-		state = &svs.client_entities[svs.next_client_entities %
-		                             svs.num_client_entities];
+		visible[count++] = e;
+	}
 
-		if (ent->s.number != e)
-		{
-			Com_DPrintf("FIXING ENT->S.NUMBER!!!\n");
-			ent->s.number = e;
-		}
+	return count;
+}
+
+/*
+ * Hands out room in the client_entities ring. Must be
+ * called for one client after the other.
+ */
+void SV_ReserveClientFrame(client_t *client, int count)
+{
+	client_frame_t *frame;
 
+	frame = &client->frames[sv.framenum & UPDATE_MASK];
+	frame->first_entity = svs.next_client_entities;
+	frame->num_entities = count;
+	svs.next_client_entities += count;
+}
+
+/*
+ * Copies the visible entities into the room reserved in the
+ * client_entities ring. May run for several clients at once.
+ */
+void SV_StoreClientFrame(client_t *client, const unsigned short *visible, int count)
+{
+	client_frame_t *frame;
+	entity_state_t *state;
+	edict_t *ent;
+	int i;
+
+	frame = &client->frames[sv.framenum & UPDATE_MASK];
+
+	for (i = 0; i < count; i++)
+	{
+		ent = sv_sendable[visible[i]].ent;
+
+		/* add it to the circular client_entities array */
+		state = &svs.client_entities[(frame->first_entity + i) %
+		                             svs.num_client_entities];
 		*state = ent->s;
 
 		/* don't mark players missiles as solid */
@@ -648,10 +864,21 @@ void SV_BuildClientFrame(client_t *client)
 		{
 			state->solid = 0;
 		}
+	}
+}
 
-		svs.next_client_entities++;
-		frame->num_entities++;
+void SV_BuildClientFrame(client_t *client)
+{
+	static unsigned short visible[MAX_EDICTS];
+	int count;
+
+	if ((count = SV_CullClientFrame(client, fatpvs, visible)) < 0)
+	{
+		return;
 	}
+
+	SV_ReserveClientFrame(client, count);
+	SV_StoreClientFrame(client, visible, count);
 }
 
 /*
@@ -710,3 +937,533 @@ void SV_RecordDemoMessage(void)
 	fwrite(&len, 4, 1, svs.demofile);
 	fwrite(buf.data, buf.cursize, 1, svs.demofile);
 }
+
+/*
+ * SV_FatPVS and the visibility checks of SV_BuildClientFrame
+ * as they used to be, for comparison by sv_visbench
+ */
+static void SV_FatPVSReference(vec3_t org, byte *pvs)
+{
+	int leafs[64];
+	int i, j, count;
+	int longs;
+	const byte *src;
+	vec3_t mins, maxs;
+
+	for (i = 0; i < 3; i++)
+	{
+		mins[i] = org[i] - 8;
+		maxs[i] = org[i] + 8;
+	}
+
+	count = CM_BoxLeafnums(mins, maxs, leafs, 64, NULL);
+	longs = (CM_NumClusters() + 31) >> 5;
+
+	for (i = 0; i < count; i++)
+	{
+		leafs[i] = CM_LeafCluster(leafs[i]);
+	}
+
+	memcpy(pvs, CM_ClusterPVS(leafs[0]), longs << 2);
+
+	for (i = 1; i < count; i++)
+	{
+		for (j = 0; j < i; j++)
+		{
+			if (leafs[i] == leafs[j])
+			{
+				break;
+			}
+		}
+
+		if (j != i)
+		{
+			continue;
+		}
+
+		src = CM_ClusterPVS(leafs[i]);
+
+		for (j = 0; j < longs; j++)
+		{
+			((unsigned *)pvs)[j] |= ((const unsigned *)src)[j];
+		}
+	}
+}
+
+static int SV_VisibleEntitiesReference(int clientarea, const byte *pvs)
+{
+	edict_t *ent;
+	int e, i, l;
+	int visible = 0;
+
+	for (e = 1; e < ge->num_edicts; e++)
+	{
+		ent = EDICT_NUM(e);
+
+		if (!ent->inuse || (ent->num_clusters == -1))
+		{
+			continue;
+		}
+
+		if (!CM_AreasConnected(clientarea, ent->areanum))
+		{
+			if (!ent->areanum2 ||
+			    !CM_AreasConnected(clientarea, ent->areanum2))
+			{
+				continue;
+			}
+		}
+
+		for (i = 0; i < ent->num_clusters; i++)
+		{
+			l = ent->clusternums[i];
+
+			if (pvs[l >> 3] & (1 << (l & 7)))
+			{
+				break;
+			}
+		}
+
+		if (i != ent->num_clusters)
+		{
+			visible++;
+		}
+	}
+
+	return visible;
+}
+
+static int SV_VisibleEntities(int clientarea, const byte *areabits, const byte *pvs)
+{
+	edict_t *ent;
+	int e;
+	int visible = 0;
+
+	for (e = 1; e < ge->num_edicts; e++)
+	{
+		ent = EDICT_NUM(e);
+
+		if (!ent->inuse || (ent->num_clusters == -1))
+		{
+			continue;
+		}
+
+		if (areabits ? !Bitset_Test(areabits, ent->areanum) :
+		    !CM_AreasConnected(clientarea, ent->areanum))
+		{
+			if (!ent->areanum2 ||
+			    (areabits ? !Bitset_Test(areabits, ent->areanum2) :
+			     !CM_AreasConnected(clientarea, ent->areanum2)))
+			{
+				continue;
+			}
+		}
+
+		if (Bitset_TestAny(pvs, ent->clusternums, ent->num_clusters))
+		{
+			visible++;
+		}
+	}
+
+	return visible;
+}
+
+/*
+ * Builds the fat PVS from the origin of every entity on the
+ * map and checks which entities are visible from there, the
+ * old way and the new way. Usage: sv_visbench [rounds]
+ */
+void SV_VisBench_f(void)
+{
+	static byte refpvs[BITSET_BYTES(MAX_MAP_LEAFS)];
+	byte areabits[MAX_MAP_AREAS / 8];
+	edict_t *ent;
+	int rounds;
+	int e, r;
+	int samples;
+	int area;
+	int start;
+	int fatOld, fatNew, entOld, entNew;
+	int mismatches = 0;
+
+	if (sv.state != ss_game)
+	{
+		Com_Printf("No map running.\n");
+		return;
+	}
+
+	rounds = (Cmd_Argc() > 1) ? (int)strtol(Cmd_Argv(1), NULL, 10) : 100;
+
+	if (rounds < 1)
+	{
+		rounds = 1;
+	}
+
+	/* check the results first */
+	for (e = 1, samples = 0; e < ge->num_edicts; e++)
+	{
+		ent = EDICT_NUM(e);
+
+		if (!ent->inuse)
+		{
+			continue;
+		}
+
+		samples++;
+		area = CM_LeafArea(CM_PointLeafnum(ent->s.origin));
+		CM_WriteAreaBits(areabits, area);
+
+		SV_FatPVSReference(ent->s.origin, refpvs);
+		SV_FatPVS(ent->s.origin, fatpvs);
+
+		if (memcmp(refpvs, fatpvs, (CM_NumClusters() + 7) >> 3) ||
+		    (SV_VisibleEntitiesReference(area, refpvs) !=
+		     SV_VisibleEntities(area, area ? areabits : NULL, fatpvs)))
+		{
+			mismatches++;
+		}
+	}
+
+	if (!samples)
+	{
+		Com_Printf("No entities to sample from.\n");
+		return;
+	}
+
+	start = Sys_Milliseconds();
+
+	for (r = 0; r < rounds; r++)
+	{
+		for (e = 1; e < ge->num_edicts; e++)
+		{
+			ent = EDICT_NUM(e);
+
+			if (ent->inuse)
+			{
+				SV_FatPVSReference(ent->s.origin, refpvs);
+			}
+		}
+	}
+
+	fatOld = Sys_Milliseconds() - start;
+	start = Sys_Milliseconds();
+
+	for (r = 0; r < rounds; r++)
+	{
+		for (e = 1; e < ge->num_edicts; e++)
+		{
+			ent = EDICT_NUM(e);
+
+			if (ent->inuse)
+			{
+				SV_FatPVS(ent->s.origin, fatpvs);
+			}
+		}
+	}
+
+	fatNew = Sys_Milliseconds() - start;
+	start = Sys_Milliseconds();
+
+	for (r = 0; r < rounds; r++)
+	{
+		for (e = 1; e < ge->num_edicts; e++)
+		{
+			ent = EDICT_NUM(e);
+
+			if (ent->inuse)
+			{
+				SV_VisibleEntitiesReference(ent->areanum, fatpvs);
+			}
+		}
+	}
+
+	entOld = Sys_Milliseconds() - start;
+	start = Sys_Milliseconds();
+
+	for (r = 0; r < rounds; r++)
+	{
+		for (e = 1; e < ge->num_edicts; e++)
+		{
+			ent = EDICT_NUM(e);
+
+			if (ent->inuse)
+			{
+				CM_WriteAreaBits(areabits, ent->areanum);
+				SV_VisibleEntities(ent->areanum,
+						ent->areanum ? areabits : NULL, fatpvs);
+			}
+		}
+	}
+
+	entNew = Sys_Milliseconds() - start;
+
+	Com_Printf("%i origins, %i clusters, %i entities, %i rounds.\n",
+			samples, CM_NumClusters(), ge->num_edicts, rounds);
+	Com_Printf("fat pvs:        old %8.3f us  new %8.3f us\n",
+			fatOld * 1000.0f / (samples * rounds),
+			fatNew * 1000.0f / (samples * rounds));
+	Com_Printf("entity checks:  old %8.3f us  new %8.3f us\n",
+			entOld * 1000.0f / (samples * rounds),
+			entNew * 1000.0f / (samples * rounds));
+
+	if (mismatches)
+	{
+		Com_Printf("%i origins gave different results!\n", mismatches);
+	}
+}
+
+/* an entity delta recorded from the frames of a client */
+typedef struct
+{
+	entity_state_t *from, *to;
+	qboolean force, newentity;
+	int length; /* bytes written, 0 if unchanged */
+} sv_benchdelta_t;
+
+#define SV_MAXBENCHDELTAS 16384
+
+/*
+ * Collects the entity deltas between consecutive frames of
+ * the clients, the same way SV_EmitPacketEntities pairs them
+ */
+static int SV_RecordBenchDeltas(sv_benchdelta_t *deltas)
+{
+	client_t *cl;
+	client_frame_t *from, *to;
+	entity_state_t *oldent, *newent;
+	int oldindex, newindex;
+	int oldnum, newnum;
+	int count = 0;
+	int c, n;
+
+	for (c = 0, cl = svs.clients; c < maxclients->value; c++, cl++)
+	{
+		if (cl->state != cs_spawned)
+		{
+			continue;
+		}
+
+		for (n = sv.framenum - UPDATE_BACKUP + 2; n <= sv.framenum; n++)
+		{
+			if (n < 2)
+			{
+				continue;
+			}
+
+			from = &cl->frames[(n - 1) & UPDATE_MASK];
+			to = &cl->frames[n & UPDATE_MASK];
+			oldent = NULL;
+			oldindex = 0;
+			newindex = 0;
+
+			while (newindex < to->num_entities && count < SV_MAXBENCHDELTAS)
+			{
+				newent = &svs.client_entities[(to->first_entity +
+				                               newindex) % svs.num_client_entities];
+				newnum = newent->number;
+				oldnum = 9999;
+
+				while (oldindex < from->num_entities)
+				{
+					oldent = &svs.client_entities[(from->first_entity +
+					                               oldindex) % svs.num_client_entities];
+					oldnum = oldent->number;
+
+					if (oldnum >= newnum)
+					{
+						break;
+					}
+
+					oldindex++;
+				}
+
+				if (oldnum == newnum)
+				{
+					deltas[count].from = oldent;
+					deltas[count].force = false;
+					deltas[count].newentity = newnum <= maxclients->value;
+					oldindex++;
+				}
+				else
+				{
+					deltas[count].from = &sv.baselines[newnum];
+					deltas[count].force = true;
+					deltas[count].newentity = true;
+				}
+
+				deltas[count].to = newent;
+				count++;
+				newindex++;
+			}
+		}
+	}
+
+	return count;
+}
+
+static unsigned SV_ReadBenchBits(sizebuf_t *msg, int *number)
+{
+	unsigned bits;
+
+	bits = MSG_ReadByte(msg);
+
+	if (bits & U_MOREBITS1)
+	{
+		bits |= MSG_ReadByte(msg) << 8;
+	}
+
+	if (bits & U_MOREBITS2)
+	{
+		bits |= MSG_ReadByte(msg) << 16;
+	}
+
+	if (bits & U_MOREBITS3)
+	{
+		bits |= (unsigned)MSG_ReadByte(msg) << 24;
+	}
+
+	*number = (bits & U_NUMBER16) ? MSG_ReadShort(msg) : MSG_ReadByte(msg);
+
+	return bits;
+}
+
+/*
+ * Replays the entity deltas of the recorded client frames
+ * through MSG_WriteDeltaEntity and MSG_ReadDeltaEntity, checks
+ * that they survive the trip and reports the time per entity.
+ * Usage: sv_msgbench [rounds]
+ */
+void SV_MsgBench_f(void)
+{
+	sv_benchdelta_t *deltas;
+	entity_state_t state;
+	sizebuf_t msg;
+	byte *data;
+	int rounds;
+	int count, sent;
+	int i, r;
+	int start;
+	int number;
+	int offset;
+	int encodeTime, decodeTime;
+	int mismatches = 0;
+	unsigned bits;
+
+	if (sv.state != ss_game)
+	{
+		Com_Printf("No map running.\n");
+		return;
+	}
+
+	rounds = (Cmd_Argc() > 1) ? (int)strtol(Cmd_Argv(1), NULL, 10) : 1000;
+
+	if (rounds < 1)
+	{
+		rounds = 1;
+	}
+
+	deltas = Z_Malloc(SV_MAXBENCHDELTAS * sizeof(*deltas));
+	count = SV_RecordBenchDeltas(deltas);
+
+	if (!count)
+	{
+		Com_Printf("No client frames to replay.\n");
+		Z_Free(deltas);
+		return;
+	}
+
+	data = Z_Malloc(count * MSG_MAXDELTAENTITY);
+	SZ_Init(&msg, data, count * MSG_MAXDELTAENTITY);
+
+	/* encode once to know what is sent, then check the trip */
+	for (i = 0, sent = 0; i < count; i++)
+	{
+		offset = msg.cursize;
+		MSG_WriteDeltaEntity(deltas[i].from, deltas[i].to, &msg,
+				deltas[i].force, deltas[i].newentity);
+		deltas[i].length = msg.cursize - offset;
+
+		if (deltas[i].length)
+		{
+			sent++;
+		}
+	}
+
+	MSG_BeginReading(&msg);
+
+	for (i = 0; i < count; i++)
+	{
+		if (!deltas[i].length)
+		{
+			continue;
+		}
+
+		offset = msg.readcount;
+		bits = SV_ReadBenchBits(&msg, &number);
+		MSG_ReadDeltaEntity(&msg, deltas[i].from, &state, number, bits);
+
+		if ((msg.readcount - offset != deltas[i].length) ||
+		    (state.number != deltas[i].to->number) ||
+		    (state.modelindex != deltas[i].to->modelindex) ||
+		    (state.sound != deltas[i].to->sound) ||
+		    (state.event != deltas[i].to->event) ||
+		    (state.solid != (short)deltas[i].to->solid) ||
+		    (fabs(state.origin[0] - deltas[i].to->origin[0]) > 0.125f) ||
+		    (fabs(state.origin[1] - deltas[i].to->origin[1]) > 0.125f) ||
+		    (fabs(state.origin[2] - deltas[i].to->origin[2]) > 0.125f))
+		{
+			mismatches++;
+		}
+	}
+
+	start = Sys_Milliseconds();
+
+	for (r = 0; r < rounds; r++)
+	{
+		SZ_Clear(&msg);
+
+		for (i = 0; i < count; i++)
+		{
+			MSG_WriteDeltaEntity(deltas[i].from, deltas[i].to, &msg,
+					deltas[i].force, deltas[i].newentity);
+		}
+	}
+
+	encodeTime = Sys_Milliseconds() - start;
+	start = Sys_Milliseconds();
+
+	for (r = 0; r < rounds; r++)
+	{
+		MSG_BeginReading(&msg);
+
+		for (i = 0; i < count; i++)
+		{
+			if (deltas[i].length)
+			{
+				bits = SV_ReadBenchBits(&msg, &number);
+				MSG_ReadDeltaEntity(&msg, deltas[i].from, &state, number, bits);
+			}
+		}
+	}
+
+	decodeTime = Sys_Milliseconds() - start;
+
+	Com_Printf("%i entities, %i deltas sent, %i bytes, %i rounds.\n",
+			count, sent, msg.cursize, rounds);
+	Com_Printf("encode: %8.1f ns/entity\n",
+			encodeTime * 1000000.0f / ((float)count * rounds));
+
+	if (sent)
+	{
+		Com_Printf("decode: %8.1f ns/entity\n",
+				decodeTime * 1000000.0f / ((float)sent * rounds));
+	}
+
+	if (mismatches)
+	{
+		Com_Printf("%i deltas did not survive the trip!\n", mismatches);
+	}
+
+	Z_Free(data);
+	Z_Free(deltas);
+}
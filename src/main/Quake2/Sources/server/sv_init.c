@@ -191,6 +191,9 @@ void SV_SpawnServer(char *server, char *spawnpoint, server_state_t serverstate,
 		FS_FCloseFile(sv.demofile);
 	}
 
+	/* files may have been added to the game tree since the last level */
+	FS_FlushNegativeCache();
+
 	svs.spawncount++; /* any partially connected client will be restarted */
 	sv.state = ss_dead;
 	Com_SetServerState(sv.state);
@@ -248,6 +251,9 @@ void SV_SpawnServer(char *server, char *spawnpoint, server_state_t serverstate,
 				false, &checksum);
 	}
 
+	/* the map was all SV_PreloadMap queued */
+	FS_PreloadClear();
+
 	Com_sprintf(sv.configstrings[CS_MAPCHECKSUM],
 		sizeof(sv.configstrings[CS_MAPCHECKSUM]),
 		"%i", checksum);
@@ -407,6 +413,42 @@ void SV_InitGame(void)
  *
  *  map tram.cin+jail_e3
  */
+/*
+ * Queues the BSP of a level given as to SV_Map, so that the
+ * preload thread reads it while the last level is being saved.
+ * Cinematics, demos and pictures aren't queued.
+ */
+void SV_PreloadMap(const char *levelstring)
+{
+	char level[MAX_QPATH];
+	char name[MAX_QPATH];
+	char *ch;
+
+	Q_strlcpy(level, levelstring, sizeof(level));
+
+	ch = strstr(level, "+");
+
+	if (ch)
+	{
+		*ch = 0;
+	}
+
+	ch = strstr(level, "$");
+
+	if (ch)
+	{
+		*ch = 0;
+	}
+
+	ch = (level[0] == '*') ? level + 1 : level;
+
+	if (ch[0] && !strchr(ch, '.'))
+	{
+		Com_sprintf(name, sizeof(name), "maps/%s.bsp", ch);
+		FS_PreloadFile(name);
+	}
+}
+
 void SV_Map(qboolean attractloop, char *levelstring, qboolean loadgame)
 {
 	char level[MAX_QPATH];
@@ -422,6 +464,8 @@ void SV_Map(qboolean attractloop, char *levelstring, qboolean loadgame)
 		SV_InitGame(); /* the game is just starting */
 	}
 
+	SV_PreloadMap(levelstring);
+
 	strcpy(level, levelstring);
 
 	/* if there is a + in the map, set nextserver to the remainder */
@@ -35,6 +35,9 @@ client_t *sv_client; /* current client */
 cvar_t *sv_paused;
 cvar_t *sv_timedemo;
 cvar_t *sv_enforcetime;
+cvar_t *sv_threads;
+cvar_t *sv_dlwindow; /* svc_dlchunks in flight per client */
+cvar_t *sv_dlrate; /* bytes per second per windowed download */
 cvar_t *timeout; /* seconds without any message */
 cvar_t *zombietime; /* seconds to sink messages after disconnect */
 cvar_t *rcon_password; /* password for remote server commands */
@@ -49,6 +52,11 @@ cvar_t *maxclients; /* rename sv_maxclients */
 cvar_t *sv_showclamp;
 cvar_t *hostname;
 cvar_t *public_server; /* should heartbeats be sent */
+cvar_t *sv_tracecache; /* reuse identical traces until something relinks */
+cvar_t *sv_packetrate; /* packet reads per second between frames, 0 as they arrive */
+cvar_t *sv_telemetry; /* record per frame telemetry */
+cvar_t *sv_telemetry_log; /* file the records are written to */
+cvar_t *sv_telemetry_format; /* csv or json */
 
 void Master_Shutdown(void);
 void SV_ConnectionlessPacket(void);
@@ -76,6 +84,8 @@ void SV_DropClient(client_t *drop)
 		drop->download = NULL;
 	}
 
+	drop->dlstream = 0;
+
 	drop->state = cs_zombie; /* become free in a few seconds */
 	drop->name[0] = 0;
 }
@@ -190,9 +200,114 @@ void SV_GiveMsec(void)
 	}
 }
 
-void SV_ReadPackets(void)
+/*
+ * Hashes what SV_ReadPackets matches packets with: the
+ * address without the port, and the qport
+ */
+static unsigned SV_HashAddress(netadr_t *adr, int qport)
 {
+	unsigned hash;
+	int len;
 	int i;
+
+	switch (adr->type)
+	{
+		case NA_IP:
+			len = 4;
+			break;
+
+		case NA_IP6:
+			len = 16;
+			break;
+
+		default:
+			len = 0;
+			break;
+	}
+
+	hash = adr->type * 31 + qport;
+
+	for (i = 0; i < len; i++)
+	{
+		hash = hash * 31 + adr->ip[i];
+	}
+
+	if (adr->type == NA_IPX)
+	{
+		for (i = 0; i < 10; i++)
+		{
+			hash = hash * 31 + adr->ipx[i];
+		}
+	}
+
+	return hash & (SV_ADDRESSHASH - 1);
+}
+
+/*
+ * Must be called whenever a client gets a new netchan,
+ * the port may change later on without relinking
+ */
+void SV_LinkClientAddress(client_t *cl)
+{
+	unsigned hash;
+
+	hash = SV_HashAddress(&cl->netchan.remote_address, cl->netchan.qport);
+
+	cl->addressNext = svs.clientsByAddress[hash];
+	svs.clientsByAddress[hash] = cl;
+}
+
+/*
+ * Must be called before a client slot becomes free or
+ * is overwritten. Does nothing if it isn't linked.
+ */
+void SV_UnlinkClientAddress(client_t *cl)
+{
+	client_t **back;
+
+	back = &svs.clientsByAddress[SV_HashAddress(&cl->netchan.remote_address,
+			cl->netchan.qport)];
+
+	for ( ; *back; back = &(*back)->addressNext)
+	{
+		if (*back == cl)
+		{
+			*back = cl->addressNext;
+			cl->addressNext = NULL;
+			return;
+		}
+	}
+}
+
+static client_t* SV_FindClientByAddress(netadr_t *adr, int qport)
+{
+	client_t *cl;
+
+	for (cl = svs.clientsByAddress[SV_HashAddress(adr, qport)]; cl; cl = cl->addressNext)
+	{
+		if (cl->state == cs_free)
+		{
+			continue;
+		}
+
+		if (!NET_CompareBaseAdr(*adr, cl->netchan.remote_address))
+		{
+			continue;
+		}
+
+		if (cl->netchan.qport != qport)
+		{
+			continue;
+		}
+
+		return cl;
+	}
+
+	return NULL;
+}
+
+void SV_ReadPackets(void)
+{
 	client_t *cl;
 	int qport;
 
@@ -213,49 +328,31 @@ void SV_ReadPackets(void)
 		qport = MSG_ReadShort(&net_message) & 0xffff;
 
 		/* check for packets from connected clients */
-		for (i = 0, cl = svs.clients; i < maxclients->value; i++, cl++)
-		{
-			if (cl->state == cs_free)
-			{
-				continue;
-			}
+		cl = SV_FindClientByAddress(&net_from, qport);
 
-			if (!NET_CompareBaseAdr(net_from, cl->netchan.remote_address))
-			{
-				continue;
-			}
+		if (!cl)
+		{
+			continue;
+		}
 
-			if (cl->netchan.qport != qport)
-			{
-				continue;
-			}
+		if (cl->netchan.remote_address.port != net_from.port)
+		{
+			Com_Printf("SV_ReadPackets: fixing up a translated port\n");
+			cl->netchan.remote_address.port = net_from.port;
+		}
 
-			if (cl->netchan.remote_address.port != net_from.port)
+		if (Netchan_Process(&cl->netchan, &net_message))
+		{
+			/* this is a valid, sequenced packet, so process it */
+			if (cl->state != cs_zombie)
 			{
-				Com_Printf("SV_ReadPackets: fixing up a translated port\n");
-				cl->netchan.remote_address.port = net_from.port;
-			}
+				cl->lastmessage = svs.realtime; /* don't timeout */
 
-			if (Netchan_Process(&cl->netchan, &net_message))
-			{
-				/* this is a valid, sequenced packet, so process it */
-				if (cl->state != cs_zombie)
+				if (!(sv.demofile && (sv.state == ss_demo)))
 				{
-					cl->lastmessage = svs.realtime; /* don't timeout */
-
-					if (!(sv.demofile && (sv.state == ss_demo)))
-					{
-						SV_ExecuteClientMessage(cl);
-					}
+					SV_ExecuteClientMessage(cl);
 				}
 			}
-
-			break;
-		}
-
-		if (i != maxclients->value)
-		{
-			continue;
 		}
 	}
 }
@@ -290,6 +387,7 @@ void SV_CheckTimeouts(void)
 		if ((cl->state == cs_zombie) &&
 		    (cl->lastmessage < zombiepoint))
 		{
+			SV_UnlinkClientAddress(cl);
 			cl->state = cs_free; /* can now be reused */
 			continue;
 		}
@@ -299,6 +397,7 @@ void SV_CheckTimeouts(void)
 		{
 			SV_BroadcastPrintf(PRINT_HIGH, "%s timed out\n", cl->name);
 			SV_DropClient(cl);
+			SV_UnlinkClientAddress(cl);
 			cl->state = cs_free; /* don't bother with zombie state */
 		}
 	}
@@ -328,7 +427,7 @@ void SV_RunGameFrame(void)
 
 	if (host_speeds->value)
 	{
-		time_before_game = Sys_Milliseconds();
+		time_before_game = Sys_Microseconds();
 	}
 
 	#endif
@@ -343,6 +442,7 @@ void SV_RunGameFrame(void)
 	/* don't run if paused */
 	if (!sv_paused->value || (maxclients->value > 1))
 	{
+		SV_ClearTraceCache();
 		ge->RunFrame();
 
 		/* never get more than one tic behind */
@@ -361,14 +461,361 @@ void SV_RunGameFrame(void)
 
 	if (host_speeds->value)
 	{
-		time_after_game = Sys_Milliseconds();
+		time_after_game = Sys_Microseconds();
 	}
 
 	#endif
 }
 
+/*
+ * Server telemetry. Each game frame gets a record with the time
+ * spent reading packets, running the game and sending messages,
+ * and with the traffic of all clients. The last records are kept
+ * in a ring for the telemetry command, which works over rcon too,
+ * and they can be written to sv_telemetry_log as CSV or JSON lines.
+ */
+#define SV_TELEMETRY_FRAMES 1024 /* about 100 seconds */
+#define SV_TELEMETRY_FLUSH 10 /* frames between file flushes */
+#define SV_TELEMETRY_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef struct
+{
+	int framenum;
+	int realtime;
+	int readtime; /* usec in SV_ReadPackets since the last frame */
+	int gametime; /* usec in SV_RunGameFrame */
+	int sendtime; /* usec in SV_SendClientMessages */
+	int clients; /* spawned ones */
+	svtraffic_t traffic; /* of all clients in this frame */
+	int traces;
+} svtelemetry_t;
+
+static svtelemetry_t sv_telemetryRing[SV_TELEMETRY_FRAMES];
+static int sv_numTelemetry; /* records ever made */
+static svtelemetry_t sv_frameTelemetry; /* of the frame being run */
+static FILE *sv_telemetryFile;
+
+static void SV_ClientTraffic(client_t *cl, svtraffic_t *traffic)
+{
+	traffic->packetsIn = cl->netchan.packets_received;
+	traffic->bytesIn = cl->netchan.bytes_received;
+	traffic->packetsOut = cl->netchan.packets_sent;
+	traffic->bytesOut = cl->netchan.bytes_sent;
+	traffic->drops = cl->netchan.unreliable_dumped + cl->overflowDrops;
+	traffic->rateDrops = cl->rateDrops;
+}
+
+/*
+ * Adds the time since *stamp to *stage and restarts it
+ */
+static void SV_TelemetryLap(int *stage, long long *stamp)
+{
+	long long now;
+
+	now = Sys_Microseconds();
+	*stage += (int)(now - *stamp);
+	*stamp = now;
+}
+
+static void SV_OpenTelemetryLog(void)
+{
+	char name[MAX_OSPATH];
+	qboolean json;
+
+	sv_telemetry_log->modified = false;
+	sv_telemetry_format->modified = false;
+
+	if (sv_telemetryFile)
+	{
+		fclose(sv_telemetryFile);
+		sv_telemetryFile = NULL;
+	}
+
+	if (!sv_telemetry_log->string[0])
+	{
+		return;
+	}
+
+	if (strstr(sv_telemetry_log->string, "..") ||
+	    strstr(sv_telemetry_log->string, "\\"))
+	{
+		Com_Printf("Illegal telemetry log name.\n");
+		return;
+	}
+
+	Com_sprintf(name, sizeof(name), "%s/%s", FS_WritableGamedir(),
+			sv_telemetry_log->string);
+	FS_CreatePath(name);
+	sv_telemetryFile = fopen(name, "a");
+
+	if (!sv_telemetryFile)
+	{
+		Com_Printf("ERROR: couldn't open %s.\n", name);
+		return;
+	}
+
+	json = !Q_stricmp(sv_telemetry_format->string, "json");
+
+	/* appending to an existing file doesn't repeat the header */
+	fseek(sv_telemetryFile, 0, SEEK_END);
+
+	if (!json && !ftell(sv_telemetryFile))
+	{
+		fprintf(sv_telemetryFile, "frame,time,read_us,game_us,send_us,clients,"
+				"packets_in,bytes_in,packets_out,bytes_out,drops,rate_drops,traces\n");
+	}
+}
+
+static void SV_WriteTelemetry(const svtelemetry_t *t)
+{
+	if (sv_telemetry_log->modified || sv_telemetry_format->modified)
+	{
+		SV_OpenTelemetryLog();
+	}
+
+	if (!sv_telemetryFile)
+	{
+		return;
+	}
+
+	if (!Q_stricmp(sv_telemetry_format->string, "json"))
+	{
+		fprintf(sv_telemetryFile, "{\"frame\":%i,\"time\":%i,\"read_us\":%i,"
+				"\"game_us\":%i,\"send_us\":%i,\"clients\":%i,"
+				"\"packets_in\":%i,\"bytes_in\":%i,\"packets_out\":%i,"
+				"\"bytes_out\":%i,\"drops\":%i,\"rate_drops\":%i,"
+				"\"traces\":%i}\n",
+				t->framenum, t->realtime, t->readtime, t->gametime,
+				t->sendtime, t->clients, t->traffic.packetsIn,
+				t->traffic.bytesIn, t->traffic.packetsOut,
+				t->traffic.bytesOut, t->traffic.drops,
+				t->traffic.rateDrops, t->traces);
+	}
+	else
+	{
+		fprintf(sv_telemetryFile, "%i,%i,%i,%i,%i,%i,%i,%i,%i,%i,%i,%i,%i\n",
+				t->framenum, t->realtime, t->readtime, t->gametime,
+				t->sendtime, t->clients, t->traffic.packetsIn,
+				t->traffic.bytesIn, t->traffic.packetsOut,
+				t->traffic.bytesOut, t->traffic.drops,
+				t->traffic.rateDrops, t->traces);
+	}
+
+	if (!(sv_numTelemetry % SV_TELEMETRY_FLUSH))
+	{
+		fflush(sv_telemetryFile);
+	}
+}
+
+/*
+ * Completes the record of the frame that was just run
+ */
+static void SV_RecordTelemetry(void)
+{
+	svtelemetry_t *t;
+	svtraffic_t now;
+	client_t *cl;
+	int i;
+
+	t = &sv_frameTelemetry;
+	t->framenum = sv.framenum;
+	t->realtime = svs.realtime;
+
+	/* the totals start over with a new client_t */
+	for (i = 0, cl = svs.clients; i < maxclients->value; i++, cl++)
+	{
+		if (cl->state == cs_free)
+		{
+			continue;
+		}
+
+		if (cl->state == cs_spawned)
+		{
+			t->clients++;
+		}
+
+		SV_ClientTraffic(cl, &now);
+		t->traffic.packetsIn += now.packetsIn - cl->sampled.packetsIn;
+		t->traffic.bytesIn += now.bytesIn - cl->sampled.bytesIn;
+		t->traffic.packetsOut += now.packetsOut - cl->sampled.packetsOut;
+		t->traffic.bytesOut += now.bytesOut - cl->sampled.bytesOut;
+		t->traffic.drops += now.drops - cl->sampled.drops;
+		t->traffic.rateDrops += now.rateDrops - cl->sampled.rateDrops;
+		cl->sampled = now;
+	}
+
+	sv_telemetryRing[sv_numTelemetry % SV_TELEMETRY_FRAMES] = *t;
+	sv_numTelemetry++;
+
+	SV_WriteTelemetry(t);
+
+	memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Sums up the last telemetry records and prints the traffic
+ * of each client since it connected. Usage: telemetry [frames]
+ */
+void SV_Telemetry_f(void)
+{
+	svtelemetry_t *t;
+	svtelemetry_t sum, max;
+	svtraffic_t traffic;
+	client_t *cl;
+	int frames;
+	int i;
+	float seconds;
+
+	if (!sv_numTelemetry)
+	{
+		Com_Printf("No telemetry recorded, see sv_telemetry.\n");
+		return;
+	}
+
+	frames = (Cmd_Argc() > 1) ? (int)strtol(Cmd_Argv(1), NULL, 10) : 100;
+
+	if (frames > sv_numTelemetry)
+	{
+		frames = sv_numTelemetry;
+	}
+
+	if (frames > SV_TELEMETRY_FRAMES)
+	{
+		frames = SV_TELEMETRY_FRAMES;
+	}
+
+	if (frames < 1)
+	{
+		frames = 1;
+	}
+
+	memset(&sum, 0, sizeof(sum));
+	memset(&max, 0, sizeof(max));
+
+	for (i = sv_numTelemetry - frames; i < sv_numTelemetry; i++)
+	{
+		t = &sv_telemetryRing[i % SV_TELEMETRY_FRAMES];
+
+		sum.readtime += t->readtime;
+		sum.gametime += t->gametime;
+		sum.sendtime += t->sendtime;
+		sum.traffic.packetsIn += t->traffic.packetsIn;
+		sum.traffic.bytesIn += t->traffic.bytesIn;
+		sum.traffic.packetsOut += t->traffic.packetsOut;
+		sum.traffic.bytesOut += t->traffic.bytesOut;
+		sum.traffic.drops += t->traffic.drops;
+		sum.traffic.rateDrops += t->traffic.rateDrops;
+		sum.traces += t->traces;
+
+		max.readtime = SV_TELEMETRY_MAX(max.readtime, t->readtime);
+		max.gametime = SV_TELEMETRY_MAX(max.gametime, t->gametime);
+		max.sendtime = SV_TELEMETRY_MAX(max.sendtime, t->sendtime);
+		max.clients = SV_TELEMETRY_MAX(max.clients, t->clients);
+		max.traces = SV_TELEMETRY_MAX(max.traces, t->traces);
+	}
+
+	seconds = frames * 0.1f;
+
+	Com_Printf("%i frames, %.1f seconds, up to %i clients\n",
+			frames, seconds, max.clients);
+	Com_Printf("             avg      max\n");
+	Com_Printf("read  us %7.0f %8i\n", (float)sum.readtime / frames, max.readtime);
+	Com_Printf("game  us %7.0f %8i\n", (float)sum.gametime / frames, max.gametime);
+	Com_Printf("send  us %7.0f %8i\n", (float)sum.sendtime / frames, max.sendtime);
+	Com_Printf("traces   %7.1f %8i\n", (float)sum.traces / frames, max.traces);
+	Com_Printf("in:  %.1f packets/s %.1f kb/s\n",
+			sum.traffic.packetsIn / seconds,
+			sum.traffic.bytesIn / seconds / 1024);
+	Com_Printf("out: %.1f packets/s %.1f kb/s\n",
+			sum.traffic.packetsOut / seconds,
+			sum.traffic.bytesOut / seconds / 1024);
+	Com_Printf("%i unreliable drops, %i rate drops\n",
+			sum.traffic.drops, sum.traffic.rateDrops);
+
+	if (!svs.clients)
+	{
+		return;
+	}
+
+	Com_Printf("num name            pkts in pkts out    kb in   kb out drops rate\n");
+	Com_Printf("--- --------------- ------- -------- -------- -------- ----- -----\n");
+
+	for (i = 0, cl = svs.clients; i < maxclients->value; i++, cl++)
+	{
+		if (cl->state == cs_free)
+		{
+			continue;
+		}
+
+		SV_ClientTraffic(cl, &traffic);
+		Com_Printf("%3i %-15.15s %7i %8i %8i %8i %5i %5i\n", i, cl->name,
+				traffic.packetsIn, traffic.packetsOut,
+				traffic.bytesIn / 1024, traffic.bytesOut / 1024,
+				traffic.drops, traffic.rateDrops);
+	}
+}
+
+/*
+ * The game runs at 10 frames per second. In between the server
+ * sleeps until the microsecond the next frame is due, waking up
+ * for client packets as they arrive. With sv_packetrate the
+ * packets are read that many times per second instead, which
+ * batches the work of busy servers.
+ */
+static long long sv_nextPacketRead; /* Sys_Microseconds() */
+
+static void SV_SchedulePacketRead(void)
+{
+	float rate;
+
+	rate = sv_packetrate->value;
+
+	if (rate <= 0)
+	{
+		return;
+	}
+
+	if (rate > 1000)
+	{
+		rate = 1000;
+	}
+
+	sv_nextPacketRead = Sys_Microseconds() + (long long)(1000000 / rate);
+}
+
+static void SV_WaitForFrame(void)
+{
+	long long now;
+	long long usec;
+
+	now = Sys_Microseconds();
+
+	/* until the frame is due, less the part of a millisecond
+	   that has passed but isn't in realtime yet */
+	usec = (long long)(sv.time - svs.realtime) * 1000 - (now - com_frameclock);
+
+	if (sv_packetrate->value > 0)
+	{
+		if (sv_nextPacketRead - now < usec)
+		{
+			usec = sv_nextPacketRead - now;
+		}
+
+		NET_Sleep((int)(usec > 0 ? usec : 0), false);
+	}
+	else
+	{
+		NET_Sleep((int)(usec > 0 ? usec : 0), true);
+	}
+}
+
 void SV_Frame(int msec)
 {
+	extern int c_traces;
+	qboolean telemetry;
+	long long stamp = 0;
+	int traces = 0;
+
 	#ifndef DEDICATED_ONLY
 	time_before_game = time_after_game = 0;
 	#endif
@@ -387,8 +834,27 @@ void SV_Frame(int msec)
 	/* check timeouts */
 	SV_CheckTimeouts();
 
-	/* get packets from clients */
-	SV_ReadPackets();
+	telemetry = sv_telemetry->value != 0;
+
+	if (telemetry)
+	{
+		stamp = Sys_Microseconds();
+		traces = c_traces;
+	}
+
+	/* get packets from clients, with sv_packetrate only in
+	   their slots and right before a frame */
+	if (!sv_packetrate->value || (svs.realtime >= (int)sv.time) ||
+	    (Sys_Microseconds() >= sv_nextPacketRead))
+	{
+		SV_ReadPackets();
+		SV_SchedulePacketRead();
+	}
+
+	if (telemetry)
+	{
+		SV_TelemetryLap(&sv_frameTelemetry.readtime, &stamp);
+	}
 
 	/* move autonomous things around if enough time has passed */
 	if (!sv_timedemo->value && (svs.realtime < (int)sv.time))
@@ -404,7 +870,12 @@ void SV_Frame(int msec)
 			svs.realtime = sv.time - 100;
 		}
 
-		NET_Sleep(sv.time - svs.realtime);
+		if (telemetry)
+		{
+			sv_frameTelemetry.traces += c_traces - traces;
+		}
+
+		SV_WaitForFrame();
 		return;
 	}
 
@@ -414,12 +885,29 @@ void SV_Frame(int msec)
 	/* give the clients some timeslices */
 	SV_GiveMsec();
 
+	if (telemetry)
+	{
+		stamp = Sys_Microseconds();
+	}
+
 	/* let everything in the world think and move */
 	SV_RunGameFrame();
 
+	if (telemetry)
+	{
+		SV_TelemetryLap(&sv_frameTelemetry.gametime, &stamp);
+	}
+
 	/* send messages back to the clients that had packets read this frame */
 	SV_SendClientMessages();
 
+	if (telemetry)
+	{
+		SV_TelemetryLap(&sv_frameTelemetry.sendtime, &stamp);
+		sv_frameTelemetry.traces += c_traces - traces;
+		SV_RecordTelemetry();
+	}
+
 	/* save the entire world state if recording a serverdemo */
 	SV_RecordDemoMessage();
 
@@ -588,6 +1076,9 @@ void SV_Init(void)
 	sv_paused = Cvar_Get("paused", "0", 0);
 	sv_timedemo = Cvar_Get("timedemo", "0", 0);
 	sv_enforcetime = Cvar_Get("sv_enforcetime", "0", 0);
+	sv_threads = Cvar_Get("sv_threads", "0", CVAR_ARCHIVE);
+	sv_dlwindow = Cvar_Get("sv_dlwindow", "16", 0);
+	sv_dlrate = Cvar_Get("sv_dlrate", "100000", 0);
 	allow_download = Cvar_Get("allow_download", "1", CVAR_ARCHIVE);
 	allow_download_players = Cvar_Get("allow_download_players", "0", CVAR_ARCHIVE);
 	allow_download_models = Cvar_Get("allow_download_models", "1", CVAR_ARCHIVE);
@@ -600,6 +1091,13 @@ void SV_Init(void)
 
 	public_server = Cvar_Get("public", "0", 0);
 
+	sv_packetrate = Cvar_Get("sv_packetrate", "0", 0);
+	sv_tracecache = Cvar_Get("sv_tracecache", "0", 0);
+
+	sv_telemetry = Cvar_Get("sv_telemetry", dedicated->value ? "1" : "0", 0);
+	sv_telemetry_log = Cvar_Get("sv_telemetry_log", "", 0);
+	sv_telemetry_format = Cvar_Get("sv_telemetry_format", "csv", 0);
+
 	SZ_Init(&net_message, net_message_buffer, sizeof(net_message_buffer));
 }
 
@@ -688,5 +1186,13 @@ void SV_Shutdown(char *finalmsg, qboolean reconnect)
 		fclose(svs.demofile);
 	}
 
+	/* reopened by the next record */
+	if (sv_telemetryFile)
+	{
+		fclose(sv_telemetryFile);
+		sv_telemetryFile = NULL;
+		sv_telemetry_log->modified = true;
+	}
+
 	memset(&svs, 0, sizeof(svs));
 }
@@ -176,6 +176,8 @@ void SV_WriteLevelFile()
 	CM_WritePortalState(f);
 	fclose(f);
 
+	FS_FlushNegativeCache();
+
 	Com_sprintf(name, sizeof(name), "%s/save/current/%s.sav",
 		FS_WritableGamedir(), sv.name);
 	ge->WriteLevel(name);
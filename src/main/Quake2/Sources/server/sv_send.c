@@ -25,6 +25,69 @@
  */
 
 #include "server/server.h"
+#include "common/bitset.h"
+
+/* a full frame of entities never overflows this */
+#define SV_FRAMEBUFSIZE 0x10000
+#define SV_MAXWORKERS 16
+
+/* what a thread needs to build and encode client frames */
+typedef struct
+{
+	byte pvs[BITSET_BYTES(MAX_MAP_LEAFS)];
+	byte msgbuf[SV_FRAMEBUFSIZE];
+	svdeltamemo_t *deltas;
+} svworker_t;
+
+/* for encoding on the main thread */
+static svdeltamemo_t *sv_deltas;
+
+static svdeltamemo_t* SV_GetDeltaMemo(void)
+{
+	if (!sv_deltas)
+	{
+		sv_deltas = SV_CreateDeltaMemo();
+	}
+
+	return sv_deltas;
+}
+
+static svworker_t *sv_workers[SV_MAXWORKERS + 1]; /* 0 is the main thread */
+static int sv_numWorkers;
+static void *sv_jobLock, *sv_jobStart, *sv_jobDone;
+static void *sv_sendLock;
+static void (*sv_jobFunction)(client_t *client, svworker_t *worker);
+static client_t *sv_jobClients[MAX_CLIENTS];
+static int sv_numJobClients, sv_nextJob;
+
+static unsigned short sv_visible[MAX_CLIENTS][MAX_EDICTS];
+static int sv_numVisible[MAX_CLIENTS];
+
+/* SV_Multicast remembers where the clients are, and which
+   of them are in the PVS or PHS of a cluster, until one of
+   them moves into another cluster */
+#define SV_RECIPIENTCACHE 64 /* Must be a power of two. */
+
+typedef struct
+{
+	qboolean valid;
+	vec3_t origin;
+	int cluster;
+	int area;
+} svclientleaf_t;
+
+typedef struct
+{
+	int cluster;
+	qboolean phs;
+	int generation; /* 0 if unused */
+	unsigned clients[MAX_CLIENTS / 32];
+} svrecipients_t;
+
+static svclientleaf_t sv_clientLeafs[MAX_CLIENTS];
+static svrecipients_t sv_recipients[SV_RECIPIENTCACHE];
+static int sv_recipientsGeneration = 1;
+static int sv_recipientsSpawncount;
 
 char sv_outputbuf[SV_OUTPUTBUF_LENGTH];
 
@@ -143,14 +206,100 @@ void SV_BroadcastCommand(char *fmt, ...)
  * MULTICAST_PVS	send to clients potentially visible from org
  * MULTICAST_PHS	send to clients potentially hearable from org
  */
+/*
+ * Brings the cached leafs of the clients up to date, this
+ * costs a point trace only for clients that have moved.
+ */
+static void SV_UpdateClientLeafs(void)
+{
+	svclientleaf_t *leaf;
+	client_t *client;
+	int leafnum;
+	int j;
+
+	/* a new map or new clients */
+	if (sv_recipientsSpawncount != svs.spawncount)
+	{
+		sv_recipientsSpawncount = svs.spawncount;
+		sv_recipientsGeneration++;
+		memset(sv_clientLeafs, 0, sizeof(sv_clientLeafs));
+	}
+
+	for (j = 0, client = svs.clients; j < maxclients->value; j++, client++)
+	{
+		leaf = &sv_clientLeafs[j];
+
+		if ((client->state == cs_free) || (client->state == cs_zombie))
+		{
+			leaf->valid = false;
+			continue;
+		}
+
+		if (leaf->valid && VectorCompare(leaf->origin, client->edict->s.origin))
+		{
+			continue;
+		}
+
+		leafnum = CM_PointLeafnum(client->edict->s.origin);
+		VectorCopy(client->edict->s.origin, leaf->origin);
+		leaf->area = CM_LeafArea(leafnum);
+
+		if (!leaf->valid || (leaf->cluster != CM_LeafCluster(leafnum)))
+		{
+			leaf->cluster = CM_LeafCluster(leafnum);
+			sv_recipientsGeneration++;
+		}
+
+		leaf->valid = true;
+	}
+}
+
+/*
+ * Returns a bit for each client in the PVS or PHS of cluster
+ */
+static const unsigned* SV_MulticastRecipients(int cluster, qboolean phs)
+{
+	svrecipients_t *r;
+	const byte *mask;
+	int j;
+
+	r = &sv_recipients[(cluster * 2 + phs) & (SV_RECIPIENTCACHE - 1)];
+
+	if ((r->generation == sv_recipientsGeneration) &&
+		(r->cluster == cluster) && (r->phs == phs))
+	{
+		return r->clients;
+	}
+
+	mask = phs ? CM_ClusterPHS(cluster) : CM_ClusterPVS(cluster);
+
+	memset(r->clients, 0, sizeof(r->clients));
+
+	for (j = 0; j < maxclients->value; j++)
+	{
+		/* clients outside the map see nothing */
+		if (sv_clientLeafs[j].valid && (sv_clientLeafs[j].cluster >= 0) &&
+			Bitset_Test(mask, sv_clientLeafs[j].cluster))
+		{
+			r->clients[j >> 5] |= 1u << (j & 31);
+		}
+	}
+
+	r->cluster = cluster;
+	r->phs = phs;
+	r->generation = sv_recipientsGeneration;
+
+	return r->clients;
+}
+
 void SV_Multicast(vec3_t origin, multicast_t to)
 {
 	client_t *client;
-	byte *mask;
+	const unsigned *mask;
 	int leafnum = 0, cluster;
 	int j;
 	qboolean reliable;
-	int area1, area2;
+	int area1;
 
 	reliable = false;
 
@@ -181,17 +330,17 @@ void SV_Multicast(vec3_t origin, multicast_t to)
 	case MULTICAST_PHS_R:
 		reliable = true;         /* intentional fallthrough */
 	case MULTICAST_PHS:
-		leafnum = CM_PointLeafnum(origin);
 		cluster = CM_LeafCluster(leafnum);
-		mask = CM_ClusterPHS(cluster);
+		SV_UpdateClientLeafs();
+		mask = SV_MulticastRecipients(cluster, true);
 		break;
 
 	case MULTICAST_PVS_R:
 		reliable = true;         /* intentional fallthrough */
 	case MULTICAST_PVS:
-		leafnum = CM_PointLeafnum(origin);
 		cluster = CM_LeafCluster(leafnum);
-		mask = CM_ClusterPVS(cluster);
+		SV_UpdateClientLeafs();
+		mask = SV_MulticastRecipients(cluster, false);
 		break;
 
 	default:
@@ -214,16 +363,13 @@ void SV_Multicast(vec3_t origin, multicast_t to)
 
 		if (mask)
 		{
-			leafnum = CM_PointLeafnum(client->edict->s.origin);
-			cluster = CM_LeafCluster(leafnum);
-			area2 = CM_LeafArea(leafnum);
-
-			if (!CM_AreasConnected(area1, area2))
+			if (!(mask[j >> 5] & (1u << (j & 31))))
 			{
 				continue;
 			}
 
-			if (mask && (!(mask[cluster >> 3] & (1 << (cluster & 7)))))
+			/* portals may have opened or closed since */
+			if (!CM_AreasConnected(area1, sv_clientLeafs[j].area))
 			{
 				continue;
 			}
@@ -411,17 +557,17 @@ void SV_StartSound(vec3_t origin, edict_t *entity, int channel, int soundindex,
 
 qboolean SV_SendClientDatagram(client_t *client)
 {
-	byte msg_buf[MAX_MSGLEN];
+	byte msg_buf[MAX_FRAGMSGLEN];
 	sizebuf_t msg;
 
 	SV_BuildClientFrame(client);
 
-	SZ_Init(&msg, msg_buf, sizeof(msg_buf));
+	SZ_Init(&msg, msg_buf, Netchan_MaxMessageLength(&client->netchan));
 	msg.allowoverflow = true;
 
 	/* send over all the relevant entity_state_t
 	   and the player_state_t */
-	SV_WriteFrameToClient(client, &msg);
+	SV_WriteFrameToClient(client, &msg, SV_GetDeltaMemo());
 
 	/* copy the accumulated multicast datagram
 	   for this client out to the message
@@ -430,6 +576,7 @@ qboolean SV_SendClientDatagram(client_t *client)
 	if (client->datagram.overflowed)
 	{
 		Com_Printf("WARNING: datagram overflowed for %s\n", client->name);
+		client->overflowDrops++;
 	}
 	else
 	{
@@ -442,6 +589,7 @@ qboolean SV_SendClientDatagram(client_t *client)
 	{
 		/* must have room left for the packet header */
 		Com_Printf("WARNING: msg overflowed for %s\n", client->name);
+		client->overflowDrops++;
 		SZ_Clear(&msg);
 	}
 
@@ -454,6 +602,194 @@ qboolean SV_SendClientDatagram(client_t *client)
 	return true;
 }
 
+/*
+ * Building and encoding the client frames can be spread over
+ * sv_threads worker threads. The workers only run while the
+ * main thread takes part in the same jobs, so the game is never
+ * running at the same time. Sending and printing goes through
+ * sv_sendLock.
+ */
+static void SV_RunJobs(svworker_t *worker)
+{
+	int i;
+
+	while (1)
+	{
+		Sys_LockMutex(sv_jobLock);
+		i = sv_nextJob++;
+		Sys_UnlockMutex(sv_jobLock);
+
+		if (i >= sv_numJobClients)
+		{
+			break;
+		}
+
+		sv_jobFunction(sv_jobClients[i], worker);
+	}
+}
+
+static int SV_WorkerThread(void *data)
+{
+	while (1)
+	{
+		Sys_SemWait(sv_jobStart);
+		SV_RunJobs((svworker_t *)data);
+		Sys_SemPost(sv_jobDone);
+	}
+
+	return 0;
+}
+
+/*
+ * Starts worker threads until there are as many as sv_threads
+ * asks for. Returns the number of workers to use.
+ */
+static int SV_StartWorkers(void)
+{
+	int wanted;
+
+	wanted = (int)sv_threads->value;
+
+	if (wanted > SV_MAXWORKERS)
+	{
+		wanted = SV_MAXWORKERS;
+	}
+
+	if (sv_jobLock == NULL)
+	{
+		sv_jobLock = Sys_CreateMutex();
+		sv_sendLock = Sys_CreateMutex();
+		sv_jobStart = Sys_CreateSemaphore(0);
+		sv_jobDone = Sys_CreateSemaphore(0);
+		sv_workers[0] = Z_Malloc(sizeof(svworker_t));
+		sv_workers[0]->deltas = SV_GetDeltaMemo();
+	}
+
+	while (sv_numWorkers < wanted)
+	{
+		sv_workers[sv_numWorkers + 1] = Z_Malloc(sizeof(svworker_t));
+
+		if (Sys_CreateThread(SV_WorkerThread, sv_workers[sv_numWorkers + 1]) == NULL)
+		{
+			Com_Printf("SV_StartWorkers: couldn't start a worker thread.\n");
+			Z_Free(sv_workers[sv_numWorkers + 1]);
+			sv_workers[sv_numWorkers + 1] = NULL;
+			Cvar_ForceSet("sv_threads", va("%i", sv_numWorkers));
+			break;
+		}
+
+		/* the worker doesn't look at it before its first job */
+		sv_workers[sv_numWorkers + 1]->deltas = SV_CreateDeltaMemo();
+		sv_numWorkers++;
+	}
+
+	return (wanted < sv_numWorkers) ? wanted : sv_numWorkers;
+}
+
+static void SV_RunJobsOnWorkers(void (*function)(client_t *client, svworker_t *worker), int workers)
+{
+	int i;
+
+	sv_jobFunction = function;
+	sv_nextJob = 0;
+
+	for (i = 0; i < workers; i++)
+	{
+		Sys_SemPost(sv_jobStart);
+	}
+
+	SV_RunJobs(sv_workers[0]);
+
+	for (i = 0; i < workers; i++)
+	{
+		Sys_SemWait(sv_jobDone);
+	}
+}
+
+static void SV_CullClientJob(client_t *client, svworker_t *worker)
+{
+	int i = client - svs.clients;
+
+	sv_numVisible[i] = SV_CullClientFrame(client, worker->pvs, sv_visible[i]);
+}
+
+/*
+ * The threaded SV_SendClientDatagram. The message is encoded
+ * into a buffer that is big enough for everything, an overflow
+ * is detected by its size afterwards.
+ */
+static void SV_SendClientJob(client_t *client, svworker_t *worker)
+{
+	int i = client - svs.clients;
+	sizebuf_t msg;
+	qboolean datagramOverflowed;
+
+	if (sv_numVisible[i] >= 0)
+	{
+		SV_StoreClientFrame(client, sv_visible[i], sv_numVisible[i]);
+	}
+
+	SZ_Init(&msg, worker->msgbuf, sizeof(worker->msgbuf));
+	msg.allowoverflow = true;
+
+	SV_WriteFrameToClient(client, &msg, worker->deltas);
+
+	datagramOverflowed = client->datagram.overflowed;
+
+	if (!datagramOverflowed)
+	{
+		SZ_Write(&msg, client->datagram.data, client->datagram.cursize);
+	}
+
+	SZ_Clear(&client->datagram);
+
+	Sys_LockMutex(sv_sendLock);
+
+	if (datagramOverflowed)
+	{
+		Com_Printf("WARNING: datagram overflowed for %s\n", client->name);
+		client->overflowDrops++;
+	}
+
+	if (msg.cursize > Netchan_MaxMessageLength(&client->netchan))
+	{
+		Com_Printf("WARNING: msg overflowed for %s\n", client->name);
+		client->overflowDrops++;
+		SZ_Clear(&msg);
+	}
+
+	Netchan_Transmit(&client->netchan, msg.cursize, msg.data);
+	client->message_size[sv.framenum % RATE_MESSAGES] = msg.cursize;
+
+	Sys_UnlockMutex(sv_sendLock);
+}
+
+/*
+ * Sends the datagrams of all clients in sv_jobClients, with
+ * the help of the worker threads. The room in the entity ring
+ * is handed out in between, in client order.
+ */
+static void SV_SendClientDatagrams(void)
+{
+	int workers;
+	int i;
+
+	workers = SV_StartWorkers();
+
+	SV_RunJobsOnWorkers(SV_CullClientJob, workers);
+
+	for (i = 0; i < sv_numJobClients; i++)
+	{
+		if (sv_numVisible[sv_jobClients[i] - svs.clients] >= 0)
+		{
+			SV_ReserveClientFrame(sv_jobClients[i],
+					sv_numVisible[sv_jobClients[i] - svs.clients]);
+		}
+	}
+
+	SV_RunJobsOnWorkers(SV_SendClientJob, workers);
+}
+
 void SV_DemoCompleted(void)
 {
 	if (sv.demofile)
@@ -490,6 +826,7 @@ qboolean SV_RateDrop(client_t *c)
 	if (total > c->rate)
 	{
 		c->surpressCount++;
+		c->rateDrops++;
 		c->message_size[sv.framenum % RATE_MESSAGES] = 0;
 		return true;
 	}
@@ -502,8 +839,9 @@ void SV_SendClientMessages()
 	int i;
 	client_t *c;
 	int msglen;
-	byte msgbuf[MAX_MSGLEN];
+	byte msgbuf[MAX_FRAGMSGLEN];
 	size_t r;
+	qboolean threaded;
 
 	msglen = 0;
 
@@ -533,10 +871,10 @@ void SV_SendClientMessages()
 				return;
 			}
 
-			if (msglen > MAX_MSGLEN)
+			if (msglen > (int)sizeof(msgbuf))
 			{
 				Com_Error(ERR_DROP,
-					"SV_SendClientMessages: msglen > MAX_MSGLEN");
+					"SV_SendClientMessages: msglen > MAX_FRAGMSGLEN");
 			}
 
 			r = FS_FRead(msgbuf, msglen, 1, sv.demofile);
@@ -549,6 +887,21 @@ void SV_SendClientMessages()
 		}
 	}
 
+	/* entities worth sending are the same for all clients */
+	if (sv.state == ss_game)
+	{
+		SV_BuildSendableEntities();
+	}
+
+	/* the worker threads need PVS and PHS rows that
+	   aren't overwritten by the next thread */
+	threaded = (sv_threads->value > 0) && (sv.state == ss_game) &&
+	           CM_ClusterVisCached();
+	sv_numJobClients = 0;
+
+	/* the datagrams go out together at the end */
+	NET_BeginPacketBatch(NS_SERVER);
+
 	/* send a message to each connected client */
 	for (i = 0, c = svs.clients; i < maxclients->value; i++, c++)
 	{
@@ -583,7 +936,14 @@ void SV_SendClientMessages()
 				continue;
 			}
 
-			SV_SendClientDatagram(c);
+			if (threaded)
+			{
+				sv_jobClients[sv_numJobClients++] = c;
+			}
+			else
+			{
+				SV_SendClientDatagram(c);
+			}
 		}
 		else
 		{
@@ -595,4 +955,21 @@ void SV_SendClientMessages()
 			}
 		}
 	}
+
+	if (sv_numJobClients)
+	{
+		SV_SendClientDatagrams();
+	}
+
+	/* windowed downloads go out in their own
+	   packets, after the reliable data */
+	for (i = 0, c = svs.clients; i < maxclients->value; i++, c++)
+	{
+		if (c->dlstream)
+		{
+			SV_SendDownloadChunks(c);
+		}
+	}
+
+	NET_FlushPackets(NS_SERVER);
 }
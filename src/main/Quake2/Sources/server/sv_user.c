@@ -26,10 +26,24 @@
 
 #include "server/server.h"
 
+#ifdef ZIP
+ #include "zlib.h"
+#endif
+
 #define MAX_STRINGCMDS 8
 
+#define SV_DLCHUNKSIZE (MAX_MSGLEN - 64) /* bytes of a svc_dlchunk on the wire */
+#define SV_DLRETRIES 50 /* resends before a windowed download is given up */
+
 edict_t *sv_player;
 
+#ifdef ZIP
+/* messages staged for a svc_zpacket */
+static byte sv_zstage_buf[MAX_ZPACKETSIZE];
+static int sv_zends[MAX_CONFIGSTRINGS]; /* staged size after each message */
+static int sv_znext[MAX_CONFIGSTRINGS]; /* where to continue after it */
+#endif
+
 void SV_BeginDemoserver(void)
 {
 	char name[MAX_OSPATH];
@@ -109,6 +123,136 @@ void SV_New_f(void)
 	}
 }
 
+#ifdef ZIP
+/*
+ * Compresses as many of the count staged messages as fit into
+ * the client's reliable message. Returns the configstring or
+ * baseline to continue with: end if all of them were sent, first
+ * if not even one fits.
+ */
+static int SV_WriteZPacket(sizebuf_t *stage, int count, int first, int end)
+{
+	byte packed[MAX_MSGLEN];
+	sizebuf_t *msg;
+	uLongf size;
+	int room;
+	int lo, hi, mid;
+	int sent;
+
+	msg = &sv_client->netchan.message;
+
+	/* leave space for the header and the next stufftext */
+	room = msg->maxsize - msg->cursize - 64;
+
+	if (room <= 0)
+	{
+		return first;
+	}
+
+	/* compressed sizes grow with the staged size,
+	   so search for the longest run that fits */
+	sent = 0;
+	lo = 1;
+	hi = count;
+
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		size = room;
+
+		if (compress2(packed, &size, stage->data, sv_zends[mid - 1],
+				Z_BEST_COMPRESSION) == Z_OK)
+		{
+			sent = mid;
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+
+	if (!sent)
+	{
+		return first;
+	}
+
+	size = room;
+	compress2(packed, &size, stage->data, sv_zends[sent - 1], Z_BEST_COMPRESSION);
+
+	MSG_WriteByte(msg, svc_zpacket);
+	MSG_WriteShort(msg, size);
+	MSG_WriteShort(msg, sv_zends[sent - 1]);
+	SZ_Write(msg, packed, size);
+
+	return (sent == count) ? end : sv_znext[sent - 1];
+}
+
+static int SV_ZConfigstrings(int start)
+{
+	sizebuf_t stage;
+	int first;
+	int count;
+
+	SZ_Init(&stage, sv_zstage_buf, sizeof(sv_zstage_buf));
+	first = start;
+	count = 0;
+
+	while (stage.cursize < stage.maxsize - MAX_MSGLEN &&
+	       start < MAX_CONFIGSTRINGS)
+	{
+		if (sv.configstrings[start][0])
+		{
+			MSG_WriteByte(&stage, svc_configstring);
+			MSG_WriteShort(&stage, start);
+			MSG_WriteString(&stage, sv.configstrings[start]);
+
+			sv_zends[count] = stage.cursize;
+			sv_znext[count] = start + 1;
+			count++;
+		}
+
+		start++;
+	}
+
+	return SV_WriteZPacket(&stage, count, first, start);
+}
+
+static int SV_ZBaselines(int start)
+{
+	sizebuf_t stage;
+	entity_state_t nullstate;
+	entity_state_t *base;
+	int first;
+	int count;
+
+	SZ_Init(&stage, sv_zstage_buf, sizeof(sv_zstage_buf));
+	memset(&nullstate, 0, sizeof(nullstate));
+	first = start;
+	count = 0;
+
+	while (stage.cursize < stage.maxsize - MAX_MSGLEN &&
+	       start < MAX_EDICTS)
+	{
+		base = &sv.baselines[start];
+
+		if (base->modelindex || base->sound || base->effects)
+		{
+			MSG_WriteByte(&stage, svc_spawnbaseline);
+			MSG_WriteDeltaEntity(&nullstate, base, &stage, true, true);
+
+			sv_zends[count] = stage.cursize;
+			sv_znext[count] = start + 1;
+			count++;
+		}
+
+		start++;
+	}
+
+	return SV_WriteZPacket(&stage, count, first, start);
+}
+#endif
+
 void SV_Configstrings_f(void)
 {
 	int start;
@@ -131,6 +275,15 @@ void SV_Configstrings_f(void)
 
 	start = (int)strtol(Cmd_Argv(2), (char **)NULL, 10);
 
+#ifdef ZIP
+	/* several packets worth, if the client can unpack them */
+	if ((sv_client->protocolext & PROTOCOL_EXT_ZPACKET) &&
+	    !sv_client->recording && (start >= 0) && (start < MAX_CONFIGSTRINGS))
+	{
+		start = SV_ZConfigstrings(start);
+	}
+#endif
+
 	/* write a packet full of data */
 	while (sv_client->netchan.message.cursize < MAX_MSGLEN / 2 &&
 	       start < MAX_CONFIGSTRINGS)
@@ -186,6 +339,15 @@ void SV_Baselines_f(void)
 	start = (int)strtol(Cmd_Argv(2), (char **)NULL, 10);
 	memset(&nullstate, 0, sizeof(nullstate));
 
+#ifdef ZIP
+	/* several packets worth, if the client can unpack them */
+	if ((sv_client->protocolext & PROTOCOL_EXT_ZPACKET) &&
+	    !sv_client->recording && (start >= 0) && (start < MAX_EDICTS))
+	{
+		start = SV_ZBaselines(start);
+	}
+#endif
+
 	/* write a packet full of data */
 	while (sv_client->netchan.message.cursize < MAX_MSGLEN / 2 &&
 	       start < MAX_EDICTS)
@@ -244,7 +406,8 @@ void SV_NextDownload_f(void)
 	int percent;
 	int size;
 
-	if (!sv_client->download)
+	/* windowed downloads aren't asked for chunk by chunk */
+	if (!sv_client->download || sv_client->dlstream)
 	{
 		return;
 	}
@@ -328,6 +491,7 @@ void SV_BeginDownload_f(void)
 		FS_FreeFile(sv_client->download);
 	}
 
+	sv_client->dlstream = 0;
 	sv_client->downloadsize = FS_LoadFile(name, (void **)&sv_client->download);
 	sv_client->downloadcount = offset;
 
@@ -352,10 +516,223 @@ void SV_BeginDownload_f(void)
 		return;
 	}
 
-	SV_NextDownload_f();
+#ifdef ZIP
+	/* clients with the extension name a stream for the
+	   chunks, empty files still go the old way */
+	if ((sv_client->protocolext & PROTOCOL_EXT_DLSTREAM) && (Cmd_Argc() > 3) &&
+	    (sv_client->downloadcount < sv_client->downloadsize))
+	{
+		sv_client->dlstream = (int)strtol(Cmd_Argv(3), (char **)NULL, 10) & 255;
+		sv_client->dlsent = sv_client->downloadcount;
+		sv_client->dlacked = sv_client->downloadcount;
+		sv_client->dlnumends = 0;
+		sv_client->dltime = svs.realtime;
+		sv_client->dlretries = 0;
+		sv_client->dlcredit = 0;
+		sv_client->dlclock = svs.realtime;
+	}
+#endif
+
+	if (!sv_client->dlstream)
+	{
+		SV_NextDownload_f();
+	}
+
 	Com_DPrintf("Downloading %s to %s\n", name, sv_client->name);
 }
 
+/*
+ * Sends the windowed download again from the last ack.
+ */
+static void SV_RewindDownload(client_t *cl)
+{
+	cl->dlsent = cl->dlacked;
+	cl->dlnumends = 0;
+	cl->dltime = svs.realtime;
+	cl->dlretries++;
+}
+
+/*
+ * Sends the next chunks of a windowed download. Every chunk is a
+ * packet of its own and isn't reliable, the client acks how much
+ * of the file it has written with clc_dlack and drops chunks that
+ * don't continue it. Up to sv_dlwindow chunks are in flight. If
+ * the acks stop, everything after the last one is sent again.
+ */
+void SV_SendDownloadChunks(client_t *cl)
+{
+#ifdef ZIP
+	byte data[MAX_MSGLEN];
+	byte packed[SV_DLCHUNKSIZE];
+	sizebuf_t msg;
+	uLongf size;
+	int length;
+	int window;
+	int rate;
+
+	if (!cl->download)
+	{
+		cl->dlstream = 0;
+		return;
+	}
+
+	/* nothing acked for a while, go back */
+	if ((cl->dlsent > cl->dlacked) &&
+	    (svs.realtime - cl->dltime > 2 * cl->ping + 200))
+	{
+		if (cl->dlretries >= SV_DLRETRIES)
+		{
+			Com_DPrintf("Download to %s timed out\n", cl->name);
+			FS_FreeFile(cl->download);
+			cl->download = NULL;
+			cl->dlstream = 0;
+			return;
+		}
+
+		SV_RewindDownload(cl);
+	}
+
+	/* up to a fifth of a second in bursts */
+	rate = (int)sv_dlrate->value;
+
+	if (rate > 0)
+	{
+		cl->dlcredit += (int)((long long)(svs.realtime - cl->dlclock) * rate / 1000);
+
+		if (cl->dlcredit > rate / 5)
+		{
+			cl->dlcredit = rate / 5;
+		}
+	}
+
+	cl->dlclock = svs.realtime;
+
+	window = (int)sv_dlwindow->value;
+
+	if (window < 1)
+	{
+		window = 1;
+	}
+	else if (window > SV_MAXDLWINDOW)
+	{
+		window = SV_MAXDLWINDOW;
+	}
+
+	/* a packet of reliable data has to wait for the next frame */
+	while ((cl->dlnumends < window) && (cl->dlsent < cl->downloadsize) &&
+	       ((rate <= 0) || (cl->dlcredit > 0)) &&
+	       !Netchan_NeedReliable(&cl->netchan))
+	{
+		/* as much of the file as fits compressed,
+		   or what fits as it is */
+		length = cl->downloadsize - cl->dlsent;
+
+		if (length > MAX_DLCHUNKSIZE)
+		{
+			length = MAX_DLCHUNKSIZE;
+		}
+
+		while (1)
+		{
+			size = sizeof(packed);
+
+			if ((compress2(packed, &size, cl->download + cl->dlsent,
+					 length, Z_DEFAULT_COMPRESSION) == Z_OK) && ((int)size < length))
+			{
+				break;
+			}
+
+			if (length <= SV_DLCHUNKSIZE)
+			{
+				size = 0;
+				break;
+			}
+
+			length /= 2;
+		}
+
+		if (cl->dlsent == cl->dlacked)
+		{
+			cl->dltime = svs.realtime;
+		}
+
+		SZ_Init(&msg, data, sizeof(data));
+		MSG_WriteByte(&msg, svc_dlchunk);
+		MSG_WriteByte(&msg, cl->dlstream);
+		MSG_WriteLong(&msg, cl->dlsent);
+		MSG_WriteShort(&msg, length);
+		MSG_WriteShort(&msg, size);
+		MSG_WriteByte(&msg, (int)((cl->dlsent + length) * 100.0 / cl->downloadsize));
+
+		if (size)
+		{
+			SZ_Write(&msg, packed, size);
+		}
+		else
+		{
+			SZ_Write(&msg, cl->download + cl->dlsent, length);
+		}
+
+		Netchan_Transmit(&cl->netchan, msg.cursize, msg.data);
+
+		cl->dlsent += length;
+		cl->dlends[cl->dlnumends++] = cl->dlsent;
+		cl->dlcredit -= msg.cursize;
+	}
+#endif
+}
+
+/*
+ * The client wrote the windowed download up to position.
+ */
+static void SV_DownloadAck(client_t *cl, int stream, int position)
+{
+	int i;
+
+	if (!cl->dlstream || (stream != cl->dlstream) ||
+	    (position < cl->dlacked) || (position > cl->downloadsize))
+	{
+		return; /* old */
+	}
+
+	if (position == cl->dlacked)
+	{
+		/* chunks arrived but none continued the file, so one
+		   got lost. Only until the acks move on again, as the
+		   rest of the window still arrives after going back. */
+		if ((cl->dlsent > cl->dlacked) && !cl->dlretries)
+		{
+			SV_RewindDownload(cl);
+		}
+
+		return;
+	}
+
+	cl->dlacked = position;
+	cl->dltime = svs.realtime;
+	cl->dlretries = 0;
+
+	/* chunks sent before going back may still arrive */
+	if (cl->dlsent < position)
+	{
+		cl->dlsent = position;
+	}
+
+	for (i = 0; i < cl->dlnumends && cl->dlends[i] <= position; i++)
+	{
+	}
+
+	cl->dlnumends -= i;
+	memmove(cl->dlends, cl->dlends + i, cl->dlnumends * sizeof(cl->dlends[0]));
+
+	if (position == cl->downloadsize)
+	{
+		FS_FreeFile(cl->download);
+		cl->download = NULL;
+		cl->dlstream = 0;
+	}
+}
+
 /*
  * The client is going to disconnect, so remove the connection immediately
  */
@@ -416,6 +793,17 @@ void SV_Nextserver_f(void)
 	SV_Nextserver();
 }
 
+/*
+ * Sent by clients that start or stop recording a demo. Stock
+ * clients can't play back messages longer than MAX_MSGLEN or
+ * svc_zpacket, so neither is sent while recording.
+ */
+void SV_Recording_f(void)
+{
+	sv_client->recording = ((int)strtol(Cmd_Argv(1), (char **)NULL, 10) != 0);
+	sv_client->netchan.fragments_paused = sv_client->recording;
+}
+
 typedef struct
 {
 	char *name;
@@ -431,6 +819,7 @@ ucmd_t ucmds[] =
 	{ "begin", SV_Begin_f },
 	{ "nextserver", SV_Nextserver_f },
 	{ "disconnect", SV_Disconnect_f },
+	{ "recording", SV_Recording_f },
 
 	/* issued by hand at client consoles */
 	{ "info", SV_ShowServerinfo_f },
@@ -495,6 +884,7 @@ void SV_ExecuteClientMessage(client_t *cl)
 	int checksumIndex;
 	qboolean move_issued;
 	int lastframe;
+	int stream;
 
 	sv_client = cl;
 	sv_player = sv_client->edict;
@@ -534,6 +924,11 @@ void SV_ExecuteClientMessage(client_t *cl)
 			SV_UserinfoChanged(cl);
 			break;
 
+		case clc_dlack:
+			stream = MSG_ReadByte(&net_message);
+			SV_DownloadAck(cl, stream, MSG_ReadLong(&net_message));
+			break;
+
 		case clc_move:
 
 			if (move_issued)
@@ -26,17 +26,33 @@
 
 #include "server/server.h"
 
-#define AREA_DEPTH 4
-#define AREA_NODES 32
+#define AREA_NODES 512 /* the tree grows in this pool during a map */
+#define AREA_MAXDEPTH 16
+#define AREA_LEAFSIZE 1024 /* the map is split until its nodes are this small */
+#define AREA_MINSIZE 128 /* nodes this small aren't split for crowds */
+#define AREA_SPLITCOUNT 12 /* edicts in a leaf that make it split */
+#define AREA_LOOSE 0.125f /* of a child, how far its edicts may cross the split */
+#define AREA_MINLOOSE 32 /* so a player box always fits a child */
 #define MAX_TOTAL_ENT_LEAFS 128
 
 #define STRUCT_FROM_LINK(l, t, m) ((t *)((byte *)l - (byte *)&(((t *)NULL)->m)))
 #define EDICT_FROM_AREA(l) STRUCT_FROM_LINK(l, edict_t, area)
 
+/*
+ * The area tree is loose: the children of a node overlap by
+ * its loose distance, so edicts crossing the split still go
+ * down unless they're larger than that. It's first split by
+ * the map size and then where the edicts crowd, each time a
+ * leaf gets more than AREA_SPLITCOUNT of them.
+ */
 typedef struct areanode_s
 {
 	int axis; /* -1 = leaf node */
 	float dist;
+	float loose;
+	int depth;
+	int numedicts; /* linked to this node */
+	vec3_t mins, maxs;
 	struct areanode_s *children[2];
 	link_t trigger_edicts;
 	link_t solid_edicts;
@@ -45,6 +61,17 @@ typedef struct areanode_s
 areanode_t sv_areanodes[AREA_NODES];
 int sv_numareanodes;
 
+/* the node each edict is linked to */
+static areanode_t *sv_edictareanodes[MAX_EDICTS];
+
+/* where the trace cache has to look again, see SV_Trace */
+static void SV_NoteLinkedBox(edict_t *ent, vec3_t absmin, vec3_t absmax);
+
+/* SV_AreaEdicts counters for sv_areastats */
+static int sv_areaqueries;
+static int sv_areatested;
+static int sv_areafound;
+
 float *area_mins, *area_maxs;
 edict_t **area_list;
 int area_count, area_maxcount;
@@ -72,14 +99,9 @@ void InsertLinkBefore(link_t *l, link_t *before)
 	l->next->prev = l;
 }
 
-/*
- * Builds a uniformly subdivided tree for the given world size
- */
-areanode_t* SV_CreateAreaNode(int depth, vec3_t mins, vec3_t maxs)
+static areanode_t *SV_CreateAreaNode(int depth, vec3_t mins, vec3_t maxs)
 {
 	areanode_t *anode;
-	vec3_t size;
-	vec3_t mins1, maxs1, mins2, maxs2;
 
 	anode = &sv_areanodes[sv_numareanodes];
 	sv_numareanodes++;
@@ -87,43 +109,346 @@ areanode_t* SV_CreateAreaNode(int depth, vec3_t mins, vec3_t maxs)
 	ClearLink(&anode->trigger_edicts);
 	ClearLink(&anode->solid_edicts);
 
-	if (depth == AREA_DEPTH)
+	anode->axis = -1;
+	anode->depth = depth;
+	anode->numedicts = 0;
+	anode->children[0] = anode->children[1] = NULL;
+	VectorCopy(mins, anode->mins);
+	VectorCopy(maxs, anode->maxs);
+
+	return anode;
+}
+
+static void SV_SplitAreaNode(areanode_t *anode, int axis, float dist)
+{
+	vec3_t mins1, maxs1, mins2, maxs2;
+	float size;
+
+	anode->axis = axis;
+	anode->dist = dist;
+
+	/* by the smaller child */
+	size = dist - anode->mins[axis];
+
+	if (anode->maxs[axis] - dist < size)
 	{
-		anode->axis = -1;
-		anode->children[0] = anode->children[1] = NULL;
-		return anode;
+		size = anode->maxs[axis] - dist;
 	}
 
-	VectorSubtract(maxs, mins, size);
+	anode->loose = size * AREA_LOOSE;
+
+	if (anode->loose < AREA_MINLOOSE)
+	{
+		anode->loose = AREA_MINLOOSE;
+	}
+
+	VectorCopy(anode->mins, mins1);
+	VectorCopy(anode->mins, mins2);
+	VectorCopy(anode->maxs, maxs1);
+	VectorCopy(anode->maxs, maxs2);
+
+	maxs1[axis] = mins2[axis] = dist;
+
+	anode->children[0] = SV_CreateAreaNode(anode->depth + 1, mins2, maxs2);
+	anode->children[1] = SV_CreateAreaNode(anode->depth + 1, mins1, maxs1);
+}
+
+/*
+ * Splits the map in half along x or y until
+ * the nodes are at most AREA_LEAFSIZE wide
+ */
+static void SV_BuildAreaNodes(areanode_t *anode)
+{
+	vec3_t size;
+	int axis;
+
+	VectorSubtract(anode->maxs, anode->mins, size);
 
 	if (size[0] > size[1])
 	{
-		anode->axis = 0;
+		axis = 0;
 	}
 	else
 	{
-		anode->axis = 1;
+		axis = 1;
+	}
+
+	if ((size[axis] <= AREA_LEAFSIZE) || (anode->depth == AREA_MAXDEPTH))
+	{
+		return;
 	}
 
-	anode->dist = 0.5f * (maxs[anode->axis] + mins[anode->axis]);
-	VectorCopy(mins, mins1);
-	VectorCopy(mins, mins2);
-	VectorCopy(maxs, maxs1);
-	VectorCopy(maxs, maxs2);
+	SV_SplitAreaNode(anode, axis,
+			0.5f * (anode->maxs[axis] + anode->mins[axis]));
+	SV_BuildAreaNodes(anode->children[0]);
+	SV_BuildAreaNodes(anode->children[1]);
+}
+
+/*
+ * Returns the deepest node below anode that holds the box
+ */
+static areanode_t *SV_AreaNodeForBox(areanode_t *anode, vec3_t absmin, vec3_t absmax)
+{
+	qboolean high, low;
 
-	maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
+	while (anode->axis != -1)
+	{
+		high = absmin[anode->axis] > anode->dist - anode->loose;
+		low = absmax[anode->axis] < anode->dist + anode->loose;
 
-	anode->children[0] = SV_CreateAreaNode(depth + 1, mins2, maxs2);
-	anode->children[1] = SV_CreateAreaNode(depth + 1, mins1, maxs1);
+		if (high && low)
+		{
+			/* fits both, go by the center */
+			high = absmin[anode->axis] + absmax[anode->axis] > 2 * anode->dist;
+			low = !high;
+		}
+
+		if (high)
+		{
+			anode = anode->children[0];
+		}
+		else
+		if (low)
+		{
+			anode = anode->children[1];
+		}
+		else
+		{
+			break; /* crosses the node */
+		}
+	}
 
 	return anode;
 }
 
+static void SV_AddAreaEdict(areanode_t *anode, edict_t *ent)
+{
+	if (ent->solid == SOLID_TRIGGER)
+	{
+		InsertLinkBefore(&ent->area, &anode->trigger_edicts);
+	}
+	else
+	{
+		InsertLinkBefore(&ent->area, &anode->solid_edicts);
+	}
+
+	anode->numedicts++;
+	sv_edictareanodes[NUM_FOR_EDICT(ent)] = anode;
+}
+
+/*
+ * Moves the edicts of a list down to the
+ * new children of the node where they fit
+ */
+static void SV_PushAreaEdicts(areanode_t *anode, link_t *start)
+{
+	link_t *l, *next;
+	areanode_t *child;
+	edict_t *check;
+
+	for (l = start->next; l != start; l = next)
+	{
+		next = l->next;
+		check = EDICT_FROM_AREA(l);
+		child = SV_AreaNodeForBox(anode, check->absmin, check->absmax);
+
+		if (child == anode)
+		{
+			continue;
+		}
+
+		RemoveLink(l);
+		anode->numedicts--;
+
+		if (start == &anode->trigger_edicts)
+		{
+			InsertLinkBefore(l, &child->trigger_edicts);
+		}
+		else
+		{
+			InsertLinkBefore(l, &child->solid_edicts);
+		}
+
+		child->numedicts++;
+		sv_edictareanodes[NUM_FOR_EDICT(check)] = child;
+	}
+}
+
+static void SV_AreaCenters(link_t *start, int axis, float *sum, int *count)
+{
+	link_t *l;
+	edict_t *check;
+
+	for (l = start->next; l != start; l = l->next)
+	{
+		check = EDICT_FROM_AREA(l);
+		*sum += 0.5f * (check->absmin[axis] + check->absmax[axis]);
+		(*count)++;
+	}
+}
+
+/*
+ * Splits a crowded leaf along its longest axis at the
+ * mean of the edicts, within the middle half of it
+ */
+static void SV_DivideAreaNode(areanode_t *anode)
+{
+	vec3_t size;
+	float dist, sum;
+	int axis, count;
+
+	if ((anode->depth == AREA_MAXDEPTH) ||
+		(sv_numareanodes + 2 > AREA_NODES))
+	{
+		return;
+	}
+
+	VectorSubtract(anode->maxs, anode->mins, size);
+	axis = 0;
+
+	if (size[1] > size[axis])
+	{
+		axis = 1;
+	}
+
+	if (size[2] > size[axis])
+	{
+		axis = 2;
+	}
+
+	if (size[axis] < 2 * AREA_MINSIZE)
+	{
+		return;
+	}
+
+	sum = 0;
+	count = 0;
+	SV_AreaCenters(&anode->trigger_edicts, axis, &sum, &count);
+	SV_AreaCenters(&anode->solid_edicts, axis, &sum, &count);
+
+	dist = sum / count;
+
+	if (dist < anode->mins[axis] + size[axis] * 0.25f)
+	{
+		dist = anode->mins[axis] + size[axis] * 0.25f;
+	}
+	else
+	if (dist > anode->maxs[axis] - size[axis] * 0.25f)
+	{
+		dist = anode->maxs[axis] - size[axis] * 0.25f;
+	}
+
+	SV_SplitAreaNode(anode, axis, dist);
+	SV_PushAreaEdicts(anode, &anode->trigger_edicts);
+	SV_PushAreaEdicts(anode, &anode->solid_edicts);
+}
+
 void SV_ClearWorld(void)
 {
 	memset(sv_areanodes, 0, sizeof(sv_areanodes));
+	memset(sv_edictareanodes, 0, sizeof(sv_edictareanodes));
 	sv_numareanodes = 0;
+	sv_areaqueries = sv_areatested = sv_areafound = 0;
+	SV_ClearTraceCache();
+
 	SV_CreateAreaNode(0, sv.models[1]->mins, sv.models[1]->maxs);
+	SV_BuildAreaNodes(sv_areanodes);
+}
+
+static void SV_AreaStats_r(areanode_t *anode, int *leafs, int *depth)
+{
+	static const char *axes[] = {"x", "y", "z"};
+	link_t *l;
+	int triggers, solids;
+
+	triggers = solids = 0;
+
+	for (l = anode->trigger_edicts.next; l != &anode->trigger_edicts; l = l->next)
+	{
+		triggers++;
+	}
+
+	for (l = anode->solid_edicts.next; l != &anode->solid_edicts; l = l->next)
+	{
+		solids++;
+	}
+
+	if (anode->depth > *depth)
+	{
+		*depth = anode->depth;
+	}
+
+	if (anode->axis == -1)
+	{
+		(*leafs)++;
+	}
+
+	if (triggers || solids)
+	{
+		if (anode->axis == -1)
+		{
+			Com_Printf("%3i %*sleaf        %4i %4i\n", (int)(anode - sv_areanodes),
+					anode->depth * 2, "", triggers, solids);
+		}
+		else
+		{
+			Com_Printf("%3i %*s%s %7.0f  %4i %4i\n", (int)(anode - sv_areanodes),
+					anode->depth * 2, "", axes[anode->axis], anode->dist,
+					triggers, solids);
+		}
+	}
+
+	if (anode->axis != -1)
+	{
+		SV_AreaStats_r(anode->children[0], leafs, depth);
+		SV_AreaStats_r(anode->children[1], leafs, depth);
+	}
+}
+
+/*
+ * Prints the edicts linked to each node
+ * and how the queries did since the last call
+ */
+void SV_AreaStats_f(void)
+{
+	int leafs, depth;
+
+	if (!sv_numareanodes)
+	{
+		Com_Printf("No map loaded.\n");
+		return;
+	}
+
+	leafs = depth = 0;
+
+	Com_Printf("node split        trig  sol\n");
+	SV_AreaStats_r(sv_areanodes, &leafs, &depth);
+	Com_Printf("%i nodes, %i leafs, %i deep\n", sv_numareanodes, leafs, depth);
+
+	if (sv_areaqueries)
+	{
+		Com_Printf("%i queries, %.1f edicts tested and %.1f found per query\n",
+				sv_areaqueries, (float)sv_areatested / sv_areaqueries,
+				(float)sv_areafound / sv_areaqueries);
+	}
+
+	sv_areaqueries = sv_areatested = sv_areafound = 0;
+}
+
+static void SV_RemoveAreaEdict(edict_t *ent)
+{
+	areanode_t *anode;
+
+	RemoveLink(&ent->area);
+	ent->area.prev = ent->area.next = NULL;
+
+	anode = sv_edictareanodes[NUM_FOR_EDICT(ent)];
+
+	if (anode)
+	{
+		anode->numedicts--;
+		sv_edictareanodes[NUM_FOR_EDICT(ent)] = NULL;
+	}
 }
 
 void SV_UnlinkEdict(edict_t *ent)
@@ -133,8 +458,8 @@ void SV_UnlinkEdict(edict_t *ent)
 		return; /* not linked in anywhere */
 	}
 
-	RemoveLink(&ent->area);
-	ent->area.prev = ent->area.next = NULL;
+	SV_RemoveAreaEdict(ent);
+	SV_NoteLinkedBox(ent, ent->absmin, ent->absmax);
 }
 
 void SV_LinkEdict(edict_t *ent)
@@ -146,10 +471,16 @@ void SV_LinkEdict(edict_t *ent)
 	int i, j, k;
 	int area;
 	int topnode;
+	vec3_t linkmin, linkmax; /* old and new abs box */
+
+	ClearBounds(linkmin, linkmax);
 
 	if (ent->area.prev)
 	{
-		SV_UnlinkEdict(ent); /* unlink from old position */
+		/* unlink from old position */
+		SV_RemoveAreaEdict(ent);
+		VectorCopy(ent->absmin, linkmin);
+		VectorCopy(ent->absmax, linkmax);
 	}
 
 	if (ent == ge->edicts)
@@ -159,6 +490,7 @@ void SV_LinkEdict(edict_t *ent)
 
 	if (!ent->inuse)
 	{
+		SV_NoteLinkedBox(ent, linkmin, linkmax);
 		return;
 	}
 
@@ -356,42 +688,23 @@ void SV_LinkEdict(edict_t *ent)
 
 	if (ent->solid == SOLID_NOT)
 	{
+		SV_NoteLinkedBox(ent, linkmin, linkmax);
 		return;
 	}
 
-	/* find the first node that the ent's box crosses */
-	node = sv_areanodes;
+	/* find the deepest node that holds the ent's box */
+	node = SV_AreaNodeForBox(sv_areanodes, ent->absmin, ent->absmax);
 
-	while (1)
-	{
-		if (node->axis == -1)
-		{
-			break;
-		}
+	/* link it in */
+	SV_AddAreaEdict(node, ent);
 
-		if (ent->absmin[node->axis] > node->dist)
-		{
-			node = node->children[0];
-		}
-		else
-		if (ent->absmax[node->axis] < node->dist)
-		{
-			node = node->children[1];
-		}
-		else
-		{
-			break; /* crosses the node */
-		}
-	}
+	AddPointToBounds(ent->absmin, linkmin, linkmax);
+	AddPointToBounds(ent->absmax, linkmin, linkmax);
+	SV_NoteLinkedBox(ent, linkmin, linkmax);
 
-	/* link it in */
-	if (ent->solid == SOLID_TRIGGER)
-	{
-		InsertLinkBefore(&ent->area, &node->trigger_edicts);
-	}
-	else
+	if ((node->axis == -1) && (node->numedicts > AREA_SPLITCOUNT))
 	{
-		InsertLinkBefore(&ent->area, &node->solid_edicts);
+		SV_DivideAreaNode(node);
 	}
 }
 
@@ -414,6 +727,7 @@ void SV_AreaEdicts_r(areanode_t *node)
 	{
 		next = l->next;
 		check = (EDICT_FROM_AREA(l));
+		sv_areatested++;
 
 		if (check->solid == SOLID_NOT)
 		{
@@ -445,13 +759,14 @@ void SV_AreaEdicts_r(areanode_t *node)
 		return; /* terminal node */
 	}
 
-	/* recurse down both sides */
-	if (area_maxs[node->axis] > node->dist)
+	/* recurse down both sides, their edicts
+	   may reach past the split by loose */
+	if (area_maxs[node->axis] > node->dist - node->loose)
 	{
 		SV_AreaEdicts_r(node->children[0]);
 	}
 
-	if (area_mins[node->axis] < node->dist)
+	if (area_mins[node->axis] < node->dist + node->loose)
 	{
 		SV_AreaEdicts_r(node->children[1]);
 	}
@@ -468,6 +783,9 @@ int SV_AreaEdicts(vec3_t mins, vec3_t maxs, edict_t **list, int maxcount, int ar
 
 	SV_AreaEdicts_r(sv_areanodes);
 
+	sv_areaqueries++;
+	sv_areafound += area_count;
+
 	area_mins = 0;
 	area_maxs = 0;
 	area_list = 0;
@@ -544,22 +862,96 @@ int SV_HullForEntity(edict_t *ent)
 	return CM_HeadnodeForBox(ent->mins, ent->maxs);
 }
 
-void SV_ClipMoveToEntities(moveclip_t *clip)
+typedef struct
 {
-	int i, num;
-	edict_t *touchlist[MAX_EDICTS], *touch;
-	trace_t trace;
-	int headnode;
-	float *angles;
+	edict_t *ent;
+	float enter; /* fraction of the move where it reaches the absbox */
+} clipcandidate_t;
+
+/* the lists of SV_ClipMoveToEntities, kept here instead
+   of the stack. Traces only run on the main thread. */
+static edict_t *sv_touchlist[MAX_EDICTS];
+static clipcandidate_t sv_candidates[MAX_EDICTS];
+
+/*
+ * Returns the fraction of the move where the mins/maxs box
+ * reaches the absbox of ent, or -1 if it never does. Inside
+ * it at the start that's 0.
+ */
+static float SV_EnterAbsBox(moveclip_t *clip, edict_t *ent, float *mins,
+		float *maxs)
+{
+	float enter, exit;
+	float lo, hi, dir, t1, t2;
+	int i;
+
+	enter = 0;
+	exit = 1;
 
-	num = SV_AreaEdicts(clip->boxmins, clip->boxmaxs, touchlist,
+	for (i = 0; i < 3; i++)
+	{
+		/* the absbox grown by the mover */
+		lo = ent->absmin[i] - maxs[i];
+		hi = ent->absmax[i] - mins[i];
+		dir = clip->end[i] - clip->start[i];
+
+		if (dir == 0)
+		{
+			if ((clip->start[i] < lo) || (clip->start[i] > hi))
+			{
+				return -1;
+			}
+
+			continue;
+		}
+
+		t1 = (lo - clip->start[i]) / dir;
+		t2 = (hi - clip->start[i]) / dir;
+
+		if (t1 > t2)
+		{
+			float t = t1;
+
+			t1 = t2;
+			t2 = t;
+		}
+
+		if (t1 > enter)
+		{
+			enter = t1;
+		}
+
+		if (t2 < exit)
+		{
+			exit = t2;
+		}
+
+		if (enter > exit)
+		{
+			return -1;
+		}
+	}
+
+	return enter;
+}
+
+/*
+ * Fills sv_candidates with the edicts the move may clip
+ * against, sorted by where it reaches their absboxes
+ */
+static int SV_ClipCandidates(moveclip_t *clip)
+{
+	int i, j, num, count;
+	edict_t *touch;
+	float enter;
+
+	num = SV_AreaEdicts(clip->boxmins, clip->boxmaxs, sv_touchlist,
 			MAX_EDICTS, AREA_SOLID);
+	count = 0;
 
-	/* be careful, it is possible to have an entity in this
-	   list removed before we get to it (killtriggered) */
 	for (i = 0; i < num; i++)
 	{
-		touch = touchlist[i];
+		touch = sv_touchlist[i];
 
 		if (touch->solid == SOLID_NOT)
 		{
@@ -571,11 +963,6 @@ void SV_ClipMoveToEntities(moveclip_t *clip)
 			continue;
 		}
 
-		if (clip->trace.allsolid)
-		{
-			return;
-		}
-
 		if (clip->passedict)
 		{
 			if (touch->owner == clip->passedict)
@@ -595,6 +982,66 @@ void SV_ClipMoveToEntities(moveclip_t *clip)
 			continue;
 		}
 
+		/* the hull is inside the absbox, which is an epsilon
+		   larger, so a move missing the absbox misses the hull */
+		if (touch->svflags & SVF_MONSTER)
+		{
+			enter = SV_EnterAbsBox(clip, touch, clip->mins2,
+					clip->maxs2);
+		}
+		else
+		{
+			enter = SV_EnterAbsBox(clip, touch, clip->mins,
+					clip->maxs);
+		}
+
+		if (enter < 0)
+		{
+			continue;
+		}
+
+		/* insertion sort, there are few and it
+		   keeps the area order of equal ones */
+		for (j = count; j > 0 && sv_candidates[j - 1].enter > enter; j--)
+		{
+			sv_candidates[j] = sv_candidates[j - 1];
+		}
+
+		sv_candidates[j].ent = touch;
+		sv_candidates[j].enter = enter;
+		count++;
+	}
+
+	return count;
+}
+
+void SV_ClipMoveToEntities(moveclip_t *clip)
+{
+	int i, num;
+	edict_t *touch;
+	trace_t trace;
+	int headnode;
+	float *angles;
+
+	num = SV_ClipCandidates(clip);
+
+	for (i = 0; i < num; i++)
+	{
+		touch = sv_candidates[i].ent;
+
+		if (clip->trace.allsolid)
+		{
+			return;
+		}
+
+		/* this and the rest are reached only after the closest
+		   hit, and the move started outside them. Not culled
+		   before, a startsolid clip can still move the hit on. */
+		if (sv_candidates[i].enter > clip->trace.fraction)
+		{
+			return;
+		}
+
 		/* might intersect, so do an exact clip */
 		headnode = SV_HullForEntity(touch);
 		angles = touch->s.angles;
@@ -660,23 +1107,141 @@ void SV_TraceBounds(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, vec3_t b
 }
 
 /*
- * Moves the given mins/maxs volume through the world from start to end.
- * Passedict and edicts owned by passedict are explicitly not checked.
+ * With sv_tracecache identical traces are answered from a table
+ * until the next game frame or until an edict is linked or
+ * unlinked inside the bounds of the move. Monster AI traces the
+ * same lines over and over. The game changing an owner or svflags
+ * without relinking isn't seen, which is why the cache is optional.
  */
-trace_t SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, edict_t *passedict, int contentmask)
+#define SV_TRACECACHE 512 /* must be a power of two */
+#define SV_TRACELINKS 1024 /* linked boxes per frame, more clear the cache */
+#define SV_TRACECHECKS 32 /* links a memo is checked against at most */
+
+typedef struct
 {
-	moveclip_t clip;
+	edict_t *passedict;
+	vec3_t start, end;
+	vec3_t mins, maxs;
+	int contentmask;
+	int generation; /* sv_tracegeneration */
+} tracekey_t;
 
-	if (!mins)
+typedef struct
+{
+	tracekey_t key;
+	vec3_t boxmins, boxmaxs; /* of the entire move */
+	int firstlinked; /* first of the sv_linkedboxes made after it */
+	trace_t trace;
+} tracememo_t;
+
+/* where an edict was unlinked from or linked into */
+typedef struct
+{
+	edict_t *ent;
+	vec3_t absmin, absmax;
+} linkedbox_t;
+
+static tracememo_t sv_tracememos[SV_TRACECACHE];
+
+/* boxes linked or unlinked this generation, in order */
+static linkedbox_t sv_linkedboxes[SV_TRACELINKS];
+static int sv_numlinkedboxes;
+
+/* bumped to drop every cached trace at once */
+static int sv_tracegeneration = 1; /* zeroed memos are stale */
+
+void SV_ClearTraceCache(void)
+{
+	sv_tracegeneration++;
+	sv_numlinkedboxes = 0;
+}
+
+/*
+ * Notes that something may have changed inside the box.
+ * Memos are checked against it when they are hit, which
+ * keeps linking cheap.
+ */
+static void SV_NoteLinkedBox(edict_t *ent, vec3_t absmin, vec3_t absmax)
+{
+	linkedbox_t *box;
+
+	if (absmin[0] > absmax[0])
 	{
-		mins = vec3_origin;
+		return; /* cleared bounds, it wasn't linked */
 	}
 
-	if (!maxs)
+	if (sv_numlinkedboxes == SV_TRACELINKS)
 	{
-		maxs = vec3_origin;
+		SV_ClearTraceCache();
+	}
+
+	box = &sv_linkedboxes[sv_numlinkedboxes++];
+	box->ent = ent;
+	VectorCopy(absmin, box->absmin);
+	VectorCopy(absmax, box->absmax);
+}
+
+/*
+ * Tells whether an edict was linked into or unlinked from
+ * the bounds of the memo's move since it was made.
+ */
+static qboolean SV_TraceMemoDropped(const tracememo_t *memo)
+{
+	const linkedbox_t *box;
+	int i;
+
+	if (sv_numlinkedboxes - memo->firstlinked > SV_TRACECHECKS)
+	{
+		return true; /* cheaper to trace again */
 	}
 
+	for (i = memo->firstlinked; i < sv_numlinkedboxes; i++)
+	{
+		box = &sv_linkedboxes[i];
+
+		if ((memo->boxmins[0] > box->absmax[0]) ||
+		    (memo->boxmins[1] > box->absmax[1]) ||
+		    (memo->boxmins[2] > box->absmax[2]) ||
+		    (memo->boxmaxs[0] < box->absmin[0]) ||
+		    (memo->boxmaxs[1] < box->absmin[1]) ||
+		    (memo->boxmaxs[2] < box->absmin[2]))
+		{
+			continue; /* can't be in the way */
+		}
+
+		if (box->ent != memo->key.passedict)
+		{
+			return true; /* the passedict is never clipped against */
+		}
+	}
+
+	return false;
+}
+
+static tracememo_t *SV_TraceMemo(const tracekey_t *key)
+{
+	const byte *b;
+	unsigned hash;
+	int i;
+
+	b = (const byte *)key;
+	hash = 2166136261u;
+
+	for (i = 0; i < (int)sizeof(*key); i++)
+	{
+		hash = (hash ^ b[i]) * 16777619u;
+	}
+
+	return &sv_tracememos[(hash ^ (hash >> 16)) & (SV_TRACECACHE - 1)];
+}
+
+/*
+ * SV_Trace without the cache
+ */
+static trace_t SV_ClipTrace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, edict_t *passedict, int contentmask)
+{
+	moveclip_t clip;
+
 	memset(&clip, 0, sizeof(moveclip_t));
 
 	/* clip to world */
@@ -707,3 +1272,57 @@ trace_t SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, edict_t *pa
 
 	return clip.trace;
 }
+
+/*
+ * Moves the given mins/maxs volume through the world from start to end.
+ * Passedict and edicts owned by passedict are explicitly not checked.
+ */
+trace_t SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, edict_t *passedict, int contentmask)
+{
+	tracekey_t key;
+	tracememo_t *memo;
+
+	if (!mins)
+	{
+		mins = vec3_origin;
+	}
+
+	if (!maxs)
+	{
+		maxs = vec3_origin;
+	}
+
+	if (!sv_tracecache->value)
+	{
+		return SV_ClipTrace(start, mins, maxs, end, passedict, contentmask);
+	}
+
+	/* zeroed, so the padding compares too */
+	memset(&key, 0, sizeof(key));
+	key.passedict = passedict;
+	VectorCopy(start, key.start);
+	VectorCopy(end, key.end);
+	VectorCopy(mins, key.mins);
+	VectorCopy(maxs, key.maxs);
+	key.contentmask = contentmask;
+	key.generation = sv_tracegeneration;
+
+	memo = SV_TraceMemo(&key);
+
+	if (!memcmp(&memo->key, &key, sizeof(key)) && !SV_TraceMemoDropped(memo))
+	{
+#ifndef DEDICATED_ONLY
+		extern int c_cachedtraces;
+
+		c_cachedtraces++;
+#endif
+		return memo->trace;
+	}
+
+	memo->trace = SV_ClipTrace(start, mins, maxs, end, passedict, contentmask);
+	memo->key = key;
+	memo->firstlinked = sv_numlinkedboxes;
+	SV_TraceBounds(start, mins, maxs, end, memo->boxmins, memo->boxmaxs);
+
+	return memo->trace;
+}